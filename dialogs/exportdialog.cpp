@@ -487,6 +487,9 @@ void ExportDialog::on_pushButton_clicked()
             et->audio_bitrate = ui->audiobitrateSpinbox->value();
         }
 
+        et->start_frame = 0;
+        et->end_frame = sequence->getEndFrame();
+        et->gl_context = NULL;
         et->ed = this;
         cancelled = false;
 
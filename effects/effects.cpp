@@ -5,6 +5,12 @@
 #include <QVector>
 #include <QDebug>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 QVector<QString> video_effect_names;
 QVector<QString> audio_effect_names;
 
@@ -34,3 +40,27 @@ Effect* create_effect(int effect_id, Clip* c) {
     qDebug() << "[ERROR] Invalid effect ID";
     return NULL;
 }
+
+void apply_gain_ramp(float* samples, int nb_samples, float from, float to) {
+    float step = (to - from) / qMax(1, nb_samples);
+    int i = 0;
+#if defined(__SSE2__)
+    __m128 gain = _mm_setr_ps(from, from+step, from+step*2, from+step*3);
+    __m128 gain_step = _mm_set1_ps(step*4);
+    for (;i+4<=nb_samples;i+=4) {
+        _mm_storeu_ps(samples+i, _mm_mul_ps(_mm_loadu_ps(samples+i), gain));
+        gain = _mm_add_ps(gain, gain_step);
+    }
+#elif defined(__ARM_NEON)
+    float start[4] = {from, from+step, from+step*2, from+step*3};
+    float32x4_t gain = vld1q_f32(start);
+    float32x4_t gain_step = vdupq_n_f32(step*4);
+    for (;i+4<=nb_samples;i+=4) {
+        vst1q_f32(samples+i, vmulq_f32(vld1q_f32(samples+i), gain));
+        gain = vaddq_f32(gain, gain_step);
+    }
+#endif
+    for (;i<nb_samples;i++) {
+        samples[i] *= from + step*i;
+    }
+}
@@ -26,6 +26,10 @@ extern QVector<QString> audio_effect_names;
 void init_effects();
 Effect* create_effect(int effect_id, Clip* c);
 
+// multiplies a block of samples by a gain moving linearly from `from` to `to` across it, so a
+// setting that's changed since the last block glides to its new value instead of clicking
+void apply_gain_ramp(float* samples, int nb_samples, float from, float to);
+
 // video effects
 class TransformEffect : public Effect {
 	Q_OBJECT
@@ -86,23 +90,28 @@ private:
 class VolumeEffect : public Effect {
 public:
     VolumeEffect(Clip* c);
-    void process_audio(quint8* samples, int nb_bytes);
+    void process_audio(float** samples, int channels, int nb_samples);
     Effect* copy(Clip* c);
     void load(QXmlStreamReader* stream);
     void save(QXmlStreamWriter* stream);
 
     LabelSlider* volume_val;
+private:
+    float last_gain; // where the previous block's ramp ended, -1 before the first block
 };
 
 class PanEffect : public Effect {
 public:
     PanEffect(Clip* c);
-    void process_audio(quint8* samples, int nb_bytes);
+    void process_audio(float** samples, int channels, int nb_samples);
     Effect* copy(Clip* c);
     void load(QXmlStreamReader* stream);
     void save(QXmlStreamWriter* stream);
 
     LabelSlider* pan_val;
+private:
+    float last_left; // where the previous block's ramps ended, -1 before the first block
+    float last_right;
 };
 
 #endif // EFFECTS_H
@@ -10,6 +10,8 @@
 
 PanEffect::PanEffect(Clip* c) : Effect(c) {
     setup_effect(EFFECT_TYPE_AUDIO, AUDIO_PAN_EFFECT);
+    last_left = -1;
+    last_right = -1;
 
     QGridLayout* ui_layout = new QGridLayout();
 
@@ -47,25 +49,22 @@ void PanEffect::save(QXmlStreamWriter *stream) {
     stream->writeTextElement("pan", QString::number(pan_val->value()));
 }
 
-void PanEffect::process_audio(quint8 *samples, int nb_bytes) {
-    if (pan_val->value() != 0) {
-        for (int i=0;i<nb_bytes;i+=4) {
-            qint16 left_sample = (qint16) (((samples[i+1] & 0xFF) << 8) | (samples[i] & 0xFF));
-            qint16 right_sample = (qint16) (((samples[i+3] & 0xFF) << 8) | (samples[i+2] & 0xFF));
+void PanEffect::process_audio(float** samples, int channels, int nb_samples) {
+    if (channels < 2) return;
 
-            float val = qPow(pan_val->value()*0.01f, 3);
-            if (val < 0) {
-                // affect right channel
-                right_sample *= (1-std::abs(val));
-            } else {
-                // affect left channel
-                left_sample *= (1-val);
-            }
-
-            samples[i+3] = (quint8) (right_sample >> 8);
-            samples[i+2] = (quint8) right_sample;
-            samples[i+1] = (quint8) (left_sample >> 8);
-            samples[i] = (quint8) left_sample;
-        }
+    // panning one way turns the other channel down, worked out once per block and ramped
+    // to from the last block's so moving the slider doesn't zipper
+    float val = qPow(pan_val->value()*0.01f, 3);
+    float left = (val > 0) ? 1-val : 1;
+    float right = (val < 0) ? 1-std::abs(val) : 1;
+    float from_left = (last_left < 0) ? left : last_left;
+    float from_right = (last_right < 0) ? right : last_right;
+    if (from_left != 1.0f || left != 1.0f) {
+        apply_gain_ramp(samples[0], nb_samples, from_left, left);
+    }
+    if (from_right != 1.0f || right != 1.0f) {
+        apply_gain_ramp(samples[1], nb_samples, from_right, right);
     }
+    last_left = left;
+    last_right = right;
 }
@@ -11,6 +11,7 @@
 
 VolumeEffect::VolumeEffect(Clip* c) : Effect(c) {
     setup_effect(EFFECT_TYPE_AUDIO, AUDIO_VOLUME_EFFECT);
+    last_gain = -1;
 
 	QGridLayout* ui_layout = new QGridLayout();
 
@@ -48,20 +49,14 @@ void VolumeEffect::save(QXmlStreamWriter* stream) {
     stream->writeTextElement("volume", QString::number(volume_val->value()));
 }
 
-void VolumeEffect::process_audio(quint8* samples, int nb_bytes) {
-    if (volume_val->value() != 100) {
-        for (int i=0;i<nb_bytes;i+=2) {
-            qint32 samp = (qint16) (((samples[i+1] & 0xFF) << 8) | (samples[i] & 0xFF));
-            double val = qPow(volume_val->value()*0.01, 3);
-            samp *= val;
-            if (samp > INT16_MAX) {
-                samp = INT16_MAX;
-            } else if (samp < INT16_MIN) {
-                samp = INT16_MIN;
-            }
-
-            samples[i+1] = (quint8) (samp >> 8);
-            samples[i] = (quint8) samp;
+void VolumeEffect::process_audio(float** samples, int channels, int nb_samples) {
+    // worked out once per block and ramped to from the last block's, so moving the slider doesn't zipper
+    float gain = qPow(volume_val->value()*0.01, 3);
+    float from = (last_gain < 0) ? gain : last_gain;
+    if (from != 1.0f || gain != 1.0f) {
+        for (int i=0;i<channels;i++) {
+            apply_gain_ramp(samples[i], nb_samples, from, gain);
         }
     }
+    last_gain = gain;
 }
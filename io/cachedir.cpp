@@ -0,0 +1,36 @@
+#include "cachedir.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <algorithm>
+
+static QDateTime get_last_used(const QFileInfo& info) {
+    // reads only count where the filesystem records them, writes always do
+    return qMax(info.lastRead(), info.lastModified());
+}
+
+static bool less_recently_used(const QFileInfo& a, const QFileInfo& b) {
+    return get_last_used(a) < get_last_used(b);
+}
+
+void trim_cache_dir(const QString& path, qint64 max_bytes, const QString& keep) {
+    QFileInfoList files = QDir(path).entryInfoList(QDir::Files, QDir::NoSort);
+
+    qint64 total = 0;
+    for (int i=0;i<files.size();i++) {
+        total += files.at(i).size();
+    }
+    if (total <= max_bytes) return;
+
+    std::sort(files.begin(), files.end(), less_recently_used);
+    QString keep_path = keep.isEmpty() ? QString() : QFileInfo(keep).absoluteFilePath();
+    for (int i=0;i<files.size() && total > max_bytes;i++) {
+        const QFileInfo& info = files.at(i);
+        if (info.absoluteFilePath() == keep_path || info.fileName().endsWith(".part")) continue;
+
+        // another generator may have trimmed it first, or (on Windows) it may be open
+        if (QFile::remove(info.absoluteFilePath())) total -= info.size();
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef CACHEDIR_H
+#define CACHEDIR_H
+
+#include <QString>
+
+// the generators keep their output (waveforms, conformed audio) in directories under
+// QStandardPaths::CacheLocation, named after the source so it's reused next session.
+// nothing else ever deletes them, so each directory is capped at a size
+
+// deletes the least recently used files in path until it's under max_bytes. keep (e.g. the
+// file that was just written) and unfinished ".part" files are left alone
+void trim_cache_dir(const QString& path, qint64 max_bytes, const QString& keep = QString());
+
+#endif // CACHEDIR_H
@@ -0,0 +1,229 @@
+#include "cliexport.h"
+
+#include "io/exportthread.h"
+#include "project/sequence.h"
+#include "panels/panels.h"
+#include "panels/project.h"
+#include "panels/viewer.h"
+#include "ui/viewerwidget.h"
+#include "playback/playback.h"
+
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QOpenGLContext>
+#include <QTextStream>
+#include <QFileInfo>
+#include <QDebug>
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+	#include <libavcodec/avcodec.h>
+	#include <libavformat/avformat.h>
+}
+
+#define CLI_DEFAULT_VIDEO_BITRATE 2.0 // Mbps, same as the export dialog
+#define CLI_DEFAULT_AUDIO_BITRATE 320 // Kbps
+
+static void print_line(const QString& line) {
+    QTextStream out(stdout);
+    out << line << "\n";
+    out.flush();
+}
+
+static bool find_codec(const QString& name, int type, AVOutputFormat* ofmt, const char* filename, int* codec) {
+    // named encoder if given, otherwise the container's default (none disables the stream)
+    if (!name.isEmpty()) {
+        if (name == "none") {
+            *codec = AV_CODEC_ID_NONE;
+            return true;
+        }
+        QByteArray ba = name.toUtf8();
+        AVCodec* c = avcodec_find_encoder_by_name(ba.constData());
+        if (c == NULL || c->type != type) {
+            print_line("error=\"unknown encoder " + name + "\"");
+            return false;
+        }
+        *codec = c->id;
+    } else {
+        *codec = av_guess_codec(ofmt, NULL, filename, NULL, static_cast<AVMediaType>(type));
+    }
+    return true;
+}
+
+bool is_cli_export(int argc, char* argv[]) {
+    // QCommandLineParser takes both "--export project.ove" and "--export=project.ove"
+    for (int i=1;i<argc;i++) {
+        if (strcmp(argv[i], "--export") == 0 || strncmp(argv[i], "--export=", 9) == 0) return true;
+    }
+    return false;
+}
+
+CliExport::CliExport() {
+    ctx = NULL;
+    et = NULL;
+    frames = 0;
+}
+
+CliExport::~CliExport() {
+    delete et;
+    delete ctx;
+}
+
+int CliExport::run() {
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Renders a sequence of an Olive project without opening any windows.");
+    parser.addHelpOption();
+    QCommandLineOption project_option("export", "Project file to render.", "project");
+    QCommandLineOption sequence_option("sequence", "Sequence to render (default: the first one).", "name");
+    QCommandLineOption output_option(QStringList() << "o" << "output", "File to render to, its extension picks the format.", "file");
+    QCommandLineOption vcodec_option("vcodec", "Video encoder, or \"none\" (default: the format's).", "encoder");
+    QCommandLineOption acodec_option("acodec", "Audio encoder, or \"none\" (default: the format's).", "encoder");
+    QCommandLineOption width_option("width", "Video width (default: the sequence's).", "pixels");
+    QCommandLineOption height_option("height", "Video height (default: the sequence's).", "pixels");
+    QCommandLineOption vbitrate_option("vbitrate", "Video bitrate in Mbps.", "mbps", QString::number(CLI_DEFAULT_VIDEO_BITRATE));
+    QCommandLineOption abitrate_option("abitrate", "Audio bitrate in Kbps.", "kbps", QString::number(CLI_DEFAULT_AUDIO_BITRATE));
+    QCommandLineOption samplerate_option("samplerate", "Audio sampling rate in Hz (default: the sequence's).", "hz");
+    QCommandLineOption range_option("range", "Sequence frames to render, out is exclusive (default: all of it).", "in:out");
+    parser.addOption(project_option);
+    parser.addOption(sequence_option);
+    parser.addOption(output_option);
+    parser.addOption(vcodec_option);
+    parser.addOption(acodec_option);
+    parser.addOption(width_option);
+    parser.addOption(height_option);
+    parser.addOption(vbitrate_option);
+    parser.addOption(abitrate_option);
+    parser.addOption(samplerate_option);
+    parser.addOption(range_option);
+    parser.process(*qApp);
+
+    if (!parser.isSet(output_option)) {
+        print_line("error=\"no output file given (-o)\"");
+        return 1;
+    }
+
+    // load the project as the GUI would, just without showing it
+    QElapsedTimer load_timer;
+    load_timer.start();
+    project_url = QFileInfo(parser.value(project_option)).absoluteFilePath();
+    if (!panel_project->load_project()) {
+        print_line("error=\"could not load project " + project_url + "\"");
+        return 1;
+    }
+    Sequence* s = panel_project->find_sequence(parser.value(sequence_option));
+    if (s == NULL) {
+        print_line("error=\"no sequence named '" + parser.value(sequence_option) + "'\"");
+        return 1;
+    }
+    set_sequence(s);
+    print_line(QString("loaded sequence=\"%1\" msecs=%2").arg(s->name).arg(load_timer.elapsed()));
+
+    long start = 0;
+    long end = s->getEndFrame();
+    if (parser.isSet(range_option)) {
+        QStringList range = parser.value(range_option).split(':');
+        bool in_ok = false;
+        bool out_ok = false;
+        if (range.size() == 2) {
+            start = range.at(0).toLong(&in_ok);
+            end = range.at(1).toLong(&out_ok);
+        }
+        if (!in_ok || !out_ok || start < 0 || end <= start) {
+            print_line("error=\"invalid range " + parser.value(range_option) + "\"");
+            return 1;
+        }
+    }
+
+    int sampling_rate = s->audio_frequency;
+    if (parser.isSet(samplerate_option)) {
+        bool ok = false;
+        sampling_rate = parser.value(samplerate_option).toInt(&ok);
+        if (!ok || sampling_rate <= 0) {
+            print_line("error=\"invalid sampling rate " + parser.value(samplerate_option) + "\"");
+            return 1;
+        }
+    }
+
+    QString filename = parser.value(output_option);
+    QByteArray filename_ba = filename.toUtf8();
+    AVOutputFormat* ofmt = av_guess_format(NULL, filename_ba.constData(), NULL);
+    if (ofmt == NULL) {
+        print_line("error=\"no format for " + filename + "\"");
+        return 1;
+    }
+    int video_codec;
+    int audio_codec;
+    if (!find_codec(parser.value(vcodec_option), AVMEDIA_TYPE_VIDEO, ofmt, filename_ba.constData(), &video_codec)
+            || !find_codec(parser.value(acodec_option), AVMEDIA_TYPE_AUDIO, ofmt, filename_ba.constData(), &audio_codec)) {
+        return 1;
+    }
+
+    // there's no viewer on screen to borrow a context from, make our own for the offscreen surface
+    ctx = new QOpenGLContext();
+    QSurfaceFormat format;
+    format.setDepthBufferSize(24);
+    ctx->setFormat(format);
+    if (!ctx->create()) {
+        print_line("error=\"could not create OpenGL context\"");
+        return 1;
+    }
+
+    et = new ExportThread();
+    et->surface.setFormat(ctx->format());
+    et->surface.create();
+
+    connect(et, SIGNAL(finished()), this, SLOT(export_finished()));
+    connect(et, SIGNAL(progress_changed(int)), this, SLOT(progress_changed(int)));
+
+    panel_viewer->viewer_widget->multithreaded = false;
+    panel_viewer->viewer_widget->enable_paint = false;
+    panel_viewer->viewer_widget->force_audio = true;
+    ctx->moveToThread(et);
+
+    et->filename = filename;
+    et->start_frame = start;
+    et->end_frame = end;
+    et->video_enabled = (video_codec != AV_CODEC_ID_NONE);
+    if (et->video_enabled) {
+        et->video_codec = video_codec;
+        et->video_width = parser.isSet(width_option) ? parser.value(width_option).toInt() : s->width;
+        et->video_height = parser.isSet(height_option) ? parser.value(height_option).toInt() : s->height;
+        et->video_frame_rate = s->frame_rate;
+        et->video_bitrate = parser.value(vbitrate_option).toDouble();
+    }
+    et->audio_enabled = (audio_codec != AV_CODEC_ID_NONE);
+    if (et->audio_enabled) {
+        et->audio_codec = audio_codec;
+        et->audio_sampling_rate = sampling_rate;
+        et->audio_bitrate = parser.value(abitrate_option).toInt();
+    }
+    et->gl_context = ctx;
+    et->ed = NULL;
+    et->fail = false;
+
+    frames = end - start;
+    timer.start();
+    et->start();
+
+    qApp->exec();
+
+    if (et->fail || !et->export_error.isEmpty()) {
+        print_line(QString("failed msecs=%1 error=\"%2\"").arg(timer.elapsed()).arg(et->export_error));
+        return 1;
+    }
+    double secs = qMax(1LL, timer.elapsed()) * 0.001;
+    print_line(QString("done frames=%1 msecs=%2 fps=%3").arg(frames).arg(timer.elapsed()).arg(frames / secs, 0, 'f', 2));
+    return 0;
+}
+
+void CliExport::progress_changed(int value) {
+    qint64 msecs = timer.elapsed();
+    long frame = qRound(frames * value * 0.01);
+    double fps = (msecs > 0) ? frame * 1000.0 / msecs : 0.0;
+    print_line(QString("progress=%1 frame=%2 msecs=%3 fps=%4").arg(value).arg(frame).arg(msecs).arg(fps, 0, 'f', 2));
+}
+
+void CliExport::export_finished() {
+    qApp->quit();
+}
@@ -0,0 +1,34 @@
+#ifndef CLIEXPORT_H
+#define CLIEXPORT_H
+
+#include <QObject>
+#include <QElapsedTimer>
+
+class QOpenGLContext;
+class ExportThread;
+
+// renders a sequence of a project file to a file without showing any windows, e.g.
+//
+//     olive --export project.ove --sequence "Sequence 01" -o out.mp4 --vcodec libx264 --range 0:1200
+//
+// progress and the result go to stdout one "key=value" line at a time for scripts to parse
+class CliExport : public QObject {
+    Q_OBJECT
+public:
+    CliExport();
+    ~CliExport();
+    int run();
+private slots:
+    void progress_changed(int value);
+    void export_finished();
+private:
+    QOpenGLContext* ctx;
+    ExportThread* et;
+    QElapsedTimer timer;
+    long frames;
+};
+
+// true if olive was started with --export (checked before QApplication exists)
+bool is_cli_export(int argc, char* argv[]);
+
+#endif // CLIEXPORT_H
@@ -15,6 +15,11 @@ bool saved_layout = false;
 bool left_mouse_dominant = true;
 bool show_track_lines = false;
 bool scroll_zooms = false;
+int frame_cache_size = 1024;
+bool use_proxies = false;
+int playback_divider = 1;
+int audio_latency = 40;
+bool headless = false;
 
 void load_config() {
 	/*if (!custom_scale) {
@@ -12,6 +12,12 @@ extern bool show_track_lines;
 
 extern bool scroll_zooms;
 
+extern int frame_cache_size; // in megabytes, shared by all clips
+extern bool use_proxies; // viewer decodes proxies instead of originals where they exist
+extern int playback_divider; // viewer decodes and composites at 1/this of full resolution (1, 2, 4 or 8)
+extern int audio_latency; // msecs the audio device buffers, grown automatically if it underruns
+extern bool headless; // exporting from the command line - no windows, no dialogs, no proxies
+
 void load_config();
 void save_config();
 
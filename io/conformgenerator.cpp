@@ -0,0 +1,230 @@
+#include "conformgenerator.h"
+
+#include "media.h"
+#include "cachedir.h"
+#include "project/sequence.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDir>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <QVector>
+#include <QDebug>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+}
+
+#define CONFORM_CACHE_SIZE 4096 // megabytes of conformed audio kept across sessions
+
+ConformGenerator::ConformGenerator(Media* m, int f, quint64 l) : frequency(f), layout(l), media(m), url(m->url) {
+    cancelled.store(0);
+    done.store(0);
+}
+
+void ConformGenerator::run() {
+    QFileInfo info(url);
+    QDir dir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/conform");
+    dir.mkpath(".");
+
+    for (int i=0;i<media->audio_tracks.size() && !cancelled.load();i++) {
+        MediaStream* ms = media->audio_tracks.at(i);
+        ms->conform_lock.lock();
+        // (the file may have been trimmed from the cache since, see below)
+        bool conformed = (ms->conform_frequency == frequency && ms->conform_layout == layout && QFile::exists(ms->conform_url));
+        ms->conform_lock.unlock();
+        if (conformed) continue;
+
+        // named like proxies, plus the stream and the format it was conformed to
+        QByteArray id = (info.absoluteFilePath() + QString::number(info.size()) + QString::number(info.lastModified().toMSecsSinceEpoch())
+                         + ":" + QString::number(ms->file_index) + ":" + QString::number(frequency) + ":" + QString::number(layout)).toUtf8();
+        QString filename = dir.filePath(QCryptographicHash::hash(id, QCryptographicHash::Md5).toHex() + ".pcm");
+
+        if (!QFile::exists(filename)) {
+            // write to a temporary name so a half-finished conform is never picked up
+            QString temp_filename = filename + ".part";
+            if (!conform(ms, temp_filename) || !QFile::rename(temp_filename, filename)) {
+                QFile::remove(temp_filename);
+                if (!cancelled.load()) qDebug() << "[ERROR] Failed to conform audio stream" << ms->file_index << "of" << url;
+                continue;
+            }
+
+            // make room by dropping what hasn't been used in the longest time. a clip with one of
+            // those open keeps its mapping, a clip opened after falls back to decoding and asks
+            // for it to be conformed again (see request_conform)
+            trim_cache_dir(dir.absolutePath(), qint64(CONFORM_CACHE_SIZE)*1024*1024, filename);
+        }
+
+        ms->conform_lock.lock();
+        ms->conform_url = filename;
+        ms->conform_layout = layout;
+        ms->conform_frequency = frequency;
+        ms->conform_lock.unlock();
+
+        qDebug() << "[INFO] Conformed audio ready for stream" << ms->file_index << "of" << url;
+    }
+
+    done.store(1);
+}
+
+static bool write_samples(QFile& out, const QVector<float>& buffer, int nb_samples, int channels, qint64* skip) {
+    // drops the first *skip samples (audio from before the stream's zero)
+    int drop = (int) qMin(*skip, (qint64) nb_samples);
+    *skip -= drop;
+    qint64 len = (qint64) (nb_samples - drop) * channels * sizeof(float);
+    if (len == 0) return true;
+    return out.write(reinterpret_cast<const char*>(buffer.constData() + drop*channels), len) == len;
+}
+
+static bool convert_frame(QFile& out, SwrContext* swr, AVFrame* frame, QVector<float>& buffer, int channels, qint64* skip) {
+    // a NULL frame flushes what swresample is still holding on to
+    int max_samples = swr_get_out_samples(swr, (frame == NULL) ? 0 : frame->nb_samples);
+    if (max_samples <= 0) return true;
+    if (buffer.size() < max_samples*channels) buffer.resize(max_samples*channels);
+    uint8_t* out_data = reinterpret_cast<uint8_t*>(buffer.data());
+    int nb_samples = swr_convert(swr,
+                                 &out_data,
+                                 max_samples,
+                                 (frame == NULL) ? NULL : const_cast<const uint8_t**>(frame->extended_data),
+                                 (frame == NULL) ? 0 : frame->nb_samples);
+    if (nb_samples < 0) return false;
+    return write_samples(out, buffer, nb_samples, channels, skip);
+}
+
+bool ConformGenerator::conform(MediaStream* ms, const QString& filename) {
+    QByteArray in_ba = url.toUtf8();
+
+    AVFormatContext* in_ctx = NULL;
+    if (avformat_open_input(&in_ctx, in_ba.constData(), NULL, NULL) != 0) {
+        qDebug() << "[ERROR] Could not open" << url << "to conform audio";
+        return false;
+    }
+    avformat_find_stream_info(in_ctx, NULL);
+
+    AVStream* stream = in_ctx->streams[ms->file_index];
+    AVCodec* decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+    AVCodecContext* dec = avcodec_alloc_context3(decoder);
+    avcodec_parameters_to_context(dec, stream->codecpar);
+    if (avcodec_open2(dec, decoder, NULL) < 0) {
+        qDebug() << "[ERROR] Could not open decoder to conform audio";
+        avcodec_free_context(&dec);
+        avformat_close_input(&in_ctx);
+        return false;
+    }
+
+    // same guess the cacher makes for files without a layout (usually WAV)
+    if (dec->channel_layout == 0) {
+        dec->channel_layout = guess_layout_from_channels(dec->channels);
+    }
+    int channels = av_get_channel_layout_nb_channels(layout);
+
+    SwrContext* swr = swr_alloc_set_opts(
+                NULL,
+                layout,
+                AV_SAMPLE_FMT_FLT,
+                frequency,
+                dec->channel_layout,
+                dec->sample_fmt,
+                dec->sample_rate,
+                0,
+                NULL
+                );
+    swr_init(swr);
+
+    QFile out(filename);
+    bool ok = out.open(QFile::WriteOnly | QFile::Truncate);
+    if (!ok) qDebug() << "[ERROR] Could not open conform file" << filename;
+
+    AVPacket* pkt = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    QVector<float> buffer;
+    bool started = false;
+    qint64 skip = 0;
+    int packet_count = 0;
+    bool eof = false;
+
+    while (ok && !eof) {
+        if (av_read_frame(in_ctx, pkt) < 0) {
+            // drain the decoder
+            eof = true;
+            avcodec_send_packet(dec, NULL);
+        } else if (pkt->stream_index == stream->index) {
+            // a packet it won't take is just skipped like the cacher would
+            avcodec_send_packet(dec, pkt);
+        }
+        av_packet_unref(pkt);
+
+        while (ok && avcodec_receive_frame(dec, frame) == 0) {
+            if (!started) {
+                // line the file up with the stream's zero - pad a late start with silence, drop anything before it
+                int64_t ts = frame->best_effort_timestamp;
+                qint64 first = (ts == AV_NOPTS_VALUE) ? 0 : av_rescale_q(ts, stream->time_base, av_make_q(1, frequency));
+                if (first > 0) {
+                    QVector<float> silence(qMin(first, (qint64) frequency)*channels, 0.0f);
+                    for (qint64 written=0;written<first && ok;written+=silence.size()/channels) {
+                        qint64 len = qMin(first - written, (qint64) silence.size()/channels) * channels * sizeof(float);
+                        ok = (out.write(reinterpret_cast<const char*>(silence.constData()), len) == len);
+                    }
+                } else {
+                    skip = -first;
+                }
+                started = true;
+            }
+            if (ok) ok = convert_frame(out, swr, frame, buffer, channels, &skip);
+            av_frame_unref(frame);
+        }
+
+        if (cancelled.load()) ok = false;
+
+        // this can take a while on long files, let playback work jump ahead of us
+        packet_count++;
+        if (packet_count % 64 == 0) {
+            worker_pool->yield(TASK_PRIORITY_PREVIEW);
+        }
+    }
+
+    if (ok) ok = convert_frame(out, swr, NULL, buffer, channels, &skip);
+    if (ok && out.size() == 0) ok = false;
+    out.close();
+
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    swr_free(&swr);
+    avcodec_free_context(&dec);
+    avformat_close_input(&in_ctx);
+
+    return ok;
+}
+
+static bool is_conform_trimmed(Media* m) {
+    // whether a conformed file this media was using has since been trimmed from the cache
+    for (int i=0;i<m->audio_tracks.size();i++) {
+        MediaStream* ms = m->audio_tracks.at(i);
+        ms->conform_lock.lock();
+        bool trimmed = (ms->conform_frequency != 0 && !QFile::exists(ms->conform_url));
+        ms->conform_lock.unlock();
+        if (trimmed) return true;
+    }
+    return false;
+}
+
+void request_conform(Media* m, Sequence* s) {
+    ConformGenerator* cg = m->conform_generator;
+    if (cg != NULL) {
+        // one at a time - a different format is picked up by whichever clip opens after this one's done
+        if (!cg->done.load()) return;
+
+        // finished (or failed, which isn't worth retrying) for this format already
+        if (cg->frequency == s->audio_frequency && cg->layout == (quint64) s->audio_layout && !is_conform_trimmed(m)) return;
+
+        worker_pool->wait(cg);
+        delete cg;
+    }
+
+    m->conform_generator = new ConformGenerator(m, s->audio_frequency, s->audio_layout);
+    worker_pool->submit(m->conform_generator, TASK_PRIORITY_PREVIEW);
+}
@@ -0,0 +1,39 @@
+#ifndef CONFORMGENERATOR_H
+#define CONFORMGENERATOR_H
+
+#include "playback/workerpool.h"
+
+#include <QString>
+#include <QAtomicInt>
+
+struct Media;
+struct MediaStream;
+struct Sequence;
+
+// decodes and resamples a media's audio streams once to a sequence's sample rate and
+// channel layout, into raw interleaved float files the cacher maps instead of decoding.
+// sample n of a file is at n/frequency seconds in the stream's own timestamps
+class ConformGenerator : public WorkerTask
+{
+public:
+    ConformGenerator(Media* m, int f, quint64 l);
+    void run();
+
+    int frequency;
+    quint64 layout;
+
+    // set by the media's destructor, makes a running conform give up
+    QAtomicInt cancelled;
+
+    // set once run() has nothing left to do, successful or not
+    QAtomicInt done;
+private:
+    bool conform(MediaStream* ms, const QString& filename);
+    Media* media;
+    QString url;
+};
+
+// starts conforming a media's audio to a sequence's format if it hasn't been already (main thread only)
+void request_conform(Media* m, Sequence* s);
+
+#endif // CONFORMGENERATOR_H
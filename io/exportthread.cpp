@@ -15,6 +15,7 @@ extern "C" {
 	#include <libavformat/avformat.h>
 	#include <libswresample/swresample.h>
 	#include <libswscale/swscale.h>
+	#include <libavutil/pixdesc.h>
 }
 
 #include <QDebug>
@@ -22,13 +23,188 @@ extern "C" {
 #include <QOffscreenSurface>
 #include <QOpenGLFramebufferObject>
 #include <QOpenGLPaintDevice>
+#include <QOpenGLBuffer>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLShaderProgram>
+#include <QVector2D>
+#include <QVector3D>
 #include <QPainter>
+#include <QElapsedTimer>
+#include <QVector>
+
+#define EXPORT_QUEUE_SIZE 4 // frames waiting between two stages before the earlier one has to wait
+#define EXPORT_FRAME_POOL (EXPORT_QUEUE_SIZE+2) // frames of each kind, enough for a full queue plus one in each stage
+#define EXPORT_READBACK_FRAMES 3 // frames being copied off the GPU while the next ones render
+#define EXPORT_FENCE_TIMEOUT 1000000000 // nsecs to wait for a readback before giving up on the fence and mapping anyway
+
+// a pixel pack buffer the GPU copies a rendered frame into in the background
+struct ExportReadback {
+    QOpenGLBuffer* buffer;
+    GLsync fence; // signalled once the copy's done, NULL without sync objects
+    qint64 pts;
+    bool pending;
+};
+
+// renders one plane of the encoder's format from the composited RGBA frame. each output
+// pixel averages the block of source pixels it covers (chroma subsampling), then takes
+// that plane's row of the RGB to YUV matrix
+static const char* planes_vertex_shader =
+        "void main() {\n"
+        "    gl_Position = gl_Vertex;\n"
+        "}\n";
+
+static const char* planes_fragment_shader =
+        "#extension GL_ARB_texture_rectangle : enable\n"
+        "uniform sampler2DRect frame;\n"
+        "uniform vec2 block;\n"
+        "uniform vec3 plane_row;\n"
+        "uniform float plane_offset;\n"
+        "void main() {\n"
+        "    vec2 corner = floor(gl_FragCoord.xy) * block;\n"
+        "    vec3 rgb = (texture2DRect(frame, corner + vec2(0.5, 0.5)).rgb\n"
+        "              + texture2DRect(frame, corner + vec2(block.x - 0.5, 0.5)).rgb\n"
+        "              + texture2DRect(frame, corner + vec2(0.5, block.y - 0.5)).rgb\n"
+        "              + texture2DRect(frame, corner + block - vec2(0.5, 0.5)).rgb) * 0.25;\n"
+        "    gl_FragColor = vec4(dot(rgb, plane_row) + plane_offset, 0.0, 0.0, 1.0);\n"
+        "}\n";
+
+// GPU conversion to an 8-bit planar YUV format, read back one byte per pixel per plane
+struct ExportPlanes {
+    QOpenGLShaderProgram program;
+    QOpenGLFramebufferObject* buffers[3];
+    int widths[3];
+    int heights[3];
+    int offsets[3]; // where each plane starts in the readback buffer
+    QVector2D blocks[3];
+    QVector3D rows[3];
+    float plane_offsets[3];
+    int size;
+};
+
+static ExportPlanes* create_export_planes(int pix_fmt, int width, int height) {
+    // anything else is converted by swscale on the CPU
+    bool full_range;
+    switch (pix_fmt) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUV444P:
+        full_range = false;
+        break;
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_YUVJ422P:
+    case AV_PIX_FMT_YUVJ444P:
+        full_range = true;
+        break;
+    default:
+        return NULL;
+    }
+    if (!QOpenGLShaderProgram::hasOpenGLShaderPrograms()) return NULL;
+
+    ExportPlanes* p = new ExportPlanes();
+    if (!p->program.addShaderFromSourceCode(QOpenGLShader::Vertex, planes_vertex_shader)
+            || !p->program.addShaderFromSourceCode(QOpenGLShader::Fragment, planes_fragment_shader)
+            || !p->program.link()) {
+        qDebug() << "[WARNING] Could not compile export conversion shader, converting on the CPU -" << p->program.log();
+        delete p;
+        return NULL;
+    }
+
+    // BT.601 like swscale's default, so the output matches the CPU path
+    float kr = 0.299f;
+    float kb = 0.114f;
+    float kg = 1.0f - kr - kb;
+    float y_scale = full_range ? 1.0f : 219.0f/255.0f;
+    float c_scale = full_range ? 1.0f : 224.0f/255.0f;
+    p->rows[0] = QVector3D(kr, kg, kb) * y_scale;
+    p->rows[1] = QVector3D(-kr, -kg, 1.0f - kb) * (c_scale / (2.0f * (1.0f - kb)));
+    p->rows[2] = QVector3D(1.0f - kr, -kg, -kb) * (c_scale / (2.0f * (1.0f - kr)));
+    p->plane_offsets[0] = full_range ? 0.0f : 16.0f/255.0f;
+    p->plane_offsets[1] = 128.0f/255.0f;
+    p->plane_offsets[2] = 128.0f/255.0f;
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(pix_fmt));
+    p->size = 0;
+    for (int i=0;i<3;i++) {
+        int shift_w = (i > 0) ? desc->log2_chroma_w : 0;
+        int shift_h = (i > 0) ? desc->log2_chroma_h : 0;
+        p->widths[i] = AV_CEIL_RSHIFT(width, shift_w);
+        p->heights[i] = AV_CEIL_RSHIFT(height, shift_h);
+        p->blocks[i] = QVector2D(1 << shift_w, 1 << shift_h);
+        p->offsets[i] = p->size;
+        p->size += p->widths[i]*p->heights[i];
+        p->buffers[i] = new QOpenGLFramebufferObject(p->widths[i], p->heights[i]);
+    }
+    return p;
+}
+
+static void destroy_export_planes(ExportPlanes* p) {
+    for (int i=0;i<3;i++) {
+        delete p->buffers[i];
+    }
+    delete p;
+}
+
+// sync objects are GL 3.2/ARB_sync, resolved at the start of each export
+static PFNGLFENCESYNCPROC export_fence_sync = NULL;
+static PFNGLCLIENTWAITSYNCPROC export_client_wait_sync = NULL;
+static PFNGLDELETESYNCPROC export_delete_sync = NULL;
+
+static const char* stage_names[EXPORT_STAGE_COUNT] = {"render", "readback", "convert", "video encode", "audio encode"};
+
+FrameQueue::FrameQueue() {
+    capacity = 1;
+    aborted = false;
+}
+
+void FrameQueue::set_capacity(int c) {
+    capacity = c;
+}
+
+void FrameQueue::push(AVFrame* f) {
+    lock.lock();
+    while (!aborted && frames.size() >= capacity) {
+        not_full.wait(&lock);
+    }
+    if (!aborted) {
+        frames.enqueue(f);
+        not_empty.wakeOne();
+    }
+    lock.unlock();
+}
+
+AVFrame* FrameQueue::pop() {
+    lock.lock();
+    while (!aborted && frames.isEmpty()) {
+        not_empty.wait(&lock);
+    }
+    AVFrame* f = aborted ? NULL : frames.dequeue();
+    not_full.wakeOne();
+    lock.unlock();
+    return f;
+}
+
+void FrameQueue::abort() {
+    lock.lock();
+    aborted = true;
+    not_empty.wakeAll();
+    not_full.wakeAll();
+    lock.unlock();
+}
+
+ExportStageThread::ExportStageThread(ExportThread* e, void (ExportThread::*s)()) : et(e), stage(s) {}
+
+void ExportStageThread::run() {
+    (et->*stage)();
+}
 
 bool ExportThread::encode(AVFormatContext* fmt_ctx, AVCodecContext* codec_ctx, AVFrame* frame, AVPacket* packet, AVStream* stream) {
 	int ret = avcodec_send_frame(codec_ctx, frame);
     if (ret < 0/* && ret != AVERROR(EAGAIN) && frame != NULL*/) {
 		qDebug() << "[ERROR] Failed to send frame to encoder." << ret;
-        ed->export_error = "failed to send frame to encoder (" + QString::number(ret) + ")";
+        mux_lock.lock();
+        export_error = "failed to send frame to encoder (" + QString::number(ret) + ")";
+        mux_lock.unlock();
 
 		return false;
 	} else {
@@ -38,32 +214,310 @@ bool ExportThread::encode(AVFormatContext* fmt_ctx, AVCodecContext* codec_ctx, A
 				// do nothing, encoder needs more input
 			} else if (ret < 0) {
 				qDebug() << "[ERROR] Failed to receive packet from encoder." << ret;
-                ed->export_error = "failed to receive packet from encoder (" + QString::number(ret) + ")";
+                mux_lock.lock();
+                export_error = "failed to receive packet from encoder (" + QString::number(ret) + ")";
+                mux_lock.unlock();
 				return false;
 			} else {
 				packet->stream_index = stream->index;
+                mux_lock.lock();
 				av_interleaved_write_frame(fmt_ctx, packet);
+                mux_lock.unlock();
 			}
 		}
 	}
 	return true;
 }
 
+void ExportThread::fail_pipeline() {
+    // stops every stage, whatever they're waiting on
+    pipeline_failed.store(1);
+    free_rgba_frames.abort();
+    rgba_frames.abort();
+    free_video_frames.abort();
+    video_frames.abort();
+    free_audio_frames.abort();
+    audio_frames.abort();
+}
+
+void ExportThread::add_stage_time(int stage, qint64 nsecs) {
+    stage_nsecs[stage].fetchAndAddRelaxed(nsecs);
+}
+
+bool ExportThread::start_readback(qint64 pts, QOpenGLFramebufferObject* fbo) {
+    // slots are used in turn, so the one we're about to reuse holds the oldest frame
+    ExportReadback& r = readbacks[readback_index];
+    readback_index = (readback_index + 1) % EXPORT_READBACK_FRAMES;
+    if (r.pending && !finish_readback(r)) return false;
+
+    QElapsedTimer timer;
+
+    if (gpu_planes != NULL) {
+        // draw the encoder's planes from the composited frame
+        timer.start();
+        QOpenGLFunctions* f = QOpenGLContext::currentContext()->functions();
+        glPushAttrib(GL_ENABLE_BIT | GL_VIEWPORT_BIT | GL_COLOR_BUFFER_BIT);
+        glDisable(GL_BLEND);
+        f->glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_RECTANGLE, fbo->texture());
+        gpu_planes->program.bind();
+        gpu_planes->program.setUniformValue("frame", 0);
+        for (int i=0;i<3;i++) {
+            gpu_planes->buffers[i]->bind();
+            glViewport(0, 0, gpu_planes->widths[i], gpu_planes->heights[i]);
+            gpu_planes->program.setUniformValue("block", gpu_planes->blocks[i]);
+            gpu_planes->program.setUniformValue("plane_row", gpu_planes->rows[i]);
+            gpu_planes->program.setUniformValue("plane_offset", gpu_planes->plane_offsets[i]);
+            glBegin(GL_QUADS);
+            glVertex2f(-1.0f, -1.0f);
+            glVertex2f(1.0f, -1.0f);
+            glVertex2f(1.0f, 1.0f);
+            glVertex2f(-1.0f, 1.0f);
+            glEnd();
+        }
+        gpu_planes->program.release();
+        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+        glPopAttrib();
+        add_stage_time(EXPORT_STAGE_CONVERT, timer.nsecsElapsed());
+    }
+
+    timer.start();
+
+    if (r.buffer == NULL) {
+        r.buffer = new QOpenGLBuffer(QOpenGLBuffer::PixelPackBuffer);
+        r.buffer->setUsagePattern(QOpenGLBuffer::StreamRead);
+        r.buffer->create();
+        r.buffer->bind();
+        r.buffer->allocate((gpu_planes != NULL) ? gpu_planes->size : video_width*video_height*4);
+    } else {
+        r.buffer->bind();
+    }
+
+    // with a PBO bound these return straight away, the GPU does the copy once it's done rendering
+    if (gpu_planes != NULL) {
+        // one byte per pixel from each plane's red channel, with no row padding
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        for (int i=0;i<3;i++) {
+            gpu_planes->buffers[i]->bind();
+            glReadPixels(0, 0, gpu_planes->widths[i], gpu_planes->heights[i], GL_RED, GL_UNSIGNED_BYTE, reinterpret_cast<void*>(quintptr(gpu_planes->offsets[i])));
+        }
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        fbo->bind();
+    } else {
+        glReadPixels(0, 0, video_width, video_height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
+    r.buffer->release();
+    r.fence = (export_fence_sync != NULL) ? export_fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) : NULL;
+    r.pts = pts;
+    r.pending = true;
+
+    add_stage_time(EXPORT_STAGE_READBACK, timer.nsecsElapsed());
+    return true;
+}
+
+bool ExportThread::finish_readback(ExportReadback& r) {
+    r.pending = false;
+
+    // planes converted on the GPU skip straight to the encoder
+    AVFrame* video_frame = (gpu_planes != NULL) ? free_video_frames.pop() : free_rgba_frames.pop();
+    if (video_frame == NULL) return false;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    if (r.fence != NULL) {
+        // mapping would wait too, but this flushes first so a frame still queued up actually gets there
+        if (export_client_wait_sync(r.fence, GL_SYNC_FLUSH_COMMANDS_BIT, EXPORT_FENCE_TIMEOUT) == GL_TIMEOUT_EXPIRED) {
+            qDebug() << "[WARNING] Readback fence timed out";
+        }
+        export_delete_sync(r.fence);
+        r.fence = NULL;
+    }
+
+    r.buffer->bind();
+    const uchar* mapped = static_cast<const uchar*>(r.buffer->map(QOpenGLBuffer::ReadOnly));
+    if (mapped == NULL) {
+        qDebug() << "[ERROR] Could not map readback buffer";
+        mux_lock.lock();
+        export_error = "could not map readback buffer";
+        mux_lock.unlock();
+        r.buffer->release();
+        if (gpu_planes != NULL) {
+            free_video_frames.push(video_frame);
+        } else {
+            free_rgba_frames.push(video_frame);
+        }
+        return false;
+    }
+
+    // rows are packed tightly in the buffer, the frame may pad them
+    if (gpu_planes != NULL) {
+        // the encoder may still be holding on to this frame from last time around
+        av_frame_make_writable(video_frame);
+        for (int i=0;i<3;i++) {
+            const uchar* plane = mapped + gpu_planes->offsets[i];
+            for (int j=0;j<gpu_planes->heights[i];j++) {
+                memcpy(video_frame->data[i] + j*video_frame->linesize[i], plane + j*gpu_planes->widths[i], gpu_planes->widths[i]);
+            }
+        }
+    } else {
+        int row_bytes = video_width*4;
+        for (int i=0;i<video_height;i++) {
+            memcpy(video_frame->data[0] + i*video_frame->linesize[0], mapped + i*row_bytes, row_bytes);
+        }
+    }
+    r.buffer->unmap();
+    r.buffer->release();
+    video_frame->pts = r.pts;
+
+    add_stage_time(EXPORT_STAGE_READBACK, timer.nsecsElapsed());
+
+    if (gpu_planes != NULL) {
+        video_frames.push(video_frame);
+    } else {
+        rgba_frames.push(video_frame);
+    }
+    return true;
+}
+
+void ExportThread::convert_stage() {
+    QElapsedTimer timer;
+    AVFrame* rgba;
+    while ((rgba = rgba_frames.pop()) != NULL) {
+        AVFrame* frame = free_video_frames.pop();
+        if (frame == NULL) break;
+
+        timer.start();
+
+        // the encoder may still be holding on to this frame from last time around
+        av_frame_make_writable(frame);
+
+        // change pixel format
+        sws_scale(sws_ctx, rgba->data, rgba->linesize, 0, rgba->height, frame->data, frame->linesize);
+        frame->pts = rgba->pts;
+
+        add_stage_time(EXPORT_STAGE_CONVERT, timer.nsecsElapsed());
+
+        free_rgba_frames.push(rgba);
+        video_frames.push(frame);
+    }
+    video_frames.push(NULL);
+}
+
+void ExportThread::video_encode_stage() {
+    QElapsedTimer timer;
+    AVPacket video_pkt;
+    av_init_packet(&video_pkt);
+
+    AVFrame* frame;
+    while ((frame = video_frames.pop()) != NULL) {
+        timer.start();
+        bool ok = encode(fmt_ctx, vcodec_ctx, frame, &video_pkt, video_stream);
+        add_stage_time(EXPORT_STAGE_VIDEO_ENCODE, timer.nsecsElapsed());
+
+        free_video_frames.push(frame);
+        if (!ok) {
+            fail_pipeline();
+            break;
+        }
+    }
+
+    if (!pipeline_failed.load()) {
+        // flush remaining packets
+        timer.start();
+        while (encode(fmt_ctx, vcodec_ctx, NULL, &video_pkt, video_stream)) {}
+        add_stage_time(EXPORT_STAGE_VIDEO_ENCODE, timer.nsecsElapsed());
+    }
+
+    av_packet_unref(&video_pkt);
+}
+
+void ExportThread::audio_encode_stage() {
+    QElapsedTimer timer;
+    AVPacket audio_pkt;
+    av_init_packet(&audio_pkt);
+    long file_audio_samples = 0;
+
+    AVFrame* frame;
+    while ((frame = audio_frames.pop()) != NULL) {
+        timer.start();
+
+        // convert to export sample format
+        swr_convert_frame(swr_ctx, swr_frame, frame);
+        swr_frame->pts = file_audio_samples;
+
+        // send to encoder
+        bool ok = encode(fmt_ctx, acodec_ctx, swr_frame, &audio_pkt, audio_stream);
+        file_audio_samples += swr_frame->nb_samples;
+
+        add_stage_time(EXPORT_STAGE_AUDIO_ENCODE, timer.nsecsElapsed());
+
+        free_audio_frames.push(frame);
+        if (!ok) {
+            fail_pipeline();
+            break;
+        }
+    }
+
+    if (!pipeline_failed.load()) {
+        timer.start();
+
+        // flush swresample
+        do {
+            swr_convert_frame(swr_ctx, swr_frame, NULL);
+            swr_frame->pts = file_audio_samples;
+            if (!encode(fmt_ctx, acodec_ctx, swr_frame, &audio_pkt, audio_stream)) {
+                fail_pipeline();
+                break;
+            }
+            file_audio_samples += swr_frame->nb_samples;
+        } while (swr_frame->nb_samples > 0);
+
+        // flush encoder
+        while (encode(fmt_ctx, acodec_ctx, NULL, &audio_pkt, audio_stream)) {}
+
+        add_stage_time(EXPORT_STAGE_AUDIO_ENCODE, timer.nsecsElapsed());
+    }
+
+    av_packet_unref(&audio_pkt);
+}
+
 void ExportThread::run() {
     panel_timeline->pause();
 //    av_log_set_level(AV_LOG_DEBUG);
 
-	// TODO make customizable
-	long start = 0;
-	long end = sequence->getEndFrame();
+    long start = start_frame;
+    long end = end_frame;
 
-    if (!panel_viewer->viewer_widget->context()->makeCurrent(&surface)) {
+    // the viewer's own context, unless we've been given one (command-line export has no viewer on screen)
+    QOpenGLContext* ctx = (gl_context != NULL) ? gl_context : panel_viewer->viewer_widget->context();
+    if (!ctx->makeCurrent(&surface)) {
         qDebug() << "[ERROR] Make current failed";
-        ed->export_error = "could not make OpenGL context current";
+        export_error = "could not make OpenGL context current";
         return;
 	}
 
-	AVFormatContext* fmt_ctx = NULL;
+    // clips opened for playback may be decoding proxies, reopen them from the originals
+    close_active_clips(sequence, true);
+
+    fmt_ctx = NULL;
+    sws_ctx = NULL;
+    swr_ctx = NULL;
+    swr_frame = NULL;
+    pipeline_failed.store(0);
+    for (int i=0;i<EXPORT_STAGE_COUNT;i++) {
+        stage_nsecs[i].store(0);
+    }
+
+    // every frame handed between stages, freed once they've all stopped
+    QVector<AVFrame*> pipeline_frames;
+    free_rgba_frames.set_capacity(EXPORT_FRAME_POOL);
+    rgba_frames.set_capacity(EXPORT_QUEUE_SIZE);
+    free_video_frames.set_capacity(EXPORT_FRAME_POOL);
+    video_frames.set_capacity(EXPORT_QUEUE_SIZE);
+    free_audio_frames.set_capacity(EXPORT_FRAME_POOL);
+    audio_frames.set_capacity(EXPORT_QUEUE_SIZE);
+
 	QByteArray ba = filename.toLatin1();
 	char* c_filename = new char[ba.size()+1];
 	strcpy(c_filename, ba.data());
@@ -72,22 +526,10 @@ void ExportThread::run() {
     avformat_alloc_output_context2(&fmt_ctx, ofmt, NULL, c_filename);
     if (!fmt_ctx) {
         qDebug() << "[ERROR] Could not create output context";
-        ed->export_error = "could not create output format context";
+        export_error = "could not create output format context";
     } else {
-		AVStream* video_stream;
 		AVCodec* vcodec;
-		AVCodecContext* vcodec_ctx;
-		AVFrame* video_frame;
-        AVFrame* sws_frame;
-        SwsContext* sws_ctx = NULL;
-        AVStream* audio_stream;
         AVCodec* acodec;
-        AVFrame* audio_frame;
-        AVFrame* swr_frame;
-        AVCodecContext* acodec_ctx;
-		AVPacket video_pkt;
-        AVPacket audio_pkt;
-        SwrContext* swr_ctx = NULL;
         int aframe_bytes;
 		int ret;
 
@@ -97,7 +539,7 @@ void ExportThread::run() {
             vcodec = avcodec_find_encoder((enum AVCodecID) video_codec);
             if (!vcodec) {
                 qDebug() << "[ERROR] Could not find video encoder";
-                ed->export_error = "could not video encoder for " + QString::number(video_codec);
+                export_error = "could not video encoder for " + QString::number(video_codec);
                 fail = true;
             } else {
                 video_stream = avformat_new_stream(fmt_ctx, vcodec);
@@ -105,14 +547,14 @@ void ExportThread::run() {
 
                 if (!video_stream) {
                     qDebug() << "[ERROR] Could not allocate video stream";
-                    ed->export_error = "could not allocate video stream";
+                    export_error = "could not allocate video stream";
                     fail = true;
                 } else {
 					vcodec_ctx = avcodec_alloc_context3(vcodec);
 
 					if (!vcodec_ctx) {
                         qDebug() << "[ERROR] Could not allocate video encoding context";
-                        ed->export_error = "could not allocate video encoding context";
+                        export_error = "could not allocate video encoding context";
 						fail = true;
 					} else {
                         vcodec_ctx->codec_id = (enum AVCodecID) video_codec;
@@ -133,25 +575,15 @@ void ExportThread::run() {
 						ret = avcodec_open2(vcodec_ctx, vcodec, NULL);
 						if (ret < 0) {
                             qDebug() << "[ERROR] Could not open output video encoder." << ret;
-                            ed->export_error = "could not open output video encoder (" + QString::number(ret) + ")";
+                            export_error = "could not open output video encoder (" + QString::number(ret) + ")";
 							fail = true;
 						} else {
 							ret = avcodec_parameters_from_context(video_stream->codecpar, vcodec_ctx);
 							if (ret < 0) {
                                 qDebug() << "[ERROR] Could not copy video encoder parameters to output stream." << ret;
-                                ed->export_error = "could not copy video encoder parameters to output stream (" + QString::number(ret) + ")";
+                                export_error = "could not copy video encoder parameters to output stream (" + QString::number(ret) + ")";
 								fail = true;
 							} else {
-								// initialize raw video frame
-								video_frame = av_frame_alloc();
-								av_frame_make_writable(video_frame);
-								video_frame->format = AV_PIX_FMT_RGBA;
-								video_frame->width = video_width;
-								video_frame->height = video_height;
-								av_frame_get_buffer(video_frame, 0);
-
-								av_init_packet(&video_pkt);
-
 								sws_ctx = sws_getContext(
 											video_width,
 											video_height,
@@ -165,11 +597,24 @@ void ExportThread::run() {
 											NULL
 										);
 
-                                sws_frame = av_frame_alloc();
-                                sws_frame->format = vcodec_ctx->pix_fmt;
-                                sws_frame->width = video_frame->width;
-                                sws_frame->height = video_frame->height;
-                                av_frame_get_buffer(sws_frame, 0);
+                                // raw frames read back from opengl, and the same converted for the encoder
+                                for (int i=0;i<EXPORT_FRAME_POOL;i++) {
+                                    AVFrame* video_frame = av_frame_alloc();
+                                    video_frame->format = AV_PIX_FMT_RGBA;
+                                    video_frame->width = video_width;
+                                    video_frame->height = video_height;
+                                    av_frame_get_buffer(video_frame, 0);
+                                    pipeline_frames.append(video_frame);
+                                    free_rgba_frames.push(video_frame);
+
+                                    AVFrame* sws_frame = av_frame_alloc();
+                                    sws_frame->format = vcodec_ctx->pix_fmt;
+                                    sws_frame->width = video_width;
+                                    sws_frame->height = video_height;
+                                    av_frame_get_buffer(sws_frame, 0);
+                                    pipeline_frames.append(sws_frame);
+                                    free_video_frames.push(sws_frame);
+                                }
 							}
 						}
 					}
@@ -181,20 +626,20 @@ void ExportThread::run() {
             acodec = avcodec_find_encoder((enum AVCodecID) audio_codec);
             if (!acodec) {
                 qDebug() << "[ERROR] Could not find audio encoder";
-                ed->export_error = "could not audio encoder for " + QString::number(audio_codec);
+                export_error = "could not audio encoder for " + QString::number(audio_codec);
                 fail = true;
             } else {
                 audio_stream = avformat_new_stream(fmt_ctx, acodec);
                 audio_stream->id = 1;
                 if (!audio_stream) {
                     qDebug() << "[ERROR] Could not allocate audio stream";
-                    ed->export_error = "could not allocate audio stream";
+                    export_error = "could not allocate audio stream";
                     fail = true;
                 } else {
                     acodec_ctx = avcodec_alloc_context3(acodec);
                     if (!acodec_ctx) {
                         qDebug() << "[ERROR] Could not find allocate audio encoding context";
-                        ed->export_error = "could not allocate audio encoding context";
+                        export_error = "could not allocate audio encoding context";
                         fail = true;
                     } else {
                         acodec_ctx->sample_rate = audio_sampling_rate;
@@ -212,13 +657,13 @@ void ExportThread::run() {
                         ret = avcodec_open2(acodec_ctx, acodec, NULL);
                         if (ret < 0) {
                             qDebug() << "[ERROR] Could not open output audio encoder." << ret;
-                            ed->export_error = "could not open output audio encoder (" + QString::number(ret) + ")";
+                            export_error = "could not open output audio encoder (" + QString::number(ret) + ")";
                             fail = true;
                         } else {
                             ret = avcodec_parameters_from_context(audio_stream->codecpar, acodec_ctx);
                             if (ret < 0) {
                                 qDebug() << "[ERROR] Could not copy audio encoder parameters to output stream." << ret;
-                                ed->export_error = "could not copy audio encoder parameters to output stream (" + QString::number(ret) + ")";
+                                export_error = "could not copy audio encoder parameters to output stream (" + QString::number(ret) + ")";
                                 fail = true;
                             } else {
                                 // init audio resampler context
@@ -235,24 +680,27 @@ void ExportThread::run() {
                                     );
                                 swr_init(swr_ctx);
 
-                                // initialize raw audio frame
-                                audio_frame = av_frame_alloc();
-                                audio_frame->sample_rate = sequence->audio_frequency;
-                                audio_frame->nb_samples = acodec_ctx->frame_size;
-                                if (audio_frame->nb_samples == 0) audio_frame->nb_samples = 2048; // should possibly be smaller?
-                                audio_frame->format = AV_SAMPLE_FMT_S16;
-                                audio_frame->channel_layout = AV_CH_LAYOUT_STEREO; // change this to support surround/mono sound in the future (this is whatever format they're held in the internal buffer)
-                                audio_frame->channels = av_get_channel_layout_nb_channels(audio_frame->channel_layout);
-                                ret = av_frame_get_buffer(audio_frame, 0);
-                                if (ret < 0) {
-                                    qDebug() << "[ERROR] Could not allocate audio buffer." << ret;
-                                    ed->export_error = "could not allocate audio buffer (" + QString::number(ret) + ")";
-                                    fail = true;
-                                } else {
-                                    // av_samples_alloc(&audio_frame->data[0], NULL, av_get_channel_layout_nb_channels(audio_frame->channel_layout), audio_frame->nb_samples, acodec_ctx->sample_fmt, 0);
-                                    av_frame_make_writable(audio_frame);
-                                    aframe_bytes = av_samples_get_buffer_size(NULL, audio_frame->channels, audio_frame->nb_samples, static_cast<AVSampleFormat>(audio_frame->format), 0);
-
+                                // initialize raw audio frames
+                                for (int i=0;i<EXPORT_FRAME_POOL && !fail;i++) {
+                                    AVFrame* audio_frame = av_frame_alloc();
+                                    audio_frame->sample_rate = sequence->audio_frequency;
+                                    audio_frame->nb_samples = acodec_ctx->frame_size;
+                                    if (audio_frame->nb_samples == 0) audio_frame->nb_samples = 2048; // should possibly be smaller?
+                                    audio_frame->format = AV_SAMPLE_FMT_S16;
+                                    audio_frame->channel_layout = AV_CH_LAYOUT_STEREO; // change this to support surround/mono sound in the future (this is whatever format they're held in the internal buffer)
+                                    audio_frame->channels = av_get_channel_layout_nb_channels(audio_frame->channel_layout);
+                                    pipeline_frames.append(audio_frame);
+                                    ret = av_frame_get_buffer(audio_frame, 0);
+                                    if (ret < 0) {
+                                        qDebug() << "[ERROR] Could not allocate audio buffer." << ret;
+                                        export_error = "could not allocate audio buffer (" + QString::number(ret) + ")";
+                                        fail = true;
+                                    } else {
+                                        free_audio_frames.push(audio_frame);
+                                        aframe_bytes = av_samples_get_buffer_size(NULL, audio_frame->channels, audio_frame->nb_samples, static_cast<AVSampleFormat>(audio_frame->format), 0);
+                                    }
+                                }
+                                if (!fail) {
                                     // init converted audio frame
                                     swr_frame = av_frame_alloc();
                                     swr_frame->channel_layout = acodec_ctx->channel_layout;
@@ -260,8 +708,6 @@ void ExportThread::run() {
                                     swr_frame->sample_rate = acodec_ctx->sample_rate;
                                     swr_frame->format = acodec_ctx->sample_fmt;
                                     av_frame_make_writable(swr_frame);
-
-                                    av_init_packet(&audio_pkt);
                                 }
                             }
                         }
@@ -276,12 +722,12 @@ void ExportThread::run() {
             ret = avio_open(&fmt_ctx->pb, c_filename, AVIO_FLAG_WRITE);
 			if (ret < 0) {
 				qDebug() << "[ERROR] Could not open output file." << ret;
-                ed->export_error = "could not open output file (" + QString::number(ret) + ")";
+                export_error = "could not open output file (" + QString::number(ret) + ")";
 			} else {
 				ret = avformat_write_header(fmt_ctx, NULL);
 				if (ret < 0) {
 					qDebug() << "[ERROR] Could not write output file header." << ret;
-                    ed->export_error = "could not write output file header (" + QString::number(ret) + ")";
+                    export_error = "could not write output file header (" + QString::number(ret) + ")";
 				} else {
                     panel_timeline->seek(start);
 
@@ -294,83 +740,154 @@ void ExportThread::run() {
                     panel_viewer->viewer_widget->initializeGL();
                     panel_viewer->viewer_widget->flip = true;
 
-                    long file_audio_samples = 0;
+                    // compositing and readback need the GL context and stay on this thread, the
+                    // rest of the pipeline runs alongside and catches up through the queues
+                    QVector<ExportStageThread*> stages;
+                    gpu_planes = NULL;
+                    if (video_enabled) {
+                        // planar YUV is cheaper to convert on the GPU, and 25-62% fewer bytes to read back than RGBA
+                        gpu_planes = create_export_planes(vcodec_ctx->pix_fmt, video_width, video_height);
+                        if (gpu_planes == NULL) {
+                            stages.append(new ExportStageThread(this, &ExportThread::convert_stage));
+                        }
+                        stages.append(new ExportStageThread(this, &ExportThread::video_encode_stage));
+                    }
+                    if (audio_enabled) {
+                        stages.append(new ExportStageThread(this, &ExportThread::audio_encode_stage));
+                    }
+                    for (int i=0;i<stages.size();i++) {
+                        stages.at(i)->start();
+                    }
+
+                    export_fence_sync = reinterpret_cast<PFNGLFENCESYNCPROC>(ctx->getProcAddress("glFenceSync"));
+                    export_client_wait_sync = reinterpret_cast<PFNGLCLIENTWAITSYNCPROC>(ctx->getProcAddress("glClientWaitSync"));
+                    export_delete_sync = reinterpret_cast<PFNGLDELETESYNCPROC>(ctx->getProcAddress("glDeleteSync"));
+                    if (export_fence_sync == NULL || export_client_wait_sync == NULL || export_delete_sync == NULL) {
+                        export_fence_sync = NULL;
+                    }
+
+                    ExportReadback readback_slots[EXPORT_READBACK_FRAMES];
+                    for (int i=0;i<EXPORT_READBACK_FRAMES;i++) {
+                        readback_slots[i].buffer = NULL;
+                        readback_slots[i].fence = NULL;
+                        readback_slots[i].pending = false;
+                    }
+                    readbacks = readback_slots;
+                    readback_index = 0;
 
-					while (panel_timeline->playhead < end && !fail) {
+                    QElapsedTimer export_timer;
+                    export_timer.start();
+                    QElapsedTimer timer;
+                    long sequence_audio_samples = 0;
+
+					while (panel_timeline->playhead < end && !fail && !pipeline_failed.load()) {
+                        timer.start();
                         panel_viewer->viewer_widget->paintGL();
+                        add_stage_time(EXPORT_STAGE_RENDER, timer.nsecsElapsed());
 
-						double timecode_secs = (double) panel_timeline->playhead / sequence->frame_rate;
+						// relative to the in point, like the audio, so a range export starts at zero
+						double timecode_secs = (double) (panel_timeline->playhead - start) / sequence->frame_rate;
 						if (video_enabled) {
                             // get image from opengl
-                            glReadPixels(0, 0, video_width, video_height, GL_RGBA, GL_UNSIGNED_BYTE, video_frame->data[0]);
-
-                            // change pixel format
-                            sws_scale(sws_ctx, video_frame->data, video_frame->linesize, 0, video_frame->height, sws_frame->data, sws_frame->linesize);
-							sws_frame->pts = round(timecode_secs/av_q2d(video_stream->time_base));
-
-							// send to encoder
-							if (!encode(fmt_ctx, vcodec_ctx, sws_frame, &video_pkt, video_stream)) fail = true;
+                            if (!start_readback(round(timecode_secs/av_q2d(video_stream->time_base)), &fbo)) {
+                                fail_pipeline();
+                                break;
+                            }
 						}
                         if (audio_enabled) {
-                            // do we need to encode more audio samples?
-                            while (!fail && file_audio_samples <= (timecode_secs*audio_sampling_rate)) {
-                                int adjusted_read = audio_ibuffer_read%audio_ibuffer_size;
-                                int copylen = qMin(aframe_bytes, audio_ibuffer_size-adjusted_read);
-                                memcpy(audio_frame->data[0], audio_ibuffer+adjusted_read, copylen);
-                                memset(audio_ibuffer+adjusted_read, 0, copylen);
-                                audio_ibuffer_read += copylen;
-
-                                if (copylen < aframe_bytes) {
-                                    // copy remainder
-                                    int remainder_len = aframe_bytes-copylen;
-                                    memcpy(audio_frame->data[0]+copylen, audio_ibuffer, remainder_len);
-                                    memset(audio_ibuffer, 0, remainder_len);
-                                    audio_ibuffer_read += remainder_len;
-                                }
-
-                                // convert to export sample format
-                                swr_convert_frame(swr_ctx, swr_frame, audio_frame);
-                                swr_frame->pts = file_audio_samples;
-
-                                // send to encoder
-                                if (!encode(fmt_ctx, acodec_ctx, swr_frame, &audio_pkt, audio_stream)) fail = true;
-
-                                file_audio_samples += swr_frame->nb_samples;
+                            // do we need to encode more audio samples? (the mix starts at the in point)
+                            while (sequence_audio_samples <= ((double) (panel_timeline->playhead - start) / sequence->frame_rate * sequence->audio_frequency)) {
+                                // the clips (cached by paintGL above) may not have mixed this far yet
+                                if (audio_ibuffer.get_readable(aframe_bytes) < aframe_bytes) break;
+
+                                AVFrame* audio_frame = free_audio_frames.pop();
+                                if (audio_frame == NULL) break;
+                                audio_ibuffer.render((char*) audio_frame->data[0], aframe_bytes);
+                                audio_ibuffer.consume(aframe_bytes);
+                                audio_frames.push(audio_frame);
+
+                                sequence_audio_samples += audio_frame->nb_samples;
                             }
                         }
-						emit progress_changed(((float) panel_timeline->playhead / (float) end) * 100);
+						emit progress_changed(((float) (panel_timeline->playhead - start) / (float) qMax(1L, end - start)) * 100);
 						panel_timeline->playhead++;
 					}
 
-                    panel_viewer->viewer_widget->flip = false;
+                    if (audio_enabled && !fail && !pipeline_failed.load()) {
+                        // the loop only pulls audio up to the last video frame, and stops short wherever
+                        // the clips hadn't mixed that far yet. pull the rest, padding the last frame with silence
+                        qint64 total_samples = qRound64((double) (end - start) / sequence->frame_rate * sequence->audio_frequency);
+                        bool topped_up = false;
+                        while (sequence_audio_samples < total_samples) {
+                            int readable = audio_ibuffer.get_readable(aframe_bytes);
+                            if (readable < aframe_bytes && !topped_up) {
+                                // give the clips a chance to mix the rest (or close) now the playhead's at the end
+                                panel_viewer->viewer_widget->paintGL();
+                                topped_up = true;
+                                continue;
+                            }
 
-					painter.endNativePainting();
-					fbo.release();
+                            AVFrame* audio_frame = free_audio_frames.pop();
+                            if (audio_frame == NULL) break;
+                            audio_ibuffer.render((char*) audio_frame->data[0], readable);
+                            audio_ibuffer.consume(readable);
+                            memset(audio_frame->data[0] + readable, 0, aframe_bytes - readable);
+                            audio_frames.push(audio_frame);
 
-                    if (!fail) {
-                        // flush remaining packets
-                        if (video_enabled) {
-                            while (encode(fmt_ctx, vcodec_ctx, NULL, &video_pkt, video_stream)) {}
+                            sequence_audio_samples += audio_frame->nb_samples;
+                            if (readable < aframe_bytes) break; // nothing more is coming
+                            topped_up = false;
                         }
-                        if (audio_enabled) {
-                            // flush swresample
-                            do {
-                                swr_convert_frame(swr_ctx, swr_frame, NULL);
-                                swr_frame->pts = file_audio_samples;
-                                if (!encode(fmt_ctx, acodec_ctx, swr_frame, &audio_pkt, audio_stream)) fail = true;
-                                file_audio_samples += swr_frame->nb_samples;
-                            } while (swr_frame->nb_samples > 0);
-
-                            // flush encoder
-                            while (encode(fmt_ctx, acodec_ctx, NULL, &audio_pkt, audio_stream)) {}
+                    }
+
+                    // hand on the frames still being read back, in the order they were rendered
+                    for (int i=0;i<EXPORT_READBACK_FRAMES;i++) {
+                        ExportReadback& r = readbacks[(readback_index + i) % EXPORT_READBACK_FRAMES];
+                        if (r.pending && !fail && !pipeline_failed.load() && !finish_readback(r)) {
+                            fail_pipeline();
+                        }
+                        if (r.fence != NULL) export_delete_sync(r.fence);
+                        if (r.buffer != NULL) {
+                            r.buffer->destroy();
+                            delete r.buffer;
                         }
                     }
+                    readbacks = NULL;
+                    if (gpu_planes != NULL) {
+                        destroy_export_planes(gpu_planes);
+                        gpu_planes = NULL;
+                    }
+
+                    // cancelled, the stages can stop where they are
+                    if (fail) fail_pipeline();
+
+                    // otherwise let them finish what's queued and flush their encoders
+                    rgba_frames.push(NULL);
+                    audio_frames.push(NULL);
+                    for (int i=0;i<stages.size();i++) {
+                        stages.at(i)->wait();
+                        delete stages.at(i);
+                    }
+                    if (pipeline_failed.load()) fail = true;
+
+                    // how much of the export each stage spent working, the busiest one is what's holding it up
+                    qint64 export_nsecs = qMax((qint64) 1, export_timer.nsecsElapsed());
+                    QString occupancy;
+                    for (int i=0;i<EXPORT_STAGE_COUNT;i++) {
+                        occupancy += QString(" %1 %2%").arg(stage_names[i]).arg(qRound(100.0 * stage_nsecs[i].load() / export_nsecs));
+                    }
+                    qDebug() << "[INFO] Export stage occupancy:" << qPrintable(occupancy);
+
+                    panel_viewer->viewer_widget->flip = false;
+
+					painter.endNativePainting();
+					fbo.release();
 
                     if (!fail) {
 						ret = av_write_trailer(fmt_ctx);
 						if (ret < 0) {
 							qDebug() << "[ERROR] Could not write output file trailer." << ret;
-                            ed->export_error = "could not write output file trailer (" + QString::number(ret) + ")";
+                            export_error = "could not write output file trailer (" + QString::number(ret) + ")";
 						}
 
 						emit progress_changed(100);
@@ -382,25 +899,24 @@ void ExportThread::run() {
 
             if (video_enabled) {
                 avcodec_close(vcodec_ctx);
-                av_packet_unref(&video_pkt);
-                av_frame_free(&video_frame);
                 avcodec_free_context(&vcodec_ctx);
             }
 
             if (audio_enabled) {
                 avcodec_close(acodec_ctx);
-                av_packet_unref(&audio_pkt);
-                av_frame_free(&audio_frame);
                 avcodec_free_context(&acodec_ctx);
             }
 
+            for (int i=0;i<pipeline_frames.size();i++) {
+                av_frame_free(&pipeline_frames[i]);
+            }
+
 			avformat_free_context(fmt_ctx);
 
 		//	qDebug() << "Render took: %ih %im %is\n", render_time/3600000, render_time/60000, render_time/1000;
 
             if (sws_ctx != NULL) {
                 sws_freeContext(sws_ctx);
-                av_frame_free(&sws_frame);
             }
             if (swr_ctx != NULL) {
                 swr_free(&swr_ctx);
@@ -411,8 +927,10 @@ void ExportThread::run() {
 
 	delete [] c_filename;
 
-	panel_viewer->viewer_widget->context()->doneCurrent();
-	panel_viewer->viewer_widget->context()->moveToThread(qApp->thread());
+    if (ed != NULL) ed->export_error = export_error;
+
+	ctx->doneCurrent();
+	ctx->moveToThread(qApp->thread());
 	panel_viewer->viewer_widget->multithreaded = true;
     panel_viewer->viewer_widget->force_audio = false;
     panel_viewer->viewer_widget->enable_paint = true;
@@ -3,13 +3,63 @@
 
 #include <QThread>
 #include <QOffscreenSurface>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QAtomicInt>
+#include <QAtomicInteger>
 
 class ExportDialog;
+class ExportThread;
+struct ExportReadback;
+struct ExportPlanes;
+class QOpenGLFramebufferObject;
+class QOpenGLContext;
 struct AVFormatContext;
 struct AVCodecContext;
 struct AVFrame;
 struct AVPacket;
 struct AVStream;
+struct SwsContext;
+struct SwrContext;
+
+// the stages export is split into, each runs concurrently with the others
+enum ExportStages {
+    EXPORT_STAGE_RENDER, // compositing the sequence (export thread)
+    EXPORT_STAGE_READBACK, // copying rendered frames out of OpenGL (export thread)
+    EXPORT_STAGE_CONVERT, // RGBA to the encoder's pixel format
+    EXPORT_STAGE_VIDEO_ENCODE,
+    EXPORT_STAGE_AUDIO_ENCODE,
+    EXPORT_STAGE_COUNT
+};
+
+// bounded hand-off between two export stages. pop() blocks while it's empty and
+// push() while it's full, so a slow stage holds back the ones feeding it
+class FrameQueue {
+public:
+    FrameQueue();
+    void set_capacity(int c);
+    void push(AVFrame* f); // NULL tells the next stage there's nothing more
+    AVFrame* pop(); // NULL at the end, or once aborted
+    void abort(); // wakes up and turns away everyone, for when a stage fails
+private:
+    QQueue<AVFrame*> frames;
+    int capacity;
+    bool aborted;
+    QMutex lock;
+    QWaitCondition not_empty;
+    QWaitCondition not_full;
+};
+
+// runs one of ExportThread's stages on its own thread
+class ExportStageThread : public QThread {
+public:
+    ExportStageThread(ExportThread* e, void (ExportThread::*s)());
+    void run();
+private:
+    ExportThread* et;
+    void (ExportThread::*stage)();
+};
 
 class ExportThread : public QThread {
 	Q_OBJECT
@@ -29,15 +79,58 @@ public:
 	int audio_sampling_rate;
 	int audio_bitrate;
 
+    long start_frame;
+    long end_frame; // exclusive
+
 	QOffscreenSurface surface;
+    QOpenGLContext* gl_context; // renders with the viewer's context if NULL
 
-    ExportDialog* ed;
+    ExportDialog* ed; // NULL when exporting from the command line
 
     bool fail;
+    QString export_error;
 signals:
     void progress_changed(int value);
 private:
+    friend class ExportStageThread;
     bool encode(AVFormatContext* fmt_ctx, AVCodecContext* codec_ctx, AVFrame* frame, AVPacket* packet, AVStream* stream);
+
+    // pipeline stages after readback
+    void convert_stage();
+    void video_encode_stage();
+    void audio_encode_stage();
+    void fail_pipeline();
+    void add_stage_time(int stage, qint64 nsecs);
+
+    // asynchronous readback (export thread only) - start_readback() queues a copy of
+    // the frame just rendered and hands on the oldest one once its slot is needed again
+    bool start_readback(qint64 pts, QOpenGLFramebufferObject* fbo);
+    bool finish_readback(ExportReadback& r);
+    ExportReadback* readbacks;
+    int readback_index;
+    ExportPlanes* gpu_planes; // the encoder's planes rendered on the GPU, NULL if convert_stage() does it
+
+    AVFormatContext* fmt_ctx;
+    AVCodecContext* vcodec_ctx;
+    AVStream* video_stream;
+    SwsContext* sws_ctx;
+    AVCodecContext* acodec_ctx;
+    AVStream* audio_stream;
+    SwrContext* swr_ctx;
+    AVFrame* swr_frame;
+
+    // rendered RGBA frames go readback -> convert -> video encode, and come back
+    // through the free queues once each stage is done with them
+    FrameQueue free_rgba_frames;
+    FrameQueue rgba_frames;
+    FrameQueue free_video_frames;
+    FrameQueue video_frames;
+    FrameQueue free_audio_frames;
+    FrameQueue audio_frames;
+
+    QMutex mux_lock; // av_interleaved_write_frame() and export_error are shared by both encoders
+    QAtomicInt pipeline_failed;
+    QAtomicInteger<qint64> stage_nsecs[EXPORT_STAGE_COUNT]; // time each stage spent working rather than waiting
 };
 
 #endif // EXPORTTHREAD_H
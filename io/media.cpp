@@ -1,14 +1,41 @@
 #include "media.h"
 
+#include "playback/framecache.h"
+#include "playback/decoderpool.h"
+#include "playback/workerpool.h"
+#include "io/proxygenerator.h"
+#include "io/conformgenerator.h"
+
 #include <QDebug>
+#include <algorithm>
 
 extern "C" {
 	#include <libavformat/avformat.h>
 }
 
-Media::Media() {}
+Media::Media() {
+    proxy_generator = NULL;
+    conform_generator = NULL;
+    proxy_ready.store(0);
+}
 
 Media::~Media() {
+    if (proxy_generator != NULL) {
+        // a queued transcode just comes off the queue, only a running one (which gives up
+        // once it sees cancelled) may still be writing to us
+        proxy_generator->cancelled.store(1);
+        if (worker_pool != NULL && worker_pool->cancel(proxy_generator)) worker_pool->wait(proxy_generator);
+        delete proxy_generator;
+    }
+    if (conform_generator != NULL) {
+        conform_generator->cancelled.store(1);
+        if (worker_pool != NULL && worker_pool->cancel(conform_generator)) worker_pool->wait(conform_generator);
+        delete conform_generator;
+    }
+
+    frame_cache_remove_media(this);
+    decoder_pool_remove_media(this);
+
     for (int i=0;i<video_tracks.size();i++) {
         delete video_tracks.at(i);
     }
@@ -37,6 +64,30 @@ MediaStream* Media::get_stream_from_file_index(int index) {
     return NULL;
 }
 
+void MediaStream::add_cost(QAtomicInt* cost, qint64 msecs) {
+    // weighted towards recent measurements, storage speed can change (caches, network drives).
+    // retried if another cacher got its measurement in first
+    int old_cost;
+    int new_cost;
+    do {
+        old_cost = cost->load();
+        new_cost = (old_cost == 0) ? (int) msecs : (int) ((old_cost*3 + msecs)/4);
+    } while (!cost->testAndSetOrdered(old_cost, new_cost));
+}
+
+long MediaStream::get_frame_from_pts(int64_t pts) {
+    // last frame shown at or before this timestamp, -1 if there isn't one
+    QVector<int64_t>::const_iterator it = std::upper_bound(frame_pts.constBegin(), frame_pts.constEnd(), pts);
+    return (it - frame_pts.constBegin()) - 1;
+}
+
+long MediaStream::get_keyframe_before(long frame) {
+    // closest keyframe at or before this frame, where a seek has to start decoding from
+    QVector<int>::const_iterator it = std::upper_bound(keyframes.constBegin(), keyframes.constEnd(), (int) frame);
+    if (it == keyframes.constBegin()) return 0;
+    return *(it - 1);
+}
+
 int guess_layout_from_channels(int channel_count) {
     if (channel_count == 1) {
         return AV_CH_LAYOUT_MONO;
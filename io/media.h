@@ -6,9 +6,14 @@
 #include <QMetaType>
 #include <QVariant>
 #include <QMutex>
+#include <QAtomicInt>
 #include <QPixmap>
 
+#include "io/waveform.h"
+
 struct Sequence;
+class ProxyGenerator;
+class ConformGenerator;
 
 struct MediaStream {
 	int file_index;
@@ -17,10 +22,34 @@ struct MediaStream {
 	bool infinite_length;
     int audio_channels;
 
-    // preview thumbnail/waveform
-    bool preview_done;
+    // preview thumbnail/waveform, filled in on a worker before preview_done is set with storeRelease,
+    // so read them only after a loadAcquire of it
+    QAtomicInt preview_done;
     QImage video_preview; // TODO change to QPixmap
-    QVector<qint8> audio_preview;
+    Waveform waveform;
+
+    // running averages measured by the cachers (msecs), used to open clips early enough.
+    // several cachers can be measuring the same stream at once
+    QAtomicInt open_cost;
+    QAtomicInt seek_cost;
+    void add_cost(QAtomicInt* cost, qint64 msecs);
+
+    // seek index (video only, built by the preview generator). the vectors are filled in once on a
+    // worker before index_done is set with storeRelease, so read them only after a loadAcquire of it
+    QAtomicInt index_done;
+    QVector<int64_t> frame_pts; // timestamp (in AV_TIME_BASE units) of every frame in presentation order
+    QVector<int> keyframes; // indices into frame_pts that decoding can start from
+    long get_frame_from_pts(int64_t pts);
+    long get_keyframe_before(long frame);
+
+    int proxy_index; // stream in the media's proxy file, -1 if there's no proxy of this stream (valid once proxy_ready is set)
+
+    // audio already resampled to a sequence's format, see ConformGenerator (guarded by conform_lock,
+    // a newer conform replaces them while cachers may be opening the old one)
+    QMutex conform_lock;
+    QString conform_url;
+    quint64 conform_layout;
+    int conform_frequency; // 0 if there's no conformed file
 };
 
 struct Media
@@ -34,6 +63,10 @@ struct Media
     QVector<MediaStream*> video_tracks;
     QVector<MediaStream*> audio_tracks;
     int save_id;
+    QString proxy_url; // low resolution copy for playback, see ProxyGenerator
+    QAtomicInt proxy_ready; // set (release) once proxy_url and the streams' proxy_index are filled in
+    ProxyGenerator* proxy_generator;
+    ConformGenerator* conform_generator;
 	long get_length_in_frames(float frame_rate);
     MediaStream* get_stream_from_file_index(int index);
 };
@@ -5,11 +5,20 @@
 #include "previewgenerator.h"
 
 #include "media.h"
+#include "waveform.h"
+#include "cachedir.h"
+#include "playback/framecache.h"
 
 #include <QPainter>
 #include <QPixmap>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDir>
+#include <QStandardPaths>
+#include <QCryptographicHash>
 #include <QDebug>
 #include <QtMath>
+#include <algorithm>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -18,18 +27,32 @@ extern "C" {
 #include <libswresample/swresample.h>
 }
 
-PreviewGenerator::PreviewGenerator(QObject* parent) : QThread(parent) {
+#define WAVEFORM_CACHE_SIZE 256 // megabytes of saved peaks kept across sessions
+
+PreviewGenerator::PreviewGenerator() {
     media = NULL;
     fmt_ctx = NULL;
+    auto_delete = true;
+}
+
+static QString get_waveform_dir() {
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/waveforms";
 }
 
-#define WAVEFORM_RESOLUTION 64
+static QString get_waveform_filename(const QString& url, int file_index) {
+    // named like proxies so an unchanged file reuses the peaks from last time
+    QFileInfo info(url);
+    QByteArray id = (info.absoluteFilePath() + QString::number(info.size()) + QString::number(info.lastModified().toMSecsSinceEpoch())
+                     + ":" + QString::number(file_index)).toUtf8();
+    QDir dir(get_waveform_dir());
+    dir.mkpath(".");
+    return dir.filePath(QCryptographicHash::hash(id, QCryptographicHash::Md5).toHex() + ".peaks");
+}
 
 void PreviewGenerator::run() {
     Q_ASSERT(media != NULL);
 
     SwsContext* sws_ctx;
-    SwrContext* swr_ctx;
     AVFrame* temp_frame = av_frame_alloc();
     AVCodecContext** codec_ctx = new AVCodecContext* [fmt_ctx->nb_streams];
     for (unsigned int i=0;i<fmt_ctx->nb_streams;i++) {
@@ -45,22 +68,63 @@ void PreviewGenerator::run() {
             }
         }
     }
+
+    // audio streams with peaks saved from last time don't need decoding at all
+    QVector<Waveform*> waveforms(fmt_ctx->nb_streams, NULL);
+    QVector<SwrContext*> resamplers(fmt_ctx->nb_streams, NULL);
+    bool audio_needed = false;
+    for (int i=0;i<media->audio_tracks.size();i++) {
+        MediaStream* s = media->audio_tracks.at(i);
+        int index = s->file_index;
+        if (codec_ctx[index] == NULL) continue;
+        if (s->waveform.load(get_waveform_filename(media->url, index))) {
+            avcodec_free_context(&codec_ctx[index]);
+        } else {
+            waveforms[index] = new Waveform();
+            waveforms[index]->init(codec_ctx[index]->channels, codec_ctx[index]->sample_rate);
+
+            // peaks are taken from planar float at the stream's own rate and layout
+            resamplers[index] = swr_alloc_set_opts(
+                        NULL,
+                        codec_ctx[index]->channel_layout,
+                        AV_SAMPLE_FMT_FLTP,
+                        codec_ctx[index]->sample_rate,
+                        codec_ctx[index]->channel_layout,
+                        codec_ctx[index]->sample_fmt,
+                        codec_ctx[index]->sample_rate,
+                        0,
+                        NULL
+                        );
+            swr_init(resamplers[index]);
+            audio_needed = true;
+        }
+    }
+
     AVPacket packet;
     bool done = true;
+    bool complete = true; // every packet was read, the waveforms are worth saving
 
-    bool end_of_file = false;
+    bool end_of_file = (!audio_needed && media->video_tracks.isEmpty());
 
     // get the ball rolling
-    av_read_frame(fmt_ctx, &packet);
-    avcodec_send_packet(codec_ctx[packet.stream_index], &packet);
+    if (!end_of_file) {
+        av_read_frame(fmt_ctx, &packet);
+        if (codec_ctx[packet.stream_index] != NULL) avcodec_send_packet(codec_ctx[packet.stream_index], &packet);
+    }
 
     while (!end_of_file) {
+        // let playback work jump ahead of us if every other worker is busy
+        worker_pool->yield(TASK_PRIORITY_PREVIEW);
+
         while (codec_ctx[packet.stream_index] == NULL || avcodec_receive_frame(codec_ctx[packet.stream_index], temp_frame) == AVERROR(EAGAIN)) {
             av_packet_unref(&packet);
             int read_ret = av_read_frame(fmt_ctx, &packet);
             if (read_ret < 0) {
                 end_of_file = true;
-                if (read_ret != AVERROR_EOF) qDebug() << "[ERROR] Failed to read packet for preview generation" << read_ret;
+                if (read_ret != AVERROR_EOF) {
+                    qDebug() << "[ERROR] Failed to read packet for preview generation" << read_ret;
+                    complete = false;
+                }
                 break;
             }
             if (codec_ctx[packet.stream_index] != NULL) {
@@ -68,13 +132,14 @@ void PreviewGenerator::run() {
                 if (send_ret < 0 && send_ret != AVERROR(EAGAIN)) {
                     qDebug() << "[ERROR] Failed to send packet for preview generation - aborting" << send_ret;
                     end_of_file = true;
+                    complete = false;
                     break;
                 }
             }
         }
         if (!end_of_file) {
             MediaStream* s = media->get_stream_from_file_index(packet.stream_index);
-            if (s != NULL && !s->preview_done) {
+            if (s != NULL && !s->preview_done.load()) {
                 if (fmt_ctx->streams[packet.stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
                     int dstH = 120;
                     int dstW = dstH * ((float)temp_frame->width/(float)temp_frame->height);
@@ -101,65 +166,34 @@ void PreviewGenerator::run() {
 
                     //                                delete [] data;
 
-                    s->preview_done = true;
+                    // the timeline reads the thumbnail as soon as it sees this
+                    s->preview_done.storeRelease(1);
 
                     sws_freeContext(sws_ctx);
 
                     avcodec_close(codec_ctx[packet.stream_index]);
                     codec_ctx[packet.stream_index] = NULL;
                 } else if (fmt_ctx->streams[packet.stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-                    int interval = qFloor((temp_frame->sample_rate/WAVEFORM_RESOLUTION)/4)*4;
-
-                    AVFrame* swr_frame = av_frame_alloc();
-                    swr_frame->channel_layout = temp_frame->channel_layout;
-                    swr_frame->sample_rate = temp_frame->sample_rate;
-                    swr_frame->format = AV_SAMPLE_FMT_S16;
-
-                    swr_ctx = swr_alloc_set_opts(
-                                NULL,
-                                temp_frame->channel_layout,
-                                static_cast<AVSampleFormat>(swr_frame->format),
-                                temp_frame->sample_rate,
-                                temp_frame->channel_layout,
-                                static_cast<AVSampleFormat>(temp_frame->format),
-                                temp_frame->sample_rate,
-                                0,
-                                NULL
-                                );
+                    Waveform* w = waveforms.at(packet.stream_index);
+                    if (w != NULL) {
+                        AVFrame* swr_frame = av_frame_alloc();
+                        swr_frame->channel_layout = codec_ctx[packet.stream_index]->channel_layout;
+                        swr_frame->sample_rate = temp_frame->sample_rate;
+                        swr_frame->format = AV_SAMPLE_FMT_FLTP;
 
-                    swr_init(swr_ctx);
-
-                    swr_convert_frame(swr_ctx, swr_frame, temp_frame);
-
-                    int channel_skip = swr_frame->channels * 2;
-                    for (int i=0;i<swr_frame->nb_samples;i+=interval) {
-                        for (int j=0;j<swr_frame->channels;j++) {
-                            qint16 min = 0;
-                            qint16 max = 0;
-                            for (int k=j*2;k<interval;k+=channel_skip) {
-                                qint16 sample = ((swr_frame->data[0][i+k+1] << 8) | swr_frame->data[0][i+k]);
-                                if (sample > max) {
-                                    max = sample;
-                                } else if (sample < min) {
-                                    min = sample;
-                                }
-                            }
-                            min /= 256;
-                            max /= 256;
-                            s->audio_preview.append(min);
-                            s->audio_preview.append(max);
+                        if (swr_convert_frame(resamplers.at(packet.stream_index), swr_frame, temp_frame) >= 0) {
+                            w->add(reinterpret_cast<const float* const*>(swr_frame->extended_data), swr_frame->nb_samples);
                         }
-                    }
 
-                    swr_free(&swr_ctx);
-                    av_frame_free(&swr_frame);
+                        av_frame_free(&swr_frame);
+                    }
                 }
 
                 // check if we've got all our previews
-                if (media->audio_tracks.size() == 0) {
+                if (!audio_needed) {
                     done = true;
                     for (int i=0;i<media->video_tracks.size();i++) {
-                        if (!media->video_tracks.at(i)->preview_done) {
+                        if (!media->video_tracks.at(i)->preview_done.load()) {
                             done = false;
                             break;
                         }
@@ -174,7 +208,21 @@ void PreviewGenerator::run() {
         }
     }
     for (int i=0;i<media->audio_tracks.size();i++) {
-        media->audio_tracks.at(i)->preview_done = true;
+        MediaStream* s = media->audio_tracks.at(i);
+        Waveform* w = waveforms.at(s->file_index);
+        if (w != NULL) {
+            w->finish();
+            if (complete) {
+                QString filename = get_waveform_filename(media->url, s->file_index);
+                if (w->save(filename)) trim_cache_dir(get_waveform_dir(), qint64(WAVEFORM_CACHE_SIZE)*1024*1024, filename);
+            }
+            s->waveform = *w;
+            delete w;
+            swr_free(&resamplers[s->file_index]);
+        }
+
+        // the timeline reads the waveform as soon as it sees this
+        s->preview_done.storeRelease(1);
     }
     av_frame_free(&temp_frame);
     for (unsigned int i=0;i<fmt_ctx->nb_streams;i++) {
@@ -184,5 +232,67 @@ void PreviewGenerator::run() {
     }
     delete [] codec_ctx;
 
+    generate_index();
+
     avformat_close_input(&fmt_ctx);
 }
+
+void PreviewGenerator::generate_index() {
+    // one pass over the packets (no decoding) recording every video frame's timestamp
+    // and which ones are keyframes, so playback can seek straight to an exact frame.
+    // timestamps are stored in AV_TIME_BASE units so they also work for the proxy
+    if (av_seek_frame(fmt_ctx, -1, 0, AVSEEK_FLAG_BACKWARD) < 0) {
+        qDebug() << "[WARNING] Could not rewind" << media->url << "to build seek index";
+        return;
+    }
+
+    QVector< QVector<int64_t> > frame_pts(fmt_ctx->nb_streams);
+    QVector< QVector<int64_t> > key_pts(fmt_ctx->nb_streams);
+
+    AVPacket packet;
+    int packet_count = 0;
+    while (av_read_frame(fmt_ctx, &packet) >= 0) {
+        MediaStream* s = media->get_stream_from_file_index(packet.stream_index);
+        if (s != NULL
+                && fmt_ctx->streams[packet.stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO
+                && !s->infinite_length) {
+            int64_t ts = (packet.pts != AV_NOPTS_VALUE) ? packet.pts : packet.dts;
+            if (ts != AV_NOPTS_VALUE) {
+                ts = av_rescale_q(ts, fmt_ctx->streams[packet.stream_index]->time_base, AV_TIME_BASE_Q);
+                frame_pts[packet.stream_index].append(ts);
+                if (packet.flags & AV_PKT_FLAG_KEY) key_pts[packet.stream_index].append(ts);
+            }
+        }
+        av_packet_unref(&packet);
+
+        packet_count++;
+        if (packet_count % 256 == 0) {
+            worker_pool->yield(TASK_PRIORITY_PREVIEW);
+        }
+    }
+
+    for (int i=0;i<media->video_tracks.size();i++) {
+        MediaStream* s = media->video_tracks.at(i);
+        QVector<int64_t>& pts = frame_pts[s->file_index];
+        if (s->infinite_length || pts.isEmpty()) continue;
+
+        // packets come in decode order, frames are shown in presentation order
+        std::sort(pts.begin(), pts.end());
+        pts.erase(std::unique(pts.begin(), pts.end()), pts.end());
+
+        QVector<int> keyframes;
+        const QVector<int64_t>& keys = key_pts.at(s->file_index);
+        for (int j=0;j<keys.size();j++) {
+            keyframes.append(std::lower_bound(pts.constBegin(), pts.constEnd(), keys.at(j)) - pts.constBegin());
+        }
+        std::sort(keyframes.begin(), keyframes.end());
+        if (keyframes.isEmpty() || keyframes.first() != 0) keyframes.prepend(0);
+
+        s->frame_pts = pts;
+        s->keyframes = keyframes;
+        s->index_done.storeRelease(1);
+    }
+
+    // anything cached before now was numbered by guessing from the frame rate
+    frame_cache_remove_media(media);
+}
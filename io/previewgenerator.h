@@ -1,17 +1,18 @@
 #ifndef PREVIEWGENERATOR_H
 #define PREVIEWGENERATOR_H
 
-#include <QThread>
+#include "playback/workerpool.h"
 
 struct Media;
 struct MediaStream;
 struct AVFormatContext;
 
-class PreviewGenerator : public QThread
+class PreviewGenerator : public WorkerTask
 {
 public:
-    PreviewGenerator(QObject* parent = 0);
+    PreviewGenerator();
     void run();
+    void generate_index();
     Media* media;
     AVFormatContext* fmt_ctx;
 };
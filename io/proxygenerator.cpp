@@ -0,0 +1,270 @@
+#include "proxygenerator.h"
+
+#include "media.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDir>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <QVector>
+#include <QDebug>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+
+#define PROXY_HEIGHT 540 // streams taller than this get a proxy scaled down to it
+#define PROXY_QUALITY 4 // MJPEG quantizer (2-31, lower is better)
+
+struct ProxyStream {
+    AVCodecContext* dec;
+    AVCodecContext* enc;
+    AVStream* out;
+    SwsContext* sws;
+    AVFrame* scaled;
+};
+
+static bool needs_proxy(MediaStream* ms) {
+    return !ms->infinite_length && ms->video_height > PROXY_HEIGHT;
+}
+
+static bool encode_frame(AVFormatContext* out_ctx, ProxyStream& ps, AVFrame* f, AVPacket* pkt) {
+    // a NULL frame flushes the encoder
+    if (avcodec_send_frame(ps.enc, f) < 0) return false;
+    while (avcodec_receive_packet(ps.enc, pkt) == 0) {
+        av_packet_rescale_ts(pkt, ps.enc->time_base, ps.out->time_base);
+        pkt->stream_index = ps.out->index;
+        if (av_interleaved_write_frame(out_ctx, pkt) < 0) return false;
+    }
+    return true;
+}
+
+static bool decode_packet(AVFormatContext* out_ctx, ProxyStream& ps, AVPacket* in_pkt, AVFrame* frame, AVPacket* out_pkt) {
+    // a NULL packet drains the decoder. a packet it won't take is just skipped,
+    // the proxy is missing a frame but the original still has it
+    if (avcodec_send_packet(ps.dec, in_pkt) < 0) return true;
+    while (avcodec_receive_frame(ps.dec, frame) == 0) {
+        ps.sws = sws_getCachedContext(
+                    ps.sws,
+                    frame->width,
+                    frame->height,
+                    static_cast<AVPixelFormat>(frame->format),
+                    ps.enc->width,
+                    ps.enc->height,
+                    ps.enc->pix_fmt,
+                    SWS_BILINEAR,
+                    NULL,
+                    NULL,
+                    NULL
+                    );
+
+        // the encoder may still be holding on to the last frame we gave it
+        av_frame_make_writable(ps.scaled);
+        sws_scale(ps.sws, frame->data, frame->linesize, 0, frame->height, ps.scaled->data, ps.scaled->linesize);
+
+        // keep the original timestamps so frame numbers match between proxy and original
+        ps.scaled->pts = frame->best_effort_timestamp;
+        av_frame_unref(frame);
+
+        if (!encode_frame(out_ctx, ps, ps.scaled, out_pkt)) return false;
+    }
+    return true;
+}
+
+ProxyGenerator::ProxyGenerator(Media* m) : media(m), url(m->url) {
+    cancelled.store(0);
+}
+
+void ProxyGenerator::run() {
+    // the media may have been deleted while we were queued
+    if (cancelled.load()) return;
+
+    bool needed = false;
+    for (int i=0;i<media->video_tracks.size();i++) {
+        if (needs_proxy(media->video_tracks.at(i))) {
+            needed = true;
+            break;
+        }
+    }
+    if (!needed) return;
+
+    // proxies are named after the source's path, size and modification time, so an
+    // unchanged file (e.g. on reopening the project) reuses the one made last time
+    QFileInfo info(url);
+    QByteArray id = (info.absoluteFilePath() + QString::number(info.size()) + QString::number(info.lastModified().toMSecsSinceEpoch())).toUtf8();
+    QDir dir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/proxies");
+    dir.mkpath(".");
+    QString filename = dir.filePath(QCryptographicHash::hash(id, QCryptographicHash::Md5).toHex() + ".nut");
+
+    if (!QFile::exists(filename)) {
+        // write to a temporary name so a half-finished proxy is never picked up
+        QString temp_filename = filename + ".part";
+        if (!transcode(temp_filename) || !QFile::rename(temp_filename, filename)) {
+            QFile::remove(temp_filename);
+            if (!cancelled.load()) qDebug() << "[ERROR] Failed to generate proxy for" << url;
+            return;
+        }
+    }
+
+    // playback only looks at these once proxy_ready is set
+    media->proxy_url = filename;
+    int proxy_index = 0;
+    for (int i=0;i<media->video_tracks.size();i++) {
+        if (needs_proxy(media->video_tracks.at(i))) {
+            media->video_tracks.at(i)->proxy_index = proxy_index;
+            proxy_index++;
+        }
+    }
+    media->proxy_ready.storeRelease(1);
+
+    qDebug() << "[INFO] Proxy ready for" << url;
+}
+
+bool ProxyGenerator::transcode(const QString& filename) {
+    QByteArray in_ba = url.toUtf8();
+    QByteArray out_ba = filename.toUtf8();
+
+    AVFormatContext* in_ctx = NULL;
+    if (avformat_open_input(&in_ctx, in_ba.constData(), NULL, NULL) != 0) {
+        qDebug() << "[ERROR] Could not open" << url << "to generate proxy";
+        return false;
+    }
+    avformat_find_stream_info(in_ctx, NULL);
+
+    // NUT keeps whatever time base it's given, so the proxy's timestamps stay identical to the original's
+    AVFormatContext* out_ctx = NULL;
+    avformat_alloc_output_context2(&out_ctx, NULL, "nut", out_ba.constData());
+    if (out_ctx == NULL) {
+        qDebug() << "[ERROR] Could not create proxy file" << filename;
+        avformat_close_input(&in_ctx);
+        return false;
+    }
+
+    // indexed by the original's stream index, enc is NULL for streams that aren't proxied
+    QVector<ProxyStream> streams(in_ctx->nb_streams);
+    for (int i=0;i<streams.size();i++) {
+        streams[i].dec = NULL;
+        streams[i].enc = NULL;
+        streams[i].out = NULL;
+        streams[i].sws = NULL;
+        streams[i].scaled = NULL;
+    }
+
+    bool ok = true;
+    for (int i=0;i<media->video_tracks.size() && ok;i++) {
+        MediaStream* ms = media->video_tracks.at(i);
+        if (!needs_proxy(ms)) continue;
+
+        AVStream* in_stream = in_ctx->streams[ms->file_index];
+        ProxyStream& ps = streams[ms->file_index];
+
+        AVCodec* decoder = avcodec_find_decoder(in_stream->codecpar->codec_id);
+        ps.dec = avcodec_alloc_context3(decoder);
+        avcodec_parameters_to_context(ps.dec, in_stream->codecpar);
+        AVDictionary* opts = NULL;
+        av_dict_set(&opts, "threads", "auto", 0);
+        if (avcodec_open2(ps.dec, decoder, &opts) < 0) {
+            qDebug() << "[ERROR] Could not open decoder to generate proxy";
+            ok = false;
+        }
+        av_dict_free(&opts);
+
+        // MJPEG is intra-only, so any frame of the proxy can be decoded without its neighbors
+        AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+        ps.enc = avcodec_alloc_context3(encoder);
+        ps.enc->height = PROXY_HEIGHT;
+        ps.enc->width = qRound(PROXY_HEIGHT * ((double) in_stream->codecpar->width / (double) in_stream->codecpar->height) / 2) * 2;
+        ps.enc->sample_aspect_ratio = in_stream->codecpar->sample_aspect_ratio;
+        ps.enc->pix_fmt = AV_PIX_FMT_YUVJ420P;
+        ps.enc->time_base = in_stream->time_base;
+        ps.enc->framerate = av_guess_frame_rate(in_ctx, in_stream, NULL);
+        ps.enc->colorspace = in_stream->codecpar->color_space;
+        ps.enc->color_primaries = in_stream->codecpar->color_primaries;
+        ps.enc->color_trc = in_stream->codecpar->color_trc;
+        ps.enc->flags |= AV_CODEC_FLAG_QSCALE;
+        ps.enc->global_quality = FF_QP2LAMBDA * PROXY_QUALITY;
+        if (out_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+            ps.enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+        if (ok && avcodec_open2(ps.enc, encoder, NULL) < 0) {
+            qDebug() << "[ERROR] Could not open encoder to generate proxy";
+            ok = false;
+        }
+
+        ps.out = avformat_new_stream(out_ctx, NULL);
+        avcodec_parameters_from_context(ps.out->codecpar, ps.enc);
+        ps.out->time_base = ps.enc->time_base;
+        ps.out->avg_frame_rate = in_stream->avg_frame_rate;
+        ps.out->r_frame_rate = in_stream->r_frame_rate;
+
+        ps.scaled = av_frame_alloc();
+        ps.scaled->format = ps.enc->pix_fmt;
+        ps.scaled->width = ps.enc->width;
+        ps.scaled->height = ps.enc->height;
+        av_frame_get_buffer(ps.scaled, 0);
+    }
+
+    bool header_written = false;
+    if (ok) {
+        if (avio_open(&out_ctx->pb, out_ba.constData(), AVIO_FLAG_WRITE) < 0) {
+            qDebug() << "[ERROR] Could not open proxy file" << filename;
+            ok = false;
+        } else if (avformat_write_header(out_ctx, NULL) < 0) {
+            qDebug() << "[ERROR] Could not write proxy header";
+            ok = false;
+        } else {
+            header_written = true;
+        }
+    }
+
+    AVPacket* in_pkt = av_packet_alloc();
+    AVPacket* out_pkt = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+
+    int packet_count = 0;
+    while (ok && av_read_frame(in_ctx, in_pkt) >= 0) {
+        if (in_pkt->stream_index < streams.size() && streams.at(in_pkt->stream_index).enc != NULL) {
+            ok = decode_packet(out_ctx, streams[in_pkt->stream_index], in_pkt, frame, out_pkt);
+        }
+        av_packet_unref(in_pkt);
+
+        if (cancelled.load()) ok = false;
+
+        // this can take minutes, let playback work jump ahead of us
+        packet_count++;
+        if (packet_count % 16 == 0) {
+            worker_pool->yield(TASK_PRIORITY_PREVIEW);
+        }
+    }
+
+    // drain whatever the decoders and encoders are still holding on to
+    for (int i=0;i<streams.size() && ok;i++) {
+        if (streams.at(i).enc != NULL) {
+            ok = decode_packet(out_ctx, streams[i], NULL, frame, out_pkt)
+                    && encode_frame(out_ctx, streams[i], NULL, out_pkt);
+        }
+    }
+
+    if (header_written && av_write_trailer(out_ctx) < 0) {
+        ok = false;
+    }
+
+    av_frame_free(&frame);
+    av_packet_free(&in_pkt);
+    av_packet_free(&out_pkt);
+    for (int i=0;i<streams.size();i++) {
+        avcodec_free_context(&streams[i].dec);
+        avcodec_free_context(&streams[i].enc);
+        sws_freeContext(streams[i].sws);
+        av_frame_free(&streams[i].scaled);
+    }
+    avio_closep(&out_ctx->pb);
+    avformat_free_context(out_ctx);
+    avformat_close_input(&in_ctx);
+
+    return ok;
+}
@@ -0,0 +1,28 @@
+#ifndef PROXYGENERATOR_H
+#define PROXYGENERATOR_H
+
+#include "playback/workerpool.h"
+
+#include <QString>
+#include <QAtomicInt>
+
+struct Media;
+
+// transcodes a media's video streams to a small intra-only MJPEG file the viewer
+// can decode instead of the original (see use_proxies in io/config.h). timestamps
+// are copied as-is so the original's seek index works for the proxy too
+class ProxyGenerator : public WorkerTask
+{
+public:
+    ProxyGenerator(Media* m);
+    void run();
+
+    // set by the media's destructor, makes a running transcode give up
+    QAtomicInt cancelled;
+private:
+    bool transcode(const QString& filename);
+    Media* media;
+    QString url;
+};
+
+#endif // PROXYGENERATOR_H
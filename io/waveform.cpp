@@ -0,0 +1,221 @@
+#include "waveform.h"
+
+#include <QFile>
+#include <QDataStream>
+#include <QtMath>
+#include <QDebug>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define WAVEFORM_MAGIC 0x4F4C5750 // "OLWP"
+#define WAVEFORM_VERSION 1
+
+static void summarize(const float* samples, int nb_samples, float* min, float* max, float* sum) {
+    // folds a run of samples into a running min, max and sum of squares
+    int i = 0;
+#if defined(__SSE2__)
+    if (nb_samples >= 4) {
+        __m128 vmin = _mm_set1_ps(*min);
+        __m128 vmax = _mm_set1_ps(*max);
+        __m128 vsum = _mm_setzero_ps();
+        for (;i+4<=nb_samples;i+=4) {
+            __m128 s = _mm_loadu_ps(samples+i);
+            vmin = _mm_min_ps(vmin, s);
+            vmax = _mm_max_ps(vmax, s);
+            vsum = _mm_add_ps(vsum, _mm_mul_ps(s, s));
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, vmin);
+        *min = qMin(qMin(lanes[0], lanes[1]), qMin(lanes[2], lanes[3]));
+        _mm_storeu_ps(lanes, vmax);
+        *max = qMax(qMax(lanes[0], lanes[1]), qMax(lanes[2], lanes[3]));
+        _mm_storeu_ps(lanes, vsum);
+        *sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#elif defined(__ARM_NEON)
+    if (nb_samples >= 4) {
+        float32x4_t vmin = vdupq_n_f32(*min);
+        float32x4_t vmax = vdupq_n_f32(*max);
+        float32x4_t vsum = vdupq_n_f32(0.0f);
+        for (;i+4<=nb_samples;i+=4) {
+            float32x4_t s = vld1q_f32(samples+i);
+            vmin = vminq_f32(vmin, s);
+            vmax = vmaxq_f32(vmax, s);
+            vsum = vmlaq_f32(vsum, s, s);
+        }
+        float lanes[4];
+        vst1q_f32(lanes, vmin);
+        *min = qMin(qMin(lanes[0], lanes[1]), qMin(lanes[2], lanes[3]));
+        vst1q_f32(lanes, vmax);
+        *max = qMax(qMax(lanes[0], lanes[1]), qMax(lanes[2], lanes[3]));
+        vst1q_f32(lanes, vsum);
+        *sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif
+    for (;i<nb_samples;i++) {
+        *min = qMin(*min, samples[i]);
+        *max = qMax(*max, samples[i]);
+        *sum += samples[i]*samples[i];
+    }
+}
+
+Waveform::Waveform() {
+    channels = 0;
+    sample_rate = 0;
+    block_fill = 0;
+}
+
+void Waveform::init(int c, int rate) {
+    channels = c;
+    sample_rate = rate;
+    levels.clear();
+    levels.resize(1);
+    block_min.fill(0.0f, channels);
+    block_max.fill(0.0f, channels);
+    block_sum.fill(0.0f, channels);
+    block_fill = 0;
+}
+
+void Waveform::add(const float* const* planes, int nb_samples) {
+    int offset = 0;
+    while (offset < nb_samples) {
+        int len = qMin(nb_samples - offset, WAVEFORM_BASE - block_fill);
+        for (int i=0;i<channels;i++) {
+            summarize(planes[i] + offset, len, &block_min[i], &block_max[i], &block_sum[i]);
+        }
+        block_fill += len;
+        offset += len;
+        if (block_fill == WAVEFORM_BASE) add_block();
+    }
+}
+
+void Waveform::add_block() {
+    for (int i=0;i<channels;i++) {
+        WaveformPeak p;
+        p.min = qBound(-127, qRound(block_min.at(i) * 127), 127);
+        p.max = qBound(-127, qRound(block_max.at(i) * 127), 127);
+        p.rms = qBound(0, qRound(qSqrt(block_sum.at(i) / block_fill) * 255), 255);
+        levels[0].append(p);
+        block_min[i] = 0.0f;
+        block_max[i] = 0.0f;
+        block_sum[i] = 0.0f;
+    }
+    block_fill = 0;
+}
+
+void Waveform::finish() {
+    if (block_fill > 0) add_block();
+    block_min.clear();
+    block_max.clear();
+    block_sum.clear();
+    build_levels();
+}
+
+void Waveform::build_levels() {
+    // each level combines WAVEFORM_FACTOR peaks of the one below until one is left
+    levels.resize(1);
+    while (channels > 0 && levels.last().size() > channels) {
+        const QVector<WaveformPeak>& below = levels.last();
+        int below_count = below.size() / channels;
+        int count = (below_count + WAVEFORM_FACTOR - 1) / WAVEFORM_FACTOR;
+        QVector<WaveformPeak> level(count*channels);
+        for (int i=0;i<count;i++) {
+            int first = i*WAVEFORM_FACTOR;
+            int last = qMin(first + WAVEFORM_FACTOR, below_count);
+            for (int j=0;j<channels;j++) {
+                WaveformPeak& p = level[i*channels+j];
+                int min = 127;
+                int max = -127;
+                qint64 sum = 0;
+                for (int k=first;k<last;k++) {
+                    const WaveformPeak& b = below.at(k*channels+j);
+                    min = qMin(min, (int) b.min);
+                    max = qMax(max, (int) b.max);
+                    sum += b.rms*b.rms;
+                }
+                p.min = min;
+                p.max = max;
+                p.rms = qRound(qSqrt((double) sum / (last - first)));
+            }
+        }
+        levels.append(level);
+    }
+}
+
+qint64 Waveform::get_samples_per_peak(int level) const {
+    qint64 samples = WAVEFORM_BASE;
+    for (int i=0;i<level;i++) samples *= WAVEFORM_FACTOR;
+    return samples;
+}
+
+int Waveform::get_level(double samples_per_pixel) const {
+    int level = 0;
+    while (level+1 < levels.size() && get_samples_per_peak(level+1) <= samples_per_pixel) {
+        level++;
+    }
+    return level;
+}
+
+bool Waveform::get_peak(int level, int channel, qint64 start, qint64 end, WaveformPeak* peak) const {
+    if (level < 0 || level >= levels.size() || channel >= channels) return false;
+    const QVector<WaveformPeak>& peaks = levels.at(level);
+    qint64 count = peaks.size() / channels;
+    qint64 samples = get_samples_per_peak(level);
+    qint64 first = qMax(0LL, start / samples);
+    qint64 last = qMin(count, qMax(first + 1, (end + samples - 1) / samples));
+    if (first >= last) return false;
+
+    int min = 127;
+    int max = -127;
+    qint64 sum = 0;
+    for (qint64 i=first;i<last;i++) {
+        const WaveformPeak& p = peaks.at(i*channels+channel);
+        min = qMin(min, (int) p.min);
+        max = qMax(max, (int) p.max);
+        sum += p.rms*p.rms;
+    }
+    peak->min = min;
+    peak->max = max;
+    peak->rms = qRound(qSqrt((double) sum / (last - first)));
+    return true;
+}
+
+bool Waveform::save(const QString& filename) const {
+    if (levels.isEmpty()) return false;
+    QFile f(filename);
+    if (!f.open(QFile::WriteOnly | QFile::Truncate)) {
+        qDebug() << "[WARNING] Could not save waveform to" << filename;
+        return false;
+    }
+    QDataStream stream(&f);
+    stream << (quint32) WAVEFORM_MAGIC << (quint32) WAVEFORM_VERSION << (qint32) channels << (qint32) sample_rate << (qint32) levels.at(0).size();
+    int len = levels.at(0).size() * sizeof(WaveformPeak);
+    return stream.writeRawData(reinterpret_cast<const char*>(levels.at(0).constData()), len) == len;
+}
+
+bool Waveform::load(const QString& filename) {
+    QFile f(filename);
+    if (!f.open(QFile::ReadOnly)) return false;
+    QDataStream stream(&f);
+    quint32 magic, version;
+    qint32 c, rate, count;
+    stream >> magic >> version >> c >> rate >> count;
+    if (stream.status() != QDataStream::Ok || magic != WAVEFORM_MAGIC || version != WAVEFORM_VERSION || c <= 0 || count < 0) {
+        return false;
+    }
+
+    QVector<WaveformPeak> peaks(count);
+    int len = count * sizeof(WaveformPeak);
+    if (stream.readRawData(reinterpret_cast<char*>(peaks.data()), len) != len) return false;
+
+    channels = c;
+    sample_rate = rate;
+    levels.clear();
+    levels.append(peaks);
+    build_levels();
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <QVector>
+#include <QString>
+
+#define WAVEFORM_BASE 256 // source samples summarized by each peak of the finest level
+#define WAVEFORM_FACTOR 4 // peaks of one level summarized by each peak of the next
+
+struct WaveformPeak {
+    qint8 min; // -127 to 127
+    qint8 max;
+    quint8 rms; // 0 to 255
+};
+
+// min/max/RMS peaks of an audio stream at a pyramid of resolutions, so the timeline
+// only ever looks at about one peak per pixel however far it's zoomed out
+class Waveform {
+public:
+    Waveform();
+
+    // building (preview generator only) - feed every sample in order then finish()
+    void init(int c, int rate);
+    void add(const float* const* planes, int nb_samples);
+    void finish();
+
+    // the coarsest level that still has at least one peak per pixel
+    int get_level(double samples_per_pixel) const;
+    qint64 get_samples_per_peak(int level) const;
+
+    // all of a channel's peaks at a level between two source samples combined, false if past the end
+    bool get_peak(int level, int channel, qint64 start, qint64 end, WaveformPeak* peak) const;
+
+    // sidecar cache, only the finest level is stored and the rest rebuilt on load
+    bool save(const QString& filename) const;
+    bool load(const QString& filename);
+
+    int channels;
+    int sample_rate;
+    QVector< QVector<WaveformPeak> > levels; // [0] is finest, peaks interleaved by channel
+private:
+    void add_block();
+    void build_levels();
+    QVector<float> block_min;
+    QVector<float> block_max;
+    QVector<float> block_sum; // sum of squares
+    int block_fill;
+};
+
+#endif // WAVEFORM_H
@@ -1,4 +1,8 @@
 #include "mainwindow.h"
+#include "io/config.h"
+#include "io/cliexport.h"
+#include "playback/workerpool.h"
+#include "playback/decoderpool.h"
 #include <QApplication>
 
 extern "C" {
@@ -10,9 +14,33 @@ int main(int argc, char *argv[])
 	// init ffmpeg subsystem
     av_register_all();
 
+    // exporting from the command line needs no display, use the offscreen platform if there isn't one
+    headless = is_cli_export(argc, argv);
+#ifdef Q_OS_LINUX
+    if (headless && qgetenv("QT_QPA_PLATFORM").isEmpty() && qgetenv("DISPLAY").isEmpty() && qgetenv("WAYLAND_DISPLAY").isEmpty()) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+#endif
+
 	QApplication a(argc, argv);
-	MainWindow w;
-	w.show();
+	init_worker_pool();
+
+	int ret;
+	{
+		// the panels are needed either way, only the GUI shows them
+		MainWindow w;
+		if (headless) {
+			CliExport cli;
+			ret = cli.run();
+		} else {
+			w.show();
+
+			ret = a.exec();
+		}
+	}
+
+	close_worker_pool();
+	decoder_pool_clear();
 
-	return a.exec();
+	return ret;
 }
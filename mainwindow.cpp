@@ -13,6 +13,9 @@
 
 #include "project/undo.h"
 
+#include "playback/playback.h"
+#include "ui/viewerwidget.h"
+
 #include "dialogs/aboutdialog.h"
 #include "dialogs/newsequencedialog.h"
 #include "dialogs/exportdialog.h"
@@ -96,8 +99,9 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->menuEdit, SIGNAL(aboutToShow()), this, SLOT(editMenu_About_To_Be_Shown()));
     connect(ui->menu_File, SIGNAL(aboutToShow()), this, SLOT(fileMenu_About_To_Be_Shown()));
 
+    // a command-line export leaves auto-recovery and recent projects to the GUI
     QString data_dir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
-    if (!data_dir.isEmpty()) {
+    if (!data_dir.isEmpty() && !headless) {
         QDir dir(data_dir);
         dir.mkpath(".");
         if (dir.exists()) {
@@ -209,6 +213,47 @@ void MainWindow::on_actionTimeline_Track_Lines_toggled(bool e)
     panel_timeline->redraw_all_clips(false);
 }
 
+void MainWindow::on_actionUse_Proxies_toggled(bool e)
+{
+    use_proxies = e;
+
+    // reopen whatever's on screen from the other file
+    if (sequence != NULL) {
+        close_active_clips(sequence, false);
+        panel_viewer->viewer_widget->update();
+    }
+}
+
+void set_playback_resolution(int divider) {
+    playback_divider = divider;
+
+    // reopen whatever's on screen at the new size
+    if (sequence != NULL) {
+        close_active_clips(sequence, false);
+        panel_viewer->viewer_widget->update();
+    }
+}
+
+void MainWindow::on_actionFull_Resolution_triggered()
+{
+    set_playback_resolution(1);
+}
+
+void MainWindow::on_actionHalf_Resolution_triggered()
+{
+    set_playback_resolution(2);
+}
+
+void MainWindow::on_actionQuarter_Resolution_triggered()
+{
+    set_playback_resolution(4);
+}
+
+void MainWindow::on_actionEighth_Resolution_triggered()
+{
+    set_playback_resolution(8);
+}
+
 void MainWindow::on_actionExport_triggered()
 {
     if (sequence == NULL) {
@@ -419,6 +464,27 @@ void MainWindow::on_actionPlay_Pause_triggered()
     }
 }
 
+void MainWindow::on_actionShuttle_Left_triggered()
+{
+    if (panel_timeline->focused() || panel_viewer->hasFocus()) {
+        panel_timeline->shuttle_left();
+    }
+}
+
+void MainWindow::on_actionShuttle_Stop_triggered()
+{
+    if (panel_timeline->focused() || panel_viewer->hasFocus()) {
+        panel_timeline->shuttle_stop();
+    }
+}
+
+void MainWindow::on_actionShuttle_Right_triggered()
+{
+    if (panel_timeline->focused() || panel_viewer->hasFocus()) {
+        panel_timeline->shuttle_right();
+    }
+}
+
 void MainWindow::on_actionCrash_triggered()
 {
     if (QMessageBox::warning(this, "Are you sure you want to crash?", "WARNING: This is a debugging function designed to crash the program. Olive WILL crash and any unsaved progress WILL be lost. Are you sure you wish to do this?", QMessageBox::Yes, QMessageBox::No) == QMessageBox::Yes) {
@@ -505,6 +571,12 @@ void MainWindow::viewMenu_About_To_Be_Shown() {
     ui->actionDrop_Frame->setChecked(panel_viewer->timecode_view == TIMECODE_DROP);
     if (sequence != NULL) ui->actionDrop_Frame->setEnabled(frame_rate_is_droppable(sequence->frame_rate));
     ui->actionNon_Drop_Frame->setChecked(panel_viewer->timecode_view == TIMECODE_NONDROP);
+
+    ui->actionUse_Proxies->setChecked(use_proxies);
+    ui->actionFull_Resolution->setChecked(playback_divider == 1);
+    ui->actionHalf_Resolution->setChecked(playback_divider == 2);
+    ui->actionQuarter_Resolution->setChecked(playback_divider == 4);
+    ui->actionEighth_Resolution->setChecked(playback_divider == 8);
 }
 
 void MainWindow::on_actionFrames_triggered()
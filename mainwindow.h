@@ -42,6 +42,16 @@ private slots:
 
 	void on_actionTimeline_Track_Lines_toggled(bool arg1);
 
+    void on_actionUse_Proxies_toggled(bool arg1);
+
+    void on_actionFull_Resolution_triggered();
+
+    void on_actionHalf_Resolution_triggered();
+
+    void on_actionQuarter_Resolution_triggered();
+
+    void on_actionEighth_Resolution_triggered();
+
 	void on_actionExport_triggered();
 
 	void on_actionProject_2_toggled(bool arg1);
@@ -88,6 +98,12 @@ private slots:
 
     void on_actionPlay_Pause_triggered();
 
+    void on_actionShuttle_Left_triggered();
+
+    void on_actionShuttle_Stop_triggered();
+
+    void on_actionShuttle_Right_triggered();
+
     void on_actionCrash_triggered();
 
     void on_actionEdit_Tool_triggered();
@@ -38,6 +38,7 @@ SOURCES += \
     project/clip.cpp \
     playback/playback.cpp \
     playback/audio.cpp \
+    playback/audioringbuffer.cpp \
     io/config.cpp \
     dialogs/newsequencedialog.cpp \
     ui/viewerwidget.cpp \
@@ -61,7 +62,16 @@ SOURCES += \
     ui/audiomonitor.cpp \
     project/undo.cpp \
     ui/scrollarea.cpp \
-    effects/shakeeffect.cpp
+    effects/shakeeffect.cpp \
+    playback/workerpool.cpp \
+    playback/framecache.cpp \
+    playback/decoderpool.cpp \
+    playback/frameuploader.cpp \
+    io/proxygenerator.cpp \
+    io/conformgenerator.cpp \
+    io/waveform.cpp \
+    io/cliexport.cpp \
+    io/cachedir.cpp
 
 HEADERS += \
         mainwindow.h \
@@ -77,6 +87,7 @@ HEADERS += \
     project/clip.h \
     playback/playback.h \
     playback/audio.h \
+    playback/audioringbuffer.h \
     effects/effects.h \
     io/config.h \
     dialogs/newsequencedialog.h \
@@ -96,7 +107,16 @@ HEADERS += \
     effects/transition.h \
     ui/audiomonitor.h \
     project/undo.h \
-    ui/scrollarea.h
+    ui/scrollarea.h \
+    playback/workerpool.h \
+    playback/framecache.h \
+    playback/decoderpool.h \
+    playback/frameuploader.h \
+    io/proxygenerator.h \
+    io/conformgenerator.h \
+    io/waveform.h \
+    io/cliexport.h \
+    io/cachedir.h
 
 FORMS += \
         mainwindow.ui \
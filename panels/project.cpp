@@ -12,6 +12,10 @@
 #include "project/effect.h"
 #include "effects/transition.h"
 #include "io/previewgenerator.h"
+#include "io/proxygenerator.h"
+#include "io/config.h"
+#include "playback/workerpool.h"
+#include "playback/framecache.h"
 #include "project/undo.h"
 #include "mainwindow.h"
 
@@ -26,6 +30,7 @@
 #include <QPushButton>
 #include <QXmlStreamReader>
 #include <QXmlStreamWriter>
+#include <QTreeWidgetItemIterator>
 
 extern "C" {
 	#include <libavformat/avformat.h>
@@ -143,7 +148,13 @@ QTreeWidgetItem* Project::import_file(QString file) {
                     qDebug() << "[ERROR] Unsupported codec in stream %d.\n";
                 } else {
                     MediaStream* ms = new MediaStream();
-                    ms->preview_done = false;
+                    ms->preview_done.store(0);
+                    ms->index_done.store(0);
+                    ms->open_cost.store(0);
+                    ms->seek_cost.store(0);
+                    ms->proxy_index = -1;
+                    ms->conform_layout = 0;
+                    ms->conform_frequency = 0;
                     ms->file_index = i;
                     if (pFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
                         bool infinite_length = (pFormatCtx->streams[i]->avg_frame_rate.den == 0);
@@ -171,12 +182,21 @@ QTreeWidgetItem* Project::import_file(QString file) {
 
             project_changed = true;
 
-            // generate waveform/thumbnail in another thread
-            PreviewGenerator* pg = new PreviewGenerator();
-            pg->fmt_ctx = pFormatCtx; // cleaned up in PG
-            pg->media = m;
-            connect(pg, SIGNAL(finished()), pg, SLOT(deleteLater()));
-            pg->start(QThread::LowPriority);
+            if (headless) {
+                // nothing's shown and nothing plays, don't decode every file for previews and proxies
+                // while a render is running
+                avformat_close_input(&pFormatCtx);
+            } else {
+                // generate waveform/thumbnail in another thread
+                PreviewGenerator* pg = new PreviewGenerator();
+                pg->fmt_ctx = pFormatCtx; // cleaned up in PG
+                pg->media = m;
+                worker_pool->submit(pg, TASK_PRIORITY_PREVIEW);
+
+                // and a proxy (skipped if the footage is small enough already)
+                m->proxy_generator = new ProxyGenerator(m);
+                worker_pool->submit(m->proxy_generator, TASK_PRIORITY_PREVIEW);
+            }
         }
     }
 
@@ -444,6 +464,10 @@ void Project::clear() {
 void Project::new_project() {
     // clear existing project
     set_sequence(NULL);
+
+    // every clip's closed now, drop all their frames in one go rather than media by media
+    frame_cache_clear();
+
     clear();
     project_changed = false;
 }
@@ -488,7 +512,9 @@ bool Project::load_worker(QFile& f, QXmlStreamReader& stream, int type) {
         if (stream.name() == root_search) {
             if (type == LOAD_TYPE_VERSION) {
                 if (stream.readElementText() != SAVE_VERSION) {
-                    if (QMessageBox::warning(this, "Version Mismatch", "This project was saved in a different version of Olive and may not be fully compatible with this version. Would you like to attempt loading it anyway?", QMessageBox::Yes, QMessageBox::No) == QMessageBox::No) {
+                    if (headless) {
+                        qDebug() << "[WARNING] Project was saved in a different version of Olive, loading it anyway";
+                    } else if (QMessageBox::warning(this, "Version Mismatch", "This project was saved in a different version of Olive and may not be fully compatible with this version. Would you like to attempt loading it anyway?", QMessageBox::Yes, QMessageBox::No) == QMessageBox::No) {
                         error_str = "Incompatible project version.";
                         return false;
                     }
@@ -676,7 +702,9 @@ bool Project::load_worker(QFile& f, QXmlStreamReader& stream, int type) {
                                     if (!found) {
                                         correct_clip->linked.removeAt(j);
                                         j--;
-                                        if (QMessageBox::warning(this, "Invalid Clip Link", "This project contains an invalid clip link. It may be corrupt. Would you like to continue loading it?", QMessageBox::Yes, QMessageBox::No) == QMessageBox::No) {
+                                        if (headless) {
+                                            qDebug() << "[WARNING] Project contains an invalid clip link, ignoring it";
+                                        } else if (QMessageBox::warning(this, "Invalid Clip Link", "This project contains an invalid clip link. It may be corrupt. Would you like to continue loading it?", QMessageBox::Yes, QMessageBox::No) == QMessageBox::No) {
                                             delete s;
                                             return false;
                                         }
@@ -697,13 +725,13 @@ bool Project::load_worker(QFile& f, QXmlStreamReader& stream, int type) {
     return true;
 }
 
-void Project::load_project() {
+bool Project::load_project() {
     new_project();
 
     QFile file(project_url);
     if (!file.open(QIODevice::ReadOnly)) {
         qDebug() << "[ERROR] Could not open file";
-        return;
+        return false;
     }
 
     QXmlStreamReader stream(&file);
@@ -744,10 +772,11 @@ void Project::load_project() {
     }
 
     if (!cont) {
-        QMessageBox::critical(this, "Project Load Error", "Error loading project: " + error_str, QMessageBox::Ok);
+        qDebug() << "[ERROR] Error loading project:" << error_str;
+        if (!headless) QMessageBox::critical(this, "Project Load Error", "Error loading project: " + error_str, QMessageBox::Ok);
     } else if (stream.hasError()) {
         qDebug() << "[ERROR] Error parsing XML." << stream.errorString();
-        QMessageBox::critical(this, "XML Parsing Error", "Couldn't load '" + project_url + "'. " + stream.errorString(), QMessageBox::Ok);
+        if (!headless) QMessageBox::critical(this, "XML Parsing Error", "Couldn't load '" + project_url + "'. " + stream.errorString(), QMessageBox::Ok);
         cont = false;
     }
 
@@ -759,6 +788,18 @@ void Project::load_project() {
     }
 
     file.close();
+    return cont;
+}
+
+Sequence* Project::find_sequence(const QString& name) {
+    // searches folders too, an empty name matches the first sequence found
+    for (QTreeWidgetItemIterator it(ui->treeWidget); *it != NULL; ++it) {
+        if (get_type_from_tree(*it) == MEDIA_TYPE_SEQUENCE) {
+            Sequence* s = get_sequence_from_tree(*it);
+            if (name.isEmpty() || s->name == name) return s;
+        }
+    }
+    return NULL;
 }
 
 void Project::save_folder(QXmlStreamWriter& stream, QTreeWidgetItem* parent, int type) {
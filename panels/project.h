@@ -52,8 +52,9 @@ public:
     void duplicate_selected();
 
     void new_project();
-    void load_project();
+    bool load_project();
     void save_project();
+    Sequence* find_sequence(const QString& name);
 
     QTreeWidgetItem* new_folder();
 
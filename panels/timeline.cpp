@@ -17,6 +17,7 @@
 #include "project/undo.h"
 
 #include <QTime>
+#include <QDebug>
 #include <QScrollBar>
 #include <QtMath>
 
@@ -30,6 +31,9 @@ Timeline::Timeline(QWidget *parent) :
     splitting = false;
     importing = false;
     playing = false;
+    playback_speed = 1;
+    audio_clock = false;
+    scrubbing = false;
     trim_in_point = false;
     snapped = false;
     rect_select_init = false;
@@ -120,13 +124,12 @@ void Timeline::next_cut() {
 }
 
 void Timeline::reset_all_audio() {
-    // reset all clip audio
+    // reset all clip audio. the cachers own the clips' mixing state, each one starts over
+    // (closing its old writer) when the viewer next asks it for audio
     for (int i=0;i<sequence->clip_count();i++) {
         Clip* c = sequence->get_clip(i);
         if (c != NULL) {
-            c->reset_audio = true;
-            c->frame_sample_index = 0;
-            c->audio_buffer_write = 0;
+            c->reset_audio.storeRelease(1);
         }
     }
     ui->audio_monitor->reset();
@@ -155,14 +158,65 @@ void Timeline::toggle_play() {
 void Timeline::play() {
     playhead_start = playhead;
     start_msecs = QDateTime::currentMSecsSinceEpoch();
+
+    // sound only plays at normal speed, so only then can it be what we keep time by
+    audio_clock = (playback_speed == 1 && start_audio_clock());
+    if (!audio_clock) stop_audio_clock();
+    reset_playback_stats();
+    panel_viewer->update_playback_stats();
+
 	playback_updater.start();
     playing = true;
     panel_viewer->set_playpause_icon(false);
+
+    // the viewer is what gets the clips mixing into the audio buffer, get it going so the clock starts moving
+    panel_viewer->viewer_widget->update();
 }
 
 void Timeline::pause() {
+    if (playing && playback_speed == 1) {
+        qDebug() << "[INFO] Playback stopped -" << dropped_frames << "frames dropped, A/V offset" << av_offset << "ms," << get_audio_underruns() << "audio underruns";
+    }
+    stop_audio_clock();
 	playing = false;
+    playback_speed = 1;
     panel_viewer->set_playpause_icon(true);
+    panel_viewer->update_playback_stats();
+}
+
+#define SHUTTLE_MAX_SPEED 8
+
+void Timeline::set_playback_speed(int speed) {
+    if (speed == 0) {
+        pause();
+    } else {
+        // audio only plays at normal speed, make sure it picks up from here when we get back to it
+        reset_all_audio();
+        audio_ibuffer_frame = playhead;
+
+        playback_speed = speed;
+        play();
+    }
+}
+
+void Timeline::shuttle_left() {
+    if (playing && playback_speed < 0) {
+        set_playback_speed(qMax(playback_speed*2, -SHUTTLE_MAX_SPEED));
+    } else {
+        set_playback_speed(-1);
+    }
+}
+
+void Timeline::shuttle_stop() {
+    set_playback_speed(0);
+}
+
+void Timeline::shuttle_right() {
+    if (playing && playback_speed > 0) {
+        set_playback_speed(qMin(playback_speed*2, SHUTTLE_MAX_SPEED));
+    } else {
+        set_playback_speed(1);
+    }
 }
 
 void Timeline::go_to_end() {
@@ -235,9 +289,25 @@ bool Timeline::focused() {
     return (ui->headers->hasFocus() || ui->video_area->hasFocus() || ui->audio_area->hasFocus());
 }
 
+double Timeline::get_clock_playhead() {
+    // where the playhead should be right now, in fractional frames
+    double elapsed;
+    if (audio_clock) {
+        elapsed = get_audio_clock() * 0.000001;
+    } else {
+        elapsed = (QDateTime::currentMSecsSinceEpoch()-start_msecs) * 0.001;
+    }
+    return playhead_start + (elapsed * sequence->frame_rate * playback_speed);
+}
+
 void Timeline::repaint_timeline() {
     if (playing) {
-        playhead = round(playhead_start + ((QDateTime::currentMSecsSinceEpoch()-start_msecs) * 0.001 * sequence->frame_rate));
+        playhead = round(get_clock_playhead());
+        if (playhead < 0) {
+            // reversed all the way back to the start
+            playhead = 0;
+            pause();
+        }
 	}
     ui->headers->update();
 	ui->video_area->update();
@@ -246,6 +316,10 @@ void Timeline::repaint_timeline() {
 		panel_viewer->viewer_widget->update();
         ui->audio_monitor->update();
 		last_frame = playhead;
+    } else if (playing && audio_clock) {
+        // keep the viewer feeding the audio device even if the frame hasn't changed,
+        // if the sound stops so does the clock
+        panel_viewer->viewer_widget->update();
 	}
     panel_viewer->update_playhead_timecode();
 }
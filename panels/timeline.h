@@ -103,10 +103,18 @@ public:
     void toggle_play();
 	void play();
 	void pause();
+    void shuttle_left();
+    void shuttle_stop();
+    void shuttle_right();
+    void set_playback_speed(int speed);
 	void go_to_end();
 	bool playing;
+    bool scrubbing; // playhead is being dragged, the viewer shows the nearest frame it can get quickly
+	int playback_speed; // multiple of normal forward playback, negative for reverse
 	long playhead_start;
     qint64 start_msecs;
+    bool audio_clock; // playhead follows the sound being played rather than the system clock
+    double get_clock_playhead();
 	QTimer playback_updater;
 
 	// shared information
@@ -2,6 +2,9 @@
 #include "ui_viewer.h"
 
 #include "playback/audio.h"
+#include "playback/playback.h"
+#include "playback/framecache.h"
+#include "playback/cacher.h"
 #include "timeline.h"
 #include "project/sequence.h"
 #include "panels/panels.h"
@@ -22,12 +25,16 @@ Viewer::Viewer(QWidget *parent) :
 	ui->setupUi(this);
 	ui->glViewerPane->child = ui->openGLWidget;
     viewer_widget = ui->openGLWidget;
+
+    // the cachers repaint the viewer when a frame it was missing turns up
+    set_frame_ready_receiver(viewer_widget, "retry");
     timecode_view = TIMECODE_DROP;
     update_sequence();
 }
 
 Viewer::~Viewer()
 {
+    set_frame_ready_receiver(NULL, NULL);
     init_audio();
 	delete ui;
 }
@@ -107,6 +114,19 @@ void Viewer::update_end_timecode() {
     ui->endTimecode->setText(frame_to_timecode(sequence->getEndFrame()));
 }
 
+void Viewer::update_playback_stats() {
+    // measured at normal speed only (see record_frame_shown), blank until there's something to show
+    if (av_offset_samples == 0) {
+        ui->playbackStats->clear();
+    } else {
+        ui->playbackStats->setText(QString("%1 dropped  A/V %2 ms  %3 underruns  cache %4 MB")
+                                   .arg(dropped_frames)
+                                   .arg(av_offset, 0, 'f', 1)
+                                   .arg(get_audio_underruns())
+                                   .arg(frame_cache_usage() / (1024*1024)));
+    }
+}
+
 void Viewer::update_sequence() {
     bool null_sequence = (sequence == NULL);
 
@@ -119,6 +139,10 @@ void Viewer::update_sequence() {
     ui->pushButton_5->setEnabled(!null_sequence);
 
     init_audio();
+    if (audio_sender != NULL) {
+        // the audio thread can't ask the cachers for more itself, see AudioSender::topup_needed()
+        connect(audio_sender, SIGNAL(topup_needed()), this, SLOT(topup_audio()), Qt::QueuedConnection);
+    }
 
     if (!null_sequence) {
         if (frame_rate_is_droppable(sequence->frame_rate)) {
@@ -162,6 +186,12 @@ void Viewer::on_pushButton_3_clicked()
     panel_timeline->toggle_play();
 }
 
+void Viewer::topup_audio() {
+    // clear it first, so a request that comes in while we're topping up isn't lost
+    if (audio_sender != NULL) audio_sender->topup_pending.storeRelease(0);
+    request_audio_topup();
+}
+
 void Viewer::set_playpause_icon(bool play) {
     if (play) {
         ui->pushButton_3->setIcon(QIcon(":/icons/play.png"));
@@ -30,6 +30,7 @@ public:
     int timecode_view;
     void update_playhead_timecode();
     void update_end_timecode();
+    void update_playback_stats();
 
 	ViewerWidget* viewer_widget;
 
@@ -45,6 +46,8 @@ private slots:
 
     void on_pushButton_3_clicked();
 
+    void topup_audio();
+
 private:    
     QString frame_to_timecode(long f);
 };
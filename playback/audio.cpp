@@ -1,8 +1,12 @@
 #include "audio.h"
 
 #include "project/sequence.h"
+#include "io/config.h"
 
 #include <QAudioOutput>
+#include <QThread>
+#include <QTimer>
+#include <QElapsedTimer>
 #include <QtMath>
 #include <QDebug>
 
@@ -10,20 +14,190 @@ extern "C" {
 	#include <libavcodec/avcodec.h>
 }
 
-QAudioOutput* audio_output;
-QIODevice* audio_io_device;
-bool audio_device_set = false;
+#define AUDIO_NOTIFY_INTERVAL 5 // msecs between the device telling us how much it's played
+#define AUDIO_LATENCY_MAX 250 // msecs the device buffer is allowed to grow to after underruns
+#define AUDIO_SHRINK_CHECKS 30 // seconds without an underrun before the buffer shrinks back down
 
-qint8 audio_ibuffer[audio_ibuffer_size];
-int audio_ibuffer_read = 0;
+AudioSender* audio_sender = NULL;
+static QThread* audio_thread = NULL;
+static QElapsedTimer audio_timer;
+
+AudioRingBuffer audio_ibuffer(audio_ibuffer_size/2);
 long audio_ibuffer_frame = 0;
 
+AudioSender::AudioSender(const QAudioFormat& f) : format(f), output(NULL) {
+    buffer_msecs = audio_latency;
+    output_msecs = 0;
+    checked_underruns = 0;
+    clean_checks = 0;
+    output_pulled = 0;
+    played_base = 0;
+    active.store(0);
+    reading.store(0);
+    underruns.store(0);
+    topup_pending.store(0);
+    pulled.store(0);
+    mix_start.store(-1);
+    played_usecs.store(0);
+    played_stamp.store(0);
+
+    adapt_timer = new QTimer(this);
+    adapt_timer->setInterval(1000);
+    connect(adapt_timer, SIGNAL(timeout()), this, SLOT(adapt_buffer()));
+
+    open(QIODevice::ReadOnly);
+}
+
+bool AudioSender::isSequential() const {
+    return true;
+}
+
+qint64 AudioSender::bytesAvailable() const {
+    // there's always something to give, silence if nothing else
+    return audio_ibuffer_size + QIODevice::bytesAvailable();
+}
+
+qint64 AudioSender::bytes_to_usecs(qint64 bytes) const {
+    // QAudioFormat::durationForBytes() only takes 32-bit
+    return (bytes / format.bytesPerFrame()) * 1000000 / format.sampleRate();
+}
+
+void AudioSender::activate() {
+    underruns.store(0);
+    mix_start.store(-1);
+    active.storeRelease(1);
+}
+
+void AudioSender::deactivate() {
+    // we clear active before checking reading, readData() sets reading before checking active,
+    // so either it sees we're done or we see it's still busy and wait for it (a few usecs at most)
+    active.fetchAndStoreOrdered(0);
+    while (reading.fetchAndAddOrdered(0)) {
+        QThread::yieldCurrentThread();
+    }
+}
+
+qint64 AudioSender::get_clock() {
+    qint64 start = mix_start.loadAcquire();
+    if (start < 0) return 0;
+
+    // the device only reports in every few msecs, fill in the time since (but not for so long
+    // that we'd run on through an underrun)
+    qint64 since = qMin(audio_timer.nsecsElapsed()/1000 - played_stamp.loadAcquire(), qint64(AUDIO_NOTIFY_INTERVAL*2000));
+    return qMax(qint64(0), played_usecs.loadAcquire() + since - bytes_to_usecs(start));
+}
+
+qint64 AudioSender::readData(char* data, qint64 maxlen) {
+    // no more than half the ring at a time, so meters can read the half behind it (see AudioRingBuffer::get_played_sample)
+    int len = (int) qMin(maxlen, qint64(audio_ibuffer_size/2));
+    len -= len % format.bytesPerFrame();
+
+    reading.fetchAndStoreOrdered(1);
+    if (active.fetchAndAddOrdered(0)) {
+        // only what every clip has finished mixing - anything short of what the device asked
+        // for is an underrun, unless playback has only just started and nothing's been mixed yet
+        int readable = audio_ibuffer.get_readable(len);
+        readable -= readable % format.bytesPerFrame();
+        if (readable < len && mix_start.load() >= 0) {
+            underruns.ref();
+        }
+        if (readable > 0) {
+            if (mix_start.load() < 0) mix_start.storeRelease(pulled.load());
+            audio_ibuffer.render(data, readable);
+            audio_ibuffer.consume(readable);
+        }
+        len = readable;
+
+        // the clips are also topped up on every repaint, ask for more between repaints if we're
+        // getting low. only one request is ever in flight
+        if (audio_ibuffer.get_lead() < audio_ibuffer.get_capacity()/4 && topup_pending.testAndSetOrdered(0, 1)) {
+            emit topup_needed();
+        }
+    } else {
+        memset(data, 0, len);
+    }
+    reading.storeRelease(0);
+
+    pulled.storeRelease(pulled.load() + len);
+    output_pulled += len;
+    return len;
+}
+
+qint64 AudioSender::writeData(const char*, qint64) {
+    return -1;
+}
+
+void AudioSender::start_output() {
+    output = new QAudioOutput(format, this);
+    output->setBufferSize(format.bytesForDuration(buffer_msecs*1000));
+    output_msecs = buffer_msecs;
+    output->setNotifyInterval(AUDIO_NOTIFY_INTERVAL);
+    connect(output, SIGNAL(notify()), this, SLOT(update_clock()));
+    output_pulled = 0;
+
+    // pull mode - the output calls readData() whenever it wants more
+    output->start(this);
+    adapt_timer->start();
+
+    qDebug() << "[INFO] Audio output started with a" << buffer_msecs << "ms buffer";
+}
+
+void AudioSender::stop_output() {
+    if (output == NULL) return;
+
+    adapt_timer->stop();
+    output->stop();
+
+    // whatever the output hadn't played yet is lost, count it as played so the clock
+    // jumps with the sound rather than falling behind it
+    played_base += bytes_to_usecs(output_pulled);
+    played_usecs.storeRelease(played_base);
+    played_stamp.storeRelease(audio_timer.nsecsElapsed()/1000);
+
+    delete output;
+    output = NULL;
+}
+
+void AudioSender::update_clock() {
+    played_usecs.storeRelease(played_base + output->processedUSecs());
+    played_stamp.storeRelease(audio_timer.nsecsElapsed()/1000);
+}
+
+void AudioSender::adapt_buffer() {
+    // a buffer that keeps running dry is too short for this machine, make it longer. once
+    // it's been fine for a while, try bringing it back down. either way the output's only
+    // restarted with the new size between playbacks, when the gap can't be heard
+    int count = underruns.load();
+    if (count < checked_underruns) checked_underruns = 0; // activate() started the count again
+    if (count > checked_underruns) {
+        clean_checks = 0;
+        if (buffer_msecs < AUDIO_LATENCY_MAX) {
+            buffer_msecs = qMin(AUDIO_LATENCY_MAX, buffer_msecs*3/2);
+            qDebug() << "[INFO] Audio output underran, raising its buffer to" << buffer_msecs << "ms once playback stops";
+        }
+    } else if (buffer_msecs > audio_latency) {
+        clean_checks++;
+        if (clean_checks >= AUDIO_SHRINK_CHECKS && !active.load()) {
+            clean_checks = 0;
+            buffer_msecs = qMax(audio_latency, buffer_msecs*2/3);
+        }
+    }
+    checked_underruns = count;
+
+    if (buffer_msecs != output_msecs && !active.load()) {
+        stop_output();
+        start_output();
+    }
+}
+
 void init_audio() {
-	if (audio_device_set) {
-		audio_output->stop();
-		delete audio_output;
-		audio_device_set = false;
-	}
+    if (audio_sender != NULL) {
+        QMetaObject::invokeMethod(audio_sender, "stop_output", Qt::BlockingQueuedConnection);
+        audio_thread->quit();
+        audio_thread->wait();
+        delete audio_sender;
+        audio_sender = NULL;
+    }
 
     if (sequence != NULL) {
 		QAudioFormat audio_format;
@@ -38,12 +212,16 @@ void init_audio() {
 		if (!info.isFormatSupported(audio_format)) {
 			qWarning() << "[WARNING] Couldn't initialize audio. Audio format is not supported by backend";
 		} else {
-            audio_output = new QAudioOutput(audio_format);
-            audio_output->setBufferSize(20480);
+            if (audio_thread == NULL) {
+                audio_timer.start();
+                audio_thread = new QThread();
+            }
 
-			// connect
-			audio_io_device = audio_output->start();
-			audio_device_set = true;
+            // the output lives on its own thread so it's never waiting on the UI to be fed
+            audio_sender = new AudioSender(audio_format);
+            audio_sender->moveToThread(audio_thread);
+            audio_thread->start(QThread::TimeCriticalPriority);
+            QMetaObject::invokeMethod(audio_sender, "start_output", Qt::QueuedConnection);
 
             clear_audio_ibuffer();
 		}
@@ -51,13 +229,35 @@ void init_audio() {
 }
 
 void clear_audio_ibuffer() {
-    memset(audio_ibuffer, 0, audio_ibuffer_size);
-    audio_ibuffer_read = 0;
+    // the audio thread mustn't be reading the mix while it's cleared
+    if (audio_sender != NULL) audio_sender->deactivate();
+    audio_ibuffer.clear();
+}
+
+bool start_audio_clock() {
+    if (audio_sender == NULL) return false;
+    audio_sender->activate();
+    return true;
+}
+
+void stop_audio_clock() {
+    if (audio_sender != NULL) audio_sender->deactivate();
+}
+
+qint64 get_audio_clock() {
+    return audio_sender->get_clock();
+}
+
+int get_audio_underruns() {
+    return (audio_sender == NULL) ? 0 : audio_sender->underruns.load();
 }
 
-int get_buffer_offset_from_frame(long frame) {
+qint64 get_buffer_offset_from_frame(long frame) {
     if (frame >= audio_ibuffer_frame) {
-        return qFloor(av_samples_get_buffer_size(NULL, av_get_channel_layout_nb_channels(sequence->audio_layout), qRound(((frame-audio_ibuffer_frame)/sequence->frame_rate)*sequence->audio_frequency), AV_SAMPLE_FMT_S16, 1)/4)*4;
+        // worked out in 64-bit, a few hours in is more bytes than an int holds
+        qint64 nb_samples = qRound64(((frame-audio_ibuffer_frame)/sequence->frame_rate)*sequence->audio_frequency);
+        qint64 bytes = nb_samples * av_get_channel_layout_nb_channels(sequence->audio_layout) * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+        return (bytes/4)*4;
     } else {
         qDebug() << "[WARNING] get_buffer_offset_from_frame called incorrectly";
         return 0;
@@ -1,26 +1,95 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
+#include "playback/audioringbuffer.h"
+
 #include <QVector>
+#include <QIODevice>
+#include <QAudioFormat>
+#include <QAtomicInt>
+#include <QAtomicInteger>
 
 //#define INT16_MAX 0x7fff
 //#define INT16_MIN (-INT16_MAX-1)
 
 class QAudioOutput;
-class QIODevice;
+class QThread;
+class QTimer;
 
 struct Sequence;
 
-extern QAudioOutput* audio_output;
-extern QIODevice* audio_io_device;
+// the device end of playback. the output pulls the mix out of audio_ibuffer whenever it
+// needs more, on a thread of its own, so a busy UI thread can't starve it
+class AudioSender : public QIODevice {
+    Q_OBJECT
+public:
+    AudioSender(const QAudioFormat& f);
+    bool isSequential() const;
+    qint64 bytesAvailable() const;
+
+    // (main thread) starts sending the mix instead of silence
+    void activate();
+
+    // (main thread) back to silence - returns once the audio thread has let go of the mix,
+    // after which audio_ibuffer can be cleared
+    void deactivate();
+
+    // usecs of the mix the device has played since activate()
+    qint64 get_clock();
+
+    QAtomicInt underruns; // times the device wanted more than the clips had mixed since activate()
+    QAtomicInt topup_pending; // topup_needed() was emitted and the main thread hasn't got to it yet
+signals:
+    // (audio thread) the mix is running low. connected queued, cachers are only asked for
+    // more from the main thread (see request_audio_topup)
+    void topup_needed();
+public slots:
+    void start_output();
+    void stop_output();
+private slots:
+    void update_clock();
+    void adapt_buffer();
+protected:
+    qint64 readData(char* data, qint64 maxlen);
+    qint64 writeData(const char* data, qint64 len);
+private:
+    qint64 bytes_to_usecs(qint64 bytes) const;
 
+    QAudioFormat format;
+    QAudioOutput* output;
+    QTimer* adapt_timer;
+    int buffer_msecs; // the device's buffer, audio_latency or more if it's been underrunning
+    int output_msecs; // the buffer the current output was started with, see adapt_buffer()
+    int checked_underruns; // underruns as of the last adapt_buffer()
+    int clean_checks; // adapt_buffer() calls in a row without an underrun
+    qint64 output_pulled; // bytes the current output has pulled
+
+    QAtomicInt active;
+    QAtomicInt reading; // set while readData() is looking at the mix, see deactivate()
+    QAtomicInteger<qint64> pulled; // bytes handed to the device, across output restarts
+    QAtomicInteger<qint64> mix_start; // pulled when the first of the mix went out, -1 till then
+    QAtomicInteger<qint64> played_usecs; // how much the device had played at the last update_clock()
+    QAtomicInteger<qint64> played_stamp; // when that was (usecs on audio_timer)
+    qint64 played_base; // usecs played by outputs since stopped (audio thread only)
+};
+
+extern AudioSender* audio_sender;
+
+// the mix bus every audio clip is mixed into (position 0 is audio_ibuffer_frame)
 #define audio_ibuffer_size 192000
-extern qint8 audio_ibuffer[audio_ibuffer_size];
-extern int audio_ibuffer_read;
+extern AudioRingBuffer audio_ibuffer;
 extern long audio_ibuffer_frame;
 void clear_audio_ibuffer();
 
 void init_audio();
-int get_buffer_offset_from_frame(long frame);
+qint64 get_buffer_offset_from_frame(long frame);
+
+// playback clock - start_audio_clock() starts sending the mix to the device, returning false if
+// there's no device to go by. get_audio_clock() is then how many microseconds of it the device
+// has played. stop_audio_clock() goes back to sending silence
+bool start_audio_clock();
+void stop_audio_clock();
+qint64 get_audio_clock();
+int get_audio_underruns();
 
 #endif // AUDIO_H
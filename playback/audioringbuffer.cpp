@@ -0,0 +1,289 @@
+#include "audioringbuffer.h"
+
+#include <QtMath>
+#include <QDebug>
+#include <string.h>
+#include <limits.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// builds for x86 only assume SSE2, with gcc/clang an AVX2 path is compiled in alongside it
+// and picked at runtime if the CPU has it
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define MIX_AVX2
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static int mix_frames_avx2(float* dst, const float* const* planes, int channels, int offset, int nb_frames) {
+    // the same as mix_frames() 8 frames at a time, returns how many it did
+    int i = 0;
+    if (channels == 2) {
+        const float* left = planes[0] + offset;
+        const float* right = planes[1] + offset;
+        for (;i+8<=nb_frames;i+=8) {
+            __m256 l = _mm256_loadu_ps(left+i);
+            __m256 r = _mm256_loadu_ps(right+i);
+            // unpack interleaves within each 128-bit half, the permutes put the halves back in order
+            __m256 lo = _mm256_unpacklo_ps(l, r);
+            __m256 hi = _mm256_unpackhi_ps(l, r);
+            float* d = dst + i*2;
+            _mm256_storeu_ps(d, _mm256_add_ps(_mm256_loadu_ps(d), _mm256_permute2f128_ps(lo, hi, 0x20)));
+            _mm256_storeu_ps(d+8, _mm256_add_ps(_mm256_loadu_ps(d+8), _mm256_permute2f128_ps(lo, hi, 0x31)));
+        }
+    } else if (channels == 1) {
+        const float* mono = planes[0] + offset;
+        for (;i+8<=nb_frames;i+=8) {
+            _mm256_storeu_ps(dst+i, _mm256_add_ps(_mm256_loadu_ps(dst+i), _mm256_loadu_ps(mono+i)));
+        }
+    }
+    return i;
+}
+
+static bool cpu_has_avx2() {
+    static bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+    return avx2;
+}
+#endif
+
+static void mix_frames(float* dst, const float* const* planes, int channels, int offset, int nb_frames) {
+    // dst (interleaved) += planes[offset...], as many frames at a time as the CPU we're running on can do
+    int i = 0;
+#ifdef MIX_AVX2
+    if (cpu_has_avx2()) {
+        i = mix_frames_avx2(dst, planes, channels, offset, nb_frames);
+    }
+#endif
+    if (channels == 2) {
+        const float* left = planes[0] + offset;
+        const float* right = planes[1] + offset;
+#if defined(__SSE2__)
+        for (;i+4<=nb_frames;i+=4) {
+            __m128 l = _mm_loadu_ps(left+i);
+            __m128 r = _mm_loadu_ps(right+i);
+            float* d = dst + i*2;
+            _mm_storeu_ps(d, _mm_add_ps(_mm_loadu_ps(d), _mm_unpacklo_ps(l, r)));
+            _mm_storeu_ps(d+4, _mm_add_ps(_mm_loadu_ps(d+4), _mm_unpackhi_ps(l, r)));
+        }
+#elif defined(__ARM_NEON)
+        for (;i+4<=nb_frames;i+=4) {
+            float32x4x2_t d = vld2q_f32(dst + i*2);
+            d.val[0] = vaddq_f32(d.val[0], vld1q_f32(left+i));
+            d.val[1] = vaddq_f32(d.val[1], vld1q_f32(right+i));
+            vst2q_f32(dst + i*2, d);
+        }
+#endif
+        for (;i<nb_frames;i++) {
+            dst[i*2] += left[i];
+            dst[i*2+1] += right[i];
+        }
+    } else if (channels == 1) {
+        const float* mono = planes[0] + offset;
+#if defined(__SSE2__)
+        for (;i+4<=nb_frames;i+=4) {
+            _mm_storeu_ps(dst+i, _mm_add_ps(_mm_loadu_ps(dst+i), _mm_loadu_ps(mono+i)));
+        }
+#elif defined(__ARM_NEON)
+        for (;i+4<=nb_frames;i+=4) {
+            vst1q_f32(dst+i, vaddq_f32(vld1q_f32(dst+i), vld1q_f32(mono+i)));
+        }
+#endif
+        for (;i<nb_frames;i++) {
+            dst[i] += mono[i];
+        }
+    } else {
+        for (;i<nb_frames;i++) {
+            for (int j=0;j<channels;j++) {
+                dst[i*channels+j] += planes[j][offset+i];
+            }
+        }
+    }
+}
+
+static inline float dither_noise(quint32& dither_seed) {
+    // triangular noise of +/-1 LSB (the difference of two uniform randoms) - added before
+    // rounding, it turns the 16-bit quantization error into a flat noise floor instead of
+    // distortion that follows the signal
+    dither_seed = dither_seed * 1664525 + 1013904223;
+    float a = (dither_seed >> 8) * (1.0f / 16777216.0f);
+    dither_seed = dither_seed * 1664525 + 1013904223;
+    float b = (dither_seed >> 8) * (1.0f / 16777216.0f);
+    return a - b;
+}
+
+AudioRingBuffer::AudioRingBuffer(int samples) : size(samples) {
+    buffer = new float[size];
+    memset(buffer, 0, size*sizeof(float));
+    played = new qint16[size];
+    memset(played, 0, size*sizeof(qint16));
+    read_position.store(0);
+    read_intent.store(0);
+    for (int i=0;i<AUDIO_RING_WRITERS;i++) {
+        writers[i].store(-1);
+    }
+    generation = 0;
+    dither_seed = 1;
+}
+
+AudioRingBuffer::~AudioRingBuffer() {
+    delete [] buffer;
+    delete [] played;
+}
+
+int AudioRingBuffer::get_slot(int writer) {
+    // must be called with write_lock held
+    if (writer < 0 || writer / AUDIO_RING_WRITERS != generation) return -1;
+    return writer % AUDIO_RING_WRITERS;
+}
+
+int AudioRingBuffer::open_writer(qint64 position) {
+    write_lock.lock();
+    int writer = -1;
+    for (int i=0;i<AUDIO_RING_WRITERS;i++) {
+        if (writers[i].load() < 0) {
+            // the consumer publishes how far it's about to read before it looks at the writers,
+            // we publish ourselves before looking at that - so either it sees us and stops short
+            // of our position, or we see it and start past where it'll stop
+            writers[i].fetchAndStoreOrdered(position);
+            qint64 intent = read_intent.fetchAndAddOrdered(0);
+            if (intent > position) writers[i].storeRelease(intent);
+
+            writer = generation * AUDIO_RING_WRITERS + i;
+            break;
+        }
+    }
+    write_lock.unlock();
+
+    if (writer < 0) qDebug() << "[WARNING] Too many clips mixing audio at once";
+    return writer;
+}
+
+qint64 AudioRingBuffer::get_writer_position(int writer) {
+    write_lock.lock();
+    int slot = get_slot(writer);
+    qint64 position = (slot < 0) ? -1 : writers[slot].load();
+    write_lock.unlock();
+    return position;
+}
+
+void AudioRingBuffer::mix(int writer, const float* const* planes, int channels, int nb_frames) {
+    write_lock.lock();
+    int slot = get_slot(writer);
+    qint64 position = (slot < 0) ? -1 : writers[slot].load();
+    if (position >= 0) {
+        int index = (position/2) % size;
+        int done = 0;
+        while (done < nb_frames) {
+            // as many whole frames as fit before the end of the ring
+            int n = qMin(nb_frames - done, (size - index) / channels);
+            if (n > 0) {
+                mix_frames(buffer+index, planes, channels, done, n);
+                index = (index + n*channels) % size;
+            } else {
+                // a frame straddling the end of the ring
+                for (int j=0;j<channels;j++) {
+                    buffer[index] += planes[j][done];
+                    index = (index + 1) % size;
+                }
+                n = 1;
+            }
+            done += n;
+        }
+
+        // only now can the consumer read what we've just added
+        writers[slot].storeRelease(position + qint64(nb_frames)*channels*2);
+    }
+    write_lock.unlock();
+}
+
+void AudioRingBuffer::close_writer(int writer) {
+    write_lock.lock();
+    int slot = get_slot(writer);
+    if (slot >= 0) writers[slot].storeRelease(-1);
+    write_lock.unlock();
+}
+
+int AudioRingBuffer::get_readable(int len) {
+    qint64 read = read_position.load();
+    qint64 limit = read + len;
+    read_intent.fetchAndStoreOrdered(limit);
+    for (int i=0;i<AUDIO_RING_WRITERS;i++) {
+        qint64 position = writers[i].loadAcquire();
+        if (position >= 0 && position < limit) limit = position;
+    }
+    return (int) qMax(qint64(0), limit - read);
+}
+
+void AudioRingBuffer::render(char* dst, int len) {
+    qint16* out = reinterpret_cast<qint16*>(dst);
+    int index = (read_position.load()/2) % size;
+    for (int i=0;i<len/2;i++) {
+        float f = buffer[index];
+
+        // digital silence stays silent
+        int s = 0;
+        if (f != 0.0f) {
+            s = qRound(f * 32767.0f + dither_noise(dither_seed));
+            s = qBound(INT16_MIN, s, INT16_MAX);
+        }
+        out[i] = (qint16) s;
+        played[index] = (qint16) s;
+
+        index++;
+        if (index == size) index = 0;
+    }
+}
+
+qint16 AudioRingBuffer::get_played_sample(qint64 position) {
+    qint64 read = read_position.loadAcquire();
+    if (position >= read || position < read - size) return 0;
+    return played[(position/2) % size];
+}
+
+void AudioRingBuffer::consume(int len) {
+    // played, so writers coming round a ring's length later start from silence
+    qint64 read = read_position.load();
+    int index = (read/2) % size;
+    int count = len/2;
+    while (count > 0) {
+        int n = qMin(count, size - index);
+        memset(buffer+index, 0, n*sizeof(float));
+        count -= n;
+        index = 0;
+    }
+    read_position.storeRelease(read + len);
+}
+
+qint64 AudioRingBuffer::get_read_position() {
+    return read_position.loadAcquire();
+}
+
+qint64 AudioRingBuffer::get_lead() {
+    qint64 read = read_position.load();
+    qint64 lead = get_capacity();
+    for (int i=0;i<AUDIO_RING_WRITERS;i++) {
+        qint64 position = writers[i].loadAcquire();
+        if (position >= 0) lead = qMin(lead, position - read);
+    }
+    return qMax(qint64(0), lead);
+}
+
+int AudioRingBuffer::get_capacity() {
+    return size*2;
+}
+
+void AudioRingBuffer::clear() {
+    write_lock.lock();
+    memset(buffer, 0, size*sizeof(float));
+    memset(played, 0, size*sizeof(qint16));
+    for (int i=0;i<AUDIO_RING_WRITERS;i++) {
+        writers[i].store(-1);
+    }
+    read_intent.store(0);
+    read_position.storeRelease(0);
+    generation = (generation + 1) % (INT_MAX / AUDIO_RING_WRITERS);
+    write_lock.unlock();
+}
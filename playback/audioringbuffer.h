@@ -0,0 +1,75 @@
+#ifndef AUDIORINGBUFFER_H
+#define AUDIORINGBUFFER_H
+
+#include <QAtomicInteger>
+#include <QMutex>
+
+#define AUDIO_RING_WRITERS 64 // most clips that can be mixing into one ring at once
+
+// the mix bus between the clips' cachers and whatever plays or encodes the mix. any number
+// of clips mix into it ahead of the one consumer, which only ever reads what every open
+// writer is done with. samples are kept as floats so nothing clips until the mix is
+// converted to 16-bit on its way out. positions are byte offsets into that 16-bit output
+// since the ring was last cleared (see get_buffer_offset_from_frame), 64-bit so they never wrap
+class AudioRingBuffer {
+public:
+    AudioRingBuffer(int samples);
+    ~AudioRingBuffer();
+
+    // producers - serialized on a lock the consumer never takes
+
+    // starts a writer at position (or wherever the consumer's about to read up to, if that's
+    // further on). returns -1 if there are too many open
+    int open_writer(qint64 position);
+
+    // where the writer will mix next, -1 if it's been closed or the ring's been cleared since
+    qint64 get_writer_position(int writer);
+
+    // adds nb_frames of planar float audio (one buffer per channel) at the writer's position
+    // and moves it past them. the caller keeps the writer within get_capacity() of the read position
+    void mix(int writer, const float* const* planes, int channels, int nb_frames);
+
+    // the writer has nothing more to add (its clip ended or closed)
+    void close_writer(int writer);
+
+    // consumer - the one thread playing or encoding the mix, never blocks
+
+    // how many of the next len bytes every open writer is done with
+    int get_readable(int len);
+
+    // converts len readable bytes from the read position on to dithered 16-bit
+    void render(char* dst, int len);
+
+    // silences len readable bytes from the read position on and moves past them
+    void consume(int len);
+
+    // bytes every open writer has mixed past the read position (the capacity if there are none).
+    // unlike get_readable() it doesn't hold back writers opening at the read position
+    qint64 get_lead();
+
+    // either side
+
+    qint64 get_read_position();
+    int get_capacity(); // in bytes
+
+    // what was rendered for a position in the half ring behind the read position (0 for
+    // anything older), for meters. the consumer must render no more than half the ring at once
+    qint16 get_played_sample(qint64 position);
+
+    // drops everything and starts again at position 0 with no writers. only while nothing's consuming
+    void clear();
+private:
+    int get_slot(int writer);
+
+    float* buffer;
+    qint16* played; // what render() made of each sample
+    int size; // in samples
+    QAtomicInteger<qint64> read_position;
+    QAtomicInteger<qint64> read_intent; // how far the consumer is about to read, see open_writer
+    QAtomicInteger<qint64> writers[AUDIO_RING_WRITERS]; // each writer's position, -1 if the slot's free
+    int generation; // bumped on clear so writers opened before it are ignored (guarded by write_lock)
+    quint32 dither_seed; // only touched by render(), each ring's consumer has its own
+    QMutex write_lock;
+};
+
+#endif // AUDIORINGBUFFER_H
@@ -3,8 +3,11 @@
 #include "project/clip.h"
 #include "project/sequence.h"
 #include "io/media.h"
+#include "io/config.h"
 #include "playback/audio.h"
 #include "playback/playback.h"
+#include "playback/framecache.h"
+#include "playback/decoderpool.h"
 #include "effects/effects.h"
 
 extern "C" {
@@ -15,29 +18,72 @@ extern "C" {
 }
 
 #include <QDebug>
+#include <QObject>
 #include <QtMath>
+#include <QElapsedTimer>
+#include <QVarLengthArray>
+#include <QFile>
 #include <math.h>
 
-void apply_audio_effects(Clip* c, AVFrame* frame, int nb_bytes) {
-    // perform all audio effects
+void apply_audio_effects(Clip* c, AVFrame* frame) {
+    // perform all audio effects, a frame's worth of planar float samples at a time
     for (int j=0;j<c->effects.size();j++) {
         Effect* e = c->effects.at(j);
-        if (e->is_enabled()) e->process_audio(frame->data[0], nb_bytes);
+        if (e->is_enabled()) e->process_audio(reinterpret_cast<float**>(frame->extended_data), frame->channels, frame->nb_samples);
     }
 }
 
+static int get_mix_bytes(AVFrame* frame) {
+    // clip audio is decoded to planar float, but positions in the mix are in 16-bit output
+    // bytes (see get_buffer_offset_from_frame) so that's what a frame is measured in here
+    return av_samples_get_buffer_size(NULL, frame->channels, frame->nb_samples, AV_SAMPLE_FMT_S16, 1);
+}
+
+// viewer clips with an open writer, so the audio thread can ask for more without waiting on a repaint
+static QVector<Clip*> audio_feed_clips;
+static QMutex audio_feed_lock;
+
+void close_audio_writer(Clip* c) {
+    if (c->audio_writer >= 0) {
+        audio_ibuffer.close_writer(c->audio_writer);
+        c->audio_writer = -1;
+    }
+
+    // even without a writer - clearing the mix drops the writers without closing them (see clear_audio_ibuffer)
+    audio_feed_lock.lock();
+    audio_feed_clips.removeAll(c);
+    audio_feed_lock.unlock();
+}
+
+void request_audio_topup() {
+    // (main thread) a clip whose cacher is busy (or that's being closed) is skipped, it's either
+    // mixing already or will be asked again on the next read
+    audio_feed_lock.lock();
+    for (int i=0;i<audio_feed_clips.size();i++) {
+        Clip* c = audio_feed_clips.at(i);
+        if (c->lock.tryLock()) {
+            if (c->cacher->caching.load()) cache_clip(c, c->cacher->playhead, false);
+            c->lock.unlock();
+        }
+    }
+    audio_feed_lock.unlock();
+}
+
 void cache_audio_worker(Clip* c) {
     int written = 0;
     int max_write = 16384;
     while (written < max_write) {
         // gets one frame worth of audio and sends it to the audio buffer
-        AVFrame* frame = c->cache_A.frames[0];
+        AVFrame* frame = c->cache.frames[0];
 
         if (c->need_new_audio_frame) {
             // no more audio left in frame, get a new one
             if (!c->reached_end) {
                 retrieve_next_frame_raw_data(c, frame);
-                apply_audio_effects(c, frame, av_samples_get_buffer_size(NULL, frame->channels, frame->nb_samples, static_cast<AVSampleFormat>(frame->format), 1));
+                apply_audio_effects(c, frame);
+            } else if (c->conform_data != NULL) {
+                // conformed audio has no resampler to drain
+                frame->nb_samples = 0;
             } else {
                 // set by retrieve_next_frame_raw_data indicating no more frames in file,
                 // but there still may be samples in swresample
@@ -67,14 +113,28 @@ void cache_audio_worker(Clip* c) {
         }
 
         if (frame->nb_samples == 0) {
+            // the file's run out before the clip has, don't hold up the mix waiting for it
+            close_audio_writer(c);
             written = max_write;
         } else {
-            int nb_bytes = av_samples_get_buffer_size(NULL, frame->channels, frame->nb_samples, static_cast<AVSampleFormat>(frame->format), 1);
+            int nb_bytes = get_mix_bytes(frame);
+            int frame_bytes = frame->channels * 2;
 
-            int half_buffer = (audio_ibuffer_size/2);
-            if (c->audio_buffer_write == 0) {
+            if (c->audio_writer < 0 && c->audio_buffer_write == 0) {
                 c->audio_buffer_write = get_buffer_offset_from_frame(qMax(c->timeline_in, c->audio_target_frame));
-                int offset = audio_ibuffer_read - c->audio_buffer_write;
+                c->audio_writer = audio_ibuffer.open_writer(c->audio_buffer_write);
+                if (c->audio_writer < 0) {
+                    c->audio_buffer_write = 0;
+                    break;
+                }
+                if (c->multithreaded) {
+                    audio_feed_lock.lock();
+                    if (!audio_feed_clips.contains(c)) audio_feed_clips.append(c);
+                    audio_feed_lock.unlock();
+                }
+
+                // the mix may already have been played past where we wanted to start
+                int offset = (int) (audio_ibuffer.get_writer_position(c->audio_writer) - c->audio_buffer_write);
                 if (offset > 0) {
                     c->audio_buffer_write += offset;
                     c->frame_sample_index += offset;
@@ -85,43 +145,36 @@ void cache_audio_worker(Clip* c) {
                 // get new frame
                 retrieve_next_frame_raw_data(c, frame);
                 apply_effects = true;
-                nb_bytes = av_samples_get_buffer_size(NULL, frame->channels, frame->nb_samples, static_cast<AVSampleFormat>(frame->format), 1);
+                nb_bytes = get_mix_bytes(frame);
                 c->frame_sample_index -= nb_bytes;
-
-                // code DISGUSTINGLY copy/pasted from above
-                int offset = audio_ibuffer_read - c->audio_buffer_write;
-                if (offset > 0) {
-                    c->audio_buffer_write += offset;
-                    c->frame_sample_index += offset;
-                }
             }
             if (apply_effects) {
-                apply_audio_effects(c, frame, nb_bytes);
+                apply_audio_effects(c, frame);
             }
 
-            while (c->frame_sample_index < nb_bytes) {
-                if (c->audio_buffer_write >= audio_ibuffer_read+half_buffer || c->audio_buffer_write >= get_buffer_offset_from_frame(c->timeline_out)) {
-                    written = max_write;
-                    break;
-                } else {
-                    int upper_byte_index = (c->audio_buffer_write+1)%audio_ibuffer_size;
-                    int lower_byte_index = (c->audio_buffer_write)%audio_ibuffer_size;
-                    qint16 old_sample = (qint16) ((audio_ibuffer[upper_byte_index] & 0xFF) << 8 | (audio_ibuffer[lower_byte_index] & 0xFF));
-                    qint16 new_sample = (qint16) ((frame->data[0][c->frame_sample_index+1] & 0xFF) << 8 | (frame->data[0][c->frame_sample_index] & 0xFF));
-                    qint32 mixed_sample;
-
-                    mixed_sample = old_sample + new_sample;
-                    if (mixed_sample > INT16_MAX) {
-                        mixed_sample = INT16_MAX;
-                    } else if (mixed_sample < INT16_MIN) {
-                        mixed_sample = INT16_MIN;
+            if (c->frame_sample_index < nb_bytes) {
+                // mix as much of the frame as the buffer has room for in one go
+                qint64 end = get_buffer_offset_from_frame(c->timeline_out);
+                qint64 limit = qMin(audio_ibuffer.get_read_position() + audio_ibuffer.get_capacity()/2, end);
+                int len = (int) qMin(qint64(nb_bytes - c->frame_sample_index), limit - c->audio_buffer_write);
+                len -= len % frame_bytes;
+                if (len > 0) {
+                    QVarLengthArray<const float*, 8> planes(frame->channels);
+                    for (int i=0;i<frame->channels;i++) {
+                        planes[i] = reinterpret_cast<const float*>(frame->extended_data[i]) + c->frame_sample_index/frame_bytes;
                     }
-
-                    audio_ibuffer[upper_byte_index] = (quint8) (mixed_sample >> 8);
-                    audio_ibuffer[lower_byte_index] = (quint8) mixed_sample;
-                    c->audio_buffer_write+=2;
-                    c->frame_sample_index+=2;
-                    written+=2;
+                    audio_ibuffer.mix(c->audio_writer, planes.constData(), frame->channels, len/frame_bytes);
+                    c->audio_buffer_write += len;
+                    c->frame_sample_index += len;
+                    written += len;
+                }
+                if (c->audio_buffer_write >= end) {
+                    // clip's over, the mix can go on without us
+                    close_audio_writer(c);
+                }
+                if (c->frame_sample_index < nb_bytes) {
+                    // buffer's full (or the clip's over), carry on from here next time
+                    written = max_write;
                 }
             }
             if (c->frame_sample_index == nb_bytes) {
@@ -131,57 +184,381 @@ void cache_audio_worker(Clip* c) {
     }
 }
 
-void cache_video_worker(Clip* c, long playhead, ClipCache* cache) {
-    cache->mutex.lock();
+bool get_cache_frame_buffer(Clip* c, AVFrame* f) {
+    // swap the frame's old buffer for a fresh one from the clip's pool - the old one
+    // may still be referenced by the frame cache or another clip. returns false if
+    // we're out of memory, the frame is left empty and shouldn't be decoded into
+    av_frame_unref(f);
+    if (c->pix_fmt != AV_PIX_FMT_RGBA) return true; // refers to the decoder's own frame instead
+    f->buf[0] = (c->cache.pool == NULL) ? NULL : av_buffer_pool_get(c->cache.pool);
+    if (f->buf[0] == NULL) {
+        qDebug() << "[ERROR] Could not allocate a frame buffer for caching";
+        return false;
+    }
+    f->format = AV_PIX_FMT_RGBA;
+    f->width = c->frame_width;
+    f->height = c->frame_height;
+    f->data[0] = f->buf[0]->data;
+    f->linesize[0] = f->width*4;
+    return true;
+}
+
+void free_reverse_frames(Clip* c) {
+    for (int i=0;i<c->reverse_frames.size();i++) {
+        frame_cache_release(c->reverse_frames[i]);
+        av_frame_free(&c->reverse_frames[i]);
+    }
+    c->reverse_frames.clear();
+}
+
+void decode_reverse_chunk(Clip* c, long last) {
+    // decodes the frames leading up to (and including) last. with a seek index that's the GOP
+    // last is in, from its keyframe on, so walking backwards decodes each GOP exactly once
+    free_reverse_frames(c);
+
+    MediaStream* ms = c->media_stream;
+    long first;
+    if (ms->index_done.loadAcquire() && !c->decoder->proxy) {
+        first = ms->get_keyframe_before(last);
+    } else {
+        // no index (or an intra-only proxy, where every frame's a keyframe) - a chunk a little
+        // longer than the ring so each seek back pays for itself
+        first = qMax(0L, last - c->cache.size*2 + 1);
+    }
+    long write_frame = c->cache.write_frame;
+    reset_cache(c, first);
+    first = c->cache.decode_frame;
+    c->cache.write_frame = write_frame;
+    c->reverse_start = first;
+
+    for (long i=first;i<=last && !c->reached_end;i++) {
+        AVFrame* f = av_frame_alloc();
+        if (f == NULL || !get_cache_frame_buffer(c, f)) {
+            // serve what we have, the rest is decoded again when it's asked for
+            av_frame_free(&f);
+            break;
+        }
+        retrieve_next_frame_raw_data(c, f);
+        if (c->reached_end) {
+            av_frame_free(&f);
+            break;
+        }
+        c->cache.decode_frame++;
+
+        // the chunk counts against the frame cache's budget. a GOP too long for it is cut down to
+        // its last frames (anything before is decoded again next time)
+        bool reserved;
+        while (!(reserved = frame_cache_reserve(f)) && !c->reverse_frames.isEmpty()) {
+            frame_cache_release(c->reverse_frames.first());
+            av_frame_free(&c->reverse_frames.first());
+            c->reverse_frames.removeFirst();
+            c->reverse_start++;
+        }
+        if (!reserved) {
+            // not even this one frame fits
+            av_frame_free(&f);
+            break;
+        }
+        c->reverse_frames.append(f);
+    }
+
+    // in reverse we only run out of frames at the start of the file
+    c->reached_end = false;
+}
+
+bool get_reverse_frame(Clip* c, long frame, AVFrame* f) {
+    av_frame_unref(f);
+
+    AVFrame* shared = frame_cache_get(c->media, c->media_stream->file_index, c->frame_variant, frame);
+    if (shared != NULL) {
+        av_frame_move_ref(f, shared);
+        av_frame_free(&shared);
+        return true;
+    }
+
+    if (frame < c->reverse_start || frame >= c->reverse_start + c->reverse_frames.size()) {
+        decode_reverse_chunk(c, frame);
+    }
+
+    long index = frame - c->reverse_start;
+    if (index < 0 || index >= c->reverse_frames.size()) {
+        return false;
+    }
+    av_frame_ref(f, c->reverse_frames.at(index));
+
+    // share it with other clips now it's actually being shown
+    frame_cache_insert(c->media, c->media_stream->file_index, c->frame_variant, frame, f);
+    return true;
+}
+
+static QAtomicPointer<QObject> frame_ready_receiver;
+static const char* frame_ready_method = NULL;
+
+void set_frame_ready_receiver(QObject* receiver, const char* method) {
+    // the method is left alone when unregistering, a cacher may have just loaded the old receiver
+    frame_ready_receiver.fetchAndStoreOrdered(NULL);
+    if (receiver != NULL) {
+        frame_ready_method = method;
+        frame_ready_receiver.storeRelease(receiver);
+    }
+}
+
+void notify_frame_ready(Clip* c) {
+    // if the viewer came up empty waiting on this clip, have it try again now
+    if (c->notify_viewer.testAndSetOrdered(1, 0)) {
+        QObject* receiver = frame_ready_receiver.loadAcquire();
+        if (receiver != NULL) QMetaObject::invokeMethod(receiver, frame_ready_method, Qt::QueuedConnection);
+    }
+}
+
+void cache_video_worker(Clip* c) {
+    // top up the ring with as many frames as the main thread has made room for
+    ClipCache& cache = c->cache;
+    int head = cache.head.load();
+
+    if (cache.scrub) {
+        scrub_video_worker(c);
+        return;
+    }
+
+    // fast forward only needs the frames other frames are predicted from (streams where every
+    // frame is a reference won't drop any, cache_clip_worker() skips ahead for those)
+    c->codecCtx->skip_frame = (cache.skip_frames && !cache.reverse) ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+
+    while (!c->reached_end && head - cache.tail.loadAcquire() < cache.size) {
+        int slot = head % cache.size;
+        AVFrame* f = cache.frames[slot];
+
+        if (cache.reverse) {
+            if (cache.write_frame < 0) {
+                // nothing before the start of the file
+                c->reached_end = true;
+                break;
+            }
+            if (!get_reverse_frame(c, cache.write_frame, f)) {
+                // frame doesn't exist (e.g. past the end of the file), try the one before
+                cache.write_frame--;
+                continue;
+            }
+            cache.frame_numbers[slot] = cache.write_frame;
+            cache.write_frame--;
+
+            head++;
+            cache.head.storeRelease(head);
+            notify_frame_ready(c);
+            continue;
+        }
+
+        // another clip of the same media may have decoded this frame already
+        AVFrame* shared = frame_cache_get(c->media, c->media_stream->file_index, c->frame_variant, cache.write_frame);
+        if (shared != NULL) {
+            av_frame_unref(f);
+            av_frame_move_ref(f, shared);
+            av_frame_free(&shared);
+        } else {
+            if (cache.decode_frame != cache.write_frame) {
+                // cache hits (or a reset) have moved us away from the decoder
+                reset_cache(c, cache.write_frame);
+                if (c->reached_end) break;
+            }
 
-    cache->offset = playhead;
-    if (!c->reached_end) {
-        for (size_t i=0;i<c->cache_size;i++) {
-            retrieve_next_frame_raw_data(c, cache->frames[i]);
+            // out of memory, the next request tries again
+            if (!get_cache_frame_buffer(c, f)) break;
+            retrieve_next_frame_raw_data(c, f);
             if (c->reached_end) break;
+
+            // the decoder may have dropped frames (or the stream may be missing some) to get here,
+            // label it with what it really is
+            cache.write_frame = qMax(cache.write_frame, get_decoded_frame_number(c, c->frame, cache.write_frame));
+            cache.decode_frame = cache.write_frame + 1;
+            frame_cache_insert(c->media, c->media_stream->file_index, c->frame_variant, cache.write_frame, f);
         }
+
+        cache.frame_numbers[slot] = cache.write_frame;
+        cache.write_frame++;
+
+        // publish the frame only once it's fully written
+        head++;
+        cache.head.storeRelease(head);
+        notify_frame_ready(c);
     }
-    cache->written = true;
-    cache->unread = true;
-    // setting the cache to written even if it hasn't reached_end prevents playback from
-    // signaling a seek/reset because it wasn't able to find the frame
+}
+
+void scrub_video_worker(Clip* c) {
+    // the playhead's being dragged - rather than decoding all the way up to the wanted frame,
+    // just decode the keyframe it depends on (proxies are intra-only, so that's the frame itself)
+    ClipCache& cache = c->cache;
+    MediaStream* ms = c->media_stream;
+
+    // one frame per request, the ring was emptied for it
+    long target = cache.write_frame;
+    if (target < 0) return;
+    cache.write_frame = -1;
+
+    // the timeline can ask for frames past the last one indexed (e.g. an out point beyond the
+    // end of the file), the last frame is the closest there is
+    long last_frame = ms->frame_pts.size() - 1;
+    if (last_frame < 0) return;
+    target = qMin(target, last_frame);
+
+    int head = cache.head.load();
+    int slot = head % cache.size;
+    AVFrame* f = cache.frames[slot];
+
+    long frame_number = target;
+    AVFrame* shared = frame_cache_get(c->media, ms->file_index, c->frame_variant, target);
+    if (shared == NULL && !c->decoder->proxy) {
+        frame_number = ms->get_keyframe_before(target);
+        shared = frame_cache_get(c->media, ms->file_index, c->frame_variant, frame_number);
+    }
+
+    if (shared != NULL) {
+        av_frame_unref(f);
+        av_frame_move_ref(f, shared);
+        av_frame_free(&shared);
+    } else {
+        avcodec_flush_buffers(c->codecCtx);
+        c->codecCtx->skip_frame = AVDISCARD_NONKEY;
+        c->frame_pending = false;
+        c->reached_end = false;
+        av_seek_frame(c->formatCtx, c->stream->index, av_rescale_q(ms->frame_pts.at(frame_number), AV_TIME_BASE_Q, c->stream->time_base), AVSEEK_FLAG_BACKWARD);
+
+        // with only keyframes coming out, the decoder's position is no use to anyone after this
+        cache.decode_frame = -1;
+
+        if (!get_cache_frame_buffer(c, f)) return;
+        retrieve_next_frame_raw_data(c, f);
+        if (c->reached_end) return;
+
+        frame_number = get_decoded_frame_number(c, c->frame, frame_number);
+        frame_cache_insert(c->media, ms->file_index, c->frame_variant, frame_number, f);
+    }
+
+    cache.frame_numbers[slot] = frame_number;
+    head++;
+    cache.head.storeRelease(head);
+    notify_frame_ready(c);
+}
 
-	cache->mutex.unlock();
+long get_decoded_frame_number(Clip* c, AVFrame* f, long expected) {
+	// works out which clip frame the decoder just gave us. expected is the frame that
+	// should come next if we've been decoding sequentially, -1 straight after a seek
+	MediaStream* ms = c->media_stream;
+	if (ms->index_done.loadAcquire()) {
+		long frame = ms->get_frame_from_pts(av_rescale_q(f->best_effort_timestamp, c->stream->time_base, AV_TIME_BASE_Q));
+		if (frame >= 0) return frame;
+	}
+	if (expected >= 0) return expected;
+	return floor(f->pts * av_q2d(c->stream->time_base) * av_q2d(av_guess_frame_rate(c->formatCtx, c->stream, f)));
+}
+
+static long get_request_playhead(Clip* c) {
+	// the timeline playhead as of the clip's last request, -1 if there's no telling (rendering)
+	return c->multithreaded ? c->cacher->timeline_playhead : -1;
 }
 
 void reset_cache(Clip* c, long target_frame) {
 	// if we seek to a whole other place in the timeline, we'll need to reset the cache with new values
 	if (c->media_stream->infinite_length) {
 		// if this clip is a still image, we only need one frame
-		if (!c->cache_A.written) {
-			retrieve_next_frame_raw_data(c, c->cache_A.frames[0]);
-			c->cache_A.written = true;
+		if (c->cache.head.load() == 0) {
+			AVFrame* f = c->cache.frames[0];
+			AVFrame* shared = frame_cache_get(c->media, c->media_stream->file_index, c->frame_variant, 0);
+			if (shared != NULL) {
+				av_frame_unref(f);
+				av_frame_move_ref(f, shared);
+				av_frame_free(&shared);
+			} else {
+				if (!get_cache_frame_buffer(c, f)) return;
+				retrieve_next_frame_raw_data(c, f);
+				if (c->reached_end) return;
+				frame_cache_insert(c->media, c->media_stream->file_index, c->frame_variant, 0, f);
+			}
+			c->cache.frame_numbers[0] = 0;
+			c->cache.head.storeRelease(1);
+			notify_frame_ready(c);
 		}
 	} else {
-		// flush ffmpeg codecs
-		avcodec_flush_buffers(c->codecCtx);
-
 		double timebase = av_q2d(c->stream->time_base);
 
 		if (c->stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-			// seeks to nearest keyframe (target_frame represents internal clip frame)
-			av_seek_frame(c->formatCtx, c->media_stream->file_index, clip_frame_to_seconds(c, target_frame) / timebase, AVSEEK_FLAG_BACKWARD);
-
-			// play up to the frame we actually want
-			long retrieved_frame = 0;
-			AVFrame* temp = av_frame_alloc();
-            do {
-				retrieve_next_frame(c, temp);
-				if (retrieved_frame == 0) {
-                    if (target_frame != 0) {
-						retrieved_frame = floor(temp->pts * timebase * av_q2d(av_guess_frame_rate(c->formatCtx, c->stream, temp)));
-					}
+			// target_frame represents internal clip frame
+			MediaStream* ms = c->media_stream;
+			long keyframe = -1;
+			bool seek;
+			if (ms->index_done.loadAcquire()) {
+				// if the decoder is already between the target's keyframe and the target,
+				// carrying on is cheaper than seeking back to that same keyframe
+				// proxies are intra-only, every frame is a keyframe
+				keyframe = c->decoder->proxy ? qMin(target_frame, long(ms->frame_pts.size() - 1)) : ms->get_keyframe_before(target_frame);
+				seek = !(c->cache.decode_frame >= keyframe && c->cache.decode_frame <= target_frame);
+			} else {
+				seek = !(c->cache.decode_frame >= 0 && c->cache.decode_frame <= target_frame && target_frame - c->cache.decode_frame <= c->cache.size);
+			}
+
+			long frame_number = c->cache.decode_frame;
+			QElapsedTimer seek_timer;
+			if (seek) {
+				seek_timer.start();
+
+				// the decoder's being flushed anyway, a good time to take up this clip's current
+				// share of decode threads now that other clips may have opened or closed
+				if (rebalance_decoder(c->decoder, get_decode_weight(c, get_request_playhead(c)))) {
+					c->codecCtx = c->decoder->codecCtx;
 				} else {
-					retrieved_frame++;
+					avcodec_flush_buffers(c->codecCtx);
 				}
-			} while (retrieved_frame < target_frame);
-			av_frame_free(&temp);
+				c->frame_pending = false;
+				c->reached_end = false;
+				frame_number = -1;
+
+				if (keyframe >= 0) {
+					// jump straight to the keyframe the target depends on
+					av_seek_frame(c->formatCtx, c->stream->index, av_rescale_q(ms->frame_pts.at(keyframe), AV_TIME_BASE_Q, c->stream->time_base), AVSEEK_FLAG_BACKWARD);
+				} else {
+					// no index yet, seek to the nearest keyframe by time
+					av_seek_frame(c->formatCtx, c->stream->index, clip_frame_to_seconds(c, target_frame) / timebase, AVSEEK_FLAG_BACKWARD);
+				}
+			}
+
+			// decode up to the frame we actually want and leave it in c->frame for the cacher
+			while (!c->reached_end) {
+				if (!c->frame_pending) {
+					if (retrieve_next_frame(c, c->frame) < 0) {
+						c->reached_end = true;
+						break;
+					}
+					c->frame_pending = true;
+					frame_number = get_decoded_frame_number(c, c->frame, frame_number);
+				}
+				if (frame_number >= target_frame) break;
+				c->frame_pending = false;
+				frame_number++;
+			}
+
+			if (seek) {
+				ms->add_cost(&ms->seek_cost, seek_timer.elapsed());
+			}
+
+			// if the stream has no frame at the target (a gap in its timestamps) the decoder stops on
+			// the one after it. that's what gets cached next, the target is simply missing
+			long landed = (!c->reached_end && frame_number > target_frame) ? frame_number : target_frame;
+			c->cache.write_frame = landed;
+			c->cache.decode_frame = landed;
+		} else if (c->stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && c->conform_data != NULL) {
+			// conformed audio is sample-accurate, go straight to the sample we want (computed in
+			// double, playhead_to_seconds() loses samples on long clips)
+			double target_sts = (qMax(0L, target_frame - c->timeline_in) + c->clip_in) / c->sequence->frame_rate;
+			c->conform_position = qMin(c->conform_frames, (qint64) qRound64(target_sts * c->sequence->audio_frequency));
+			c->reached_end = false;
+			c->audio_target_frame = target_frame;
+			c->need_new_audio_frame = true;
+			c->audio_just_reset = false;
 		} else if (c->stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+			// flush ffmpeg codecs
+			avcodec_flush_buffers(c->codecCtx);
+			c->reached_end = false;
+
 			// seek (target_frame represents timeline timecode in frames, not clip timecode)
 			swr_drop_output(c->swr_ctx, swr_get_out_samples(c->swr_ctx, 0));
             av_seek_frame(c->formatCtx, c->media_stream->file_index, playhead_to_seconds(c, target_frame) / timebase, AVSEEK_FLAG_BACKWARD);
@@ -192,69 +569,117 @@ void reset_cache(Clip* c, long target_frame) {
 	}
 }
 
-Cacher::Cacher(Clip* c) : clip(c) {}
+Cacher::Cacher(Clip* c) : clip(c) {
+    caching.store(0);
+    playhead = 0;
+    timeline_playhead = -1;
+    reset = false;
+    cache_pending = false;
+}
 
-void open_clip_worker(Clip* clip) {
-	// opens file resource for FFmpeg and prepares Clip struct for playback
-	QByteArray ba = clip->media->url.toUtf8();
-	const char* filename = ba.constData();
-
-	int errCode = avformat_open_input(
-			&clip->formatCtx,
-			filename,
-			NULL,
-			NULL
-		);
-	if (errCode != 0) {
-		char err[1024];
-		av_strerror(errCode, err, 1024);
-		qDebug() << "[ERROR] Could not open" << filename << "-" << err;
+void Cacher::request() {
+    if (queued.testAndSetOrdered(0, 1)) {
+        worker_pool->submit(this, TASK_PRIORITY_PLAYBACK);
+    }
+}
+
+#define DECODE_WEIGHT_PIXELS 518400 // a quarter of a 1080p frame is one unit of decode weight
+
+int get_decode_weight(Clip* c, long timeline_playhead) {
+	// rough cost of decoding this clip's frames next to other open clips, decode threads
+	// are shared out in proportion to it (see lease_decoder)
+	if (!c->media->video_tracks.contains(c->media_stream)) {
+		return 1; // audio decoding barely needs a thread
 	}
 
-	errCode = avformat_find_stream_info(clip->formatCtx, NULL);
-	if (errCode < 0) {
-		char err[1024];
-		av_strerror(errCode, err, 1024);
-		qDebug() << "[ERROR] Could not open" << filename << "-" << err;
+	double pixels;
+	bool intra_only;
+	if (c->stream != NULL) {
+		pixels = (double) AV_CEIL_RSHIFT(c->stream->codecpar->width, c->codecCtx->lowres) * AV_CEIL_RSHIFT(c->stream->codecpar->height, c->codecCtx->lowres);
+		const AVCodecDescriptor* desc = avcodec_descriptor_get(c->stream->codecpar->codec_id);
+		intra_only = (desc != NULL && (desc->props & AV_CODEC_PROP_INTRA_ONLY));
+	} else {
+		// not open yet, go by the original and assume the worst of its codec
+		int divider = c->multithreaded ? playback_divider : 1;
+		pixels = (double) c->media_stream->video_width * c->media_stream->video_height / (divider*divider);
+		intra_only = false;
 	}
 
-	av_dump_format(clip->formatCtx, 0, filename, 0);
+	// long GOP codecs do a lot more work per pixel (and need every reference frame decoded)
+	double weight = pixels / DECODE_WEIGHT_PIXELS;
+	if (!intra_only) weight *= 2;
 
-	clip->stream = clip->formatCtx->streams[clip->media_stream->file_index];
-	clip->codec = avcodec_find_decoder(clip->stream->codecpar->codec_id);
-	clip->codecCtx = avcodec_alloc_context3(clip->codec);
-	avcodec_parameters_to_context(clip->codecCtx, clip->stream->codecpar);
+	// clips opened ahead of the playhead are only prefetching, the ones on screen come first
+	if (timeline_playhead >= 0 && (timeline_playhead < c->timeline_in || timeline_playhead >= c->timeline_out)) {
+		weight /= 2;
+	}
 
-	AVDictionary* opts = NULL;
+	return qMax(1, qRound(weight));
+}
 
-	// decoding optimization configuration
-	if (clip->stream->codecpar->codec_id != AV_CODEC_ID_PNG &&
-		clip->stream->codecpar->codec_id != AV_CODEC_ID_APNG &&
-		clip->stream->codecpar->codec_id != AV_CODEC_ID_TIFF &&
-		clip->stream->codecpar->codec_id != AV_CODEC_ID_PSD) {
-		av_dict_set(&opts, "threads", "auto", 0);
+void open_clip_worker(Clip* clip) {
+	// gets a demuxer/decoder for the file (reusing a warm one if another clip just
+	// closed it) and prepares Clip struct for playback
+	QElapsedTimer open_timer;
+	open_timer.start();
+
+	// the viewer decodes the proxy if there is one and at its playback resolution, rendering
+	// (which isn't multithreaded) always uses the original at full size
+	bool proxy = (use_proxies && clip->multithreaded && clip->media->proxy_ready.loadAcquire() && clip->media_stream->proxy_index >= 0);
+	int divider = clip->multithreaded ? playback_divider : 1;
+
+	// codecs that support it decode straight to a fraction of the size, sws_scale does the rest
+	int lowres = 0;
+	if (clip->media->video_tracks.contains(clip->media_stream)) {
+		while ((2 << lowres) <= divider) lowres++;
+	}
+
+	int weight = get_decode_weight(clip, get_request_playhead(clip));
+	clip->decoder = lease_decoder(clip->media, clip->media_stream->file_index, proxy, lowres, weight);
+	if (clip->decoder == NULL && proxy) {
+		// proxy may have been deleted from under us, the original still works
+		clip->decoder = lease_decoder(clip->media, clip->media_stream->file_index, false, lowres, weight);
 	}
-	if (clip->stream->codecpar->codec_id == AV_CODEC_ID_H264) {
-		av_dict_set(&opts, "tune", "fastdecode", 0);
-		av_dict_set(&opts, "tune", "zerolatency", 0);
+	if (clip->decoder == NULL) {
+		// don't try again on every request, the file isn't going to open any better
+		qDebug() << "[WARNING] Could not open clip, it won't be shown";
+		clip->failed_opening = true;
+		return;
 	}
+	clip->frame_variant = FRAME_VARIANT(clip->decoder->proxy, divider);
+
+	clip->formatCtx = clip->decoder->formatCtx;
+	clip->stream = clip->decoder->stream;
+	clip->codec = clip->decoder->codec;
+	clip->codecCtx = clip->decoder->codecCtx;
 
-	// Open codec
-	if (avcodec_open2(clip->codecCtx, clip->codec, &opts) < 0) {
-		qDebug() << "[ERROR] Could not open codec";
+	// now the codec is known, correct the guess the lease was made with (nothing's decoded yet)
+	if (rebalance_decoder(clip->decoder, get_decode_weight(clip, get_request_playhead(clip)))) {
+		clip->codecCtx = clip->decoder->codecCtx;
 	}
 
 	if (clip->stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-		// set up swscale context - primarily used for colorspace conversion
-		// as "scaling" is actually done by OpenGL
+		// set up swscale context - primarily used for colorspace conversion and
+		// whatever downscaling lowres couldn't do, the rest of the scaling is done by OpenGL
 		int dest_format = AV_PIX_FMT_RGBA;
+		int decoded_width = AV_CEIL_RSHIFT(clip->stream->codecpar->width, clip->codecCtx->lowres);
+		int decoded_height = AV_CEIL_RSHIFT(clip->stream->codecpar->height, clip->codecCtx->lowres);
+		int scale = divider >> clip->codecCtx->lowres;
+		clip->frame_width = qMax(1, decoded_width/scale);
+		clip->frame_height = qMax(1, decoded_height/scale);
+
+		// formats the viewer can convert itself skip sws_scale entirely (unless it has scaling to do)
+		clip->pix_fmt = dest_format;
+		if (scale == 1 && native_yuv_playback.loadAcquire() && viewer_supports_format(clip->stream->codecpar->format)) {
+			clip->pix_fmt = clip->stream->codecpar->format;
+		}
 
 		clip->sws_ctx = sws_getContext(
-				clip->stream->codecpar->width,
-				clip->stream->codecpar->height,
+				decoded_width,
+				decoded_height,
 				static_cast<AVPixelFormat>(clip->stream->codecpar->format),
-				ceil(clip->stream->codecpar->width/2)*2,
-				ceil(clip->stream->codecpar->height/2)*2,
+				clip->frame_width,
+				clip->frame_height,
 				static_cast<AVPixelFormat>(dest_format),
 				SWS_FAST_BILINEAR,
 				NULL,
@@ -264,35 +689,20 @@ void open_clip_worker(Clip* clip) {
 
 		// create memory cache for video
 		if (clip->media_stream->infinite_length) {
-			clip->cache_size = 1;
+			clip->cache.size = 1;
 		} else {
-			clip->cache_size = ceil(av_q2d(av_guess_frame_rate(clip->formatCtx, clip->stream, NULL))/4); // cache is half a second in total
-
-			// infinite length doesn't need cache B
-			clip->cache_B.frames = new AVFrame* [clip->cache_size];
+			clip->cache.size = ceil(av_q2d(av_guess_frame_rate(clip->formatCtx, clip->stream, NULL))/2); // cache is half a second in total
+		}
+		clip->cache.frames = new AVFrame* [clip->cache.size];
+		clip->cache.frame_numbers = new long [clip->cache.size];
 
+		// RGBA frames get their buffers from the pool as they're decoded (see get_cache_frame_buffer)
+		if (clip->pix_fmt == AV_PIX_FMT_RGBA) {
+			clip->cache.pool = av_buffer_pool_init(clip->frame_width*clip->frame_height*4, NULL);
 		}
-		clip->cache_A.frames = new AVFrame* [clip->cache_size];
-
-
-		for (size_t i=0;i<clip->cache_size;i++) {
-			clip->cache_A.frames[i] = av_frame_alloc();
-			av_frame_make_writable(clip->cache_A.frames[i]);
-			clip->cache_A.frames[i]->width = clip->stream->codecpar->width;
-			clip->cache_A.frames[i]->height = clip->stream->codecpar->height;
-			clip->cache_A.frames[i]->format = dest_format;
-			av_frame_get_buffer(clip->cache_A.frames[i], 0);
-			clip->cache_A.frames[i]->linesize[0] = clip->stream->codecpar->width*4;
-
-			if (!clip->media_stream->infinite_length) {
-				clip->cache_B.frames[i] = av_frame_alloc();
-				av_frame_make_writable(clip->cache_B.frames[i]);
-				clip->cache_B.frames[i]->width = clip->stream->codecpar->width;
-				clip->cache_B.frames[i]->height = clip->stream->codecpar->height;
-				clip->cache_B.frames[i]->format = dest_format;
-				av_frame_get_buffer(clip->cache_B.frames[i], 0);
-				clip->cache_B.frames[i]->linesize[0] = clip->stream->codecpar->width*4;
-			}
+		for (int i=0;i<clip->cache.size;i++) {
+			clip->cache.frames[i] = av_frame_alloc();
+			clip->cache.frame_numbers[i] = -1;
 		}
 	} else if (clip->stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
 		// if FFmpeg can't pick up the channel layout (usually WAV), assume
@@ -301,7 +711,8 @@ void open_clip_worker(Clip* clip) {
             clip->codecCtx->channel_layout = guess_layout_from_channels(clip->stream->codecpar->channels);
 		}
 
-		int sample_format = AV_SAMPLE_FMT_S16;
+		// planar float for the effects and the mix bus
+		int sample_format = AV_SAMPLE_FMT_FLTP;
 
 		// init resampling context
 		clip->swr_ctx = swr_alloc_set_opts(
@@ -317,40 +728,86 @@ void open_clip_worker(Clip* clip) {
 			);
 		swr_init(clip->swr_ctx);
 
-		// set up cache
-		clip->cache_A.frames = new AVFrame* [1];
-		clip->cache_A.frames[0] = av_frame_alloc();
-		clip->cache_A.frames[0]->format = sample_format;
-		clip->cache_A.frames[0]->channel_layout = clip->sequence->audio_layout;
-		clip->cache_A.frames[0]->channels = av_get_channel_layout_nb_channels(clip->cache_A.frames[0]->channel_layout);
-		clip->cache_A.frames[0]->sample_rate = clip->sequence->audio_frequency;
-		av_frame_make_writable(clip->cache_A.frames[0]);
+		// read the media's conformed audio instead if it's been made for this sequence's format
+		MediaStream* ms = clip->media_stream;
+		QString conform_url;
+		ms->conform_lock.lock();
+		if (ms->conform_frequency == clip->sequence->audio_frequency && ms->conform_layout == (quint64) clip->sequence->audio_layout) {
+			conform_url = ms->conform_url;
+		}
+		ms->conform_lock.unlock();
+		if (!conform_url.isEmpty()) {
+			QFile* f = new QFile(conform_url);
+			uchar* data = NULL;
+			if (f->open(QFile::ReadOnly)) data = f->map(0, f->size());
+			if (data != NULL) {
+				clip->conform_file = f;
+				clip->conform_data = reinterpret_cast<const float*>(data);
+				clip->conform_frames = f->size() / (av_get_channel_layout_nb_channels(clip->sequence->audio_layout) * sizeof(float));
+				clip->conform_position = 0;
+			} else {
+				qDebug() << "[WARNING] Could not map conformed audio" << conform_url << "- decoding instead";
+				delete f;
+			}
+		}
 
-		clip->reset_audio = true;
+		// set up cache (audio only uses the first frame as a working buffer)
+		clip->cache.size = 1;
+		clip->cache.frames = new AVFrame* [1];
+		clip->cache.frame_numbers = new long [1];
+		clip->cache.frames[0] = av_frame_alloc();
+		clip->cache.frames[0]->format = sample_format;
+		clip->cache.frames[0]->channel_layout = clip->sequence->audio_layout;
+		clip->cache.frames[0]->channels = av_get_channel_layout_nb_channels(clip->cache.frames[0]->channel_layout);
+		clip->cache.frames[0]->sample_rate = clip->sequence->audio_frequency;
+		av_frame_make_writable(clip->cache.frames[0]);
+
+		clip->reset_audio.storeRelease(1);
 	}
 
 	clip->frame = av_frame_alloc();
 
+	clip->media_stream->add_cost(&clip->media_stream->open_cost, open_timer.elapsed());
+
     clip->finished_opening = true;
+    notify_frame_ready(clip);
 
     qDebug() << "[INFO] Clip opened on track" << clip->track;
 }
 
-void cache_clip_worker(Clip* clip, long playhead, bool write_A, bool write_B, bool reset) {
+void cache_clip_worker(Clip* clip, long playhead, bool reset) {
 	if (reset) {
 		// note: for video, playhead is in "internal clip" frames - for audio, it's the timeline playhead
-		reset_cache(clip, playhead);
-		clip->reset_audio = false;
+		if (clip->stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && !clip->media_stream->infinite_length) {
+			// the seek is put off until the first frame the frame cache doesn't have
+			// (reset_cache() works out whether the decoder even needs to seek)
+			clip->cache.write_frame = playhead;
+			clip->reached_end = false;
+			if (!clip->cache.reverse) free_reverse_frames(clip);
+		} else {
+			if (clip->stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+				// start mixing again from scratch, the old writer's gone if the mix was cleared
+				close_audio_writer(clip);
+				clip->frame_sample_index = 0;
+				clip->audio_buffer_write = 0;
+			}
+			reset_cache(clip, playhead);
+		}
+	} else if (clip->stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && clip->reset_audio.loadAcquire()) {
+		// the mix was cleared and the viewer's request to start over hasn't come in yet, a top-up
+		// now would carry on from where the clip was before
+		return;
+	} else if (clip->stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && clip->cache.skip_frames
+			&& !clip->cache.reverse && playhead > clip->cache.write_frame) {
+		// fast forwarding and the viewer's already past what we were going to cache next. skip
+		// straight to its frame, reset_cache() seeks to the keyframe before it if that's closer,
+		// otherwise the frames in between are decoded but dropped before they're converted
+		clip->cache.write_frame = playhead;
 	}
 
 	if (clip->stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-		if (write_A) {
-			cache_video_worker(clip, playhead, &clip->cache_A);
-			playhead += clip->cache_size;
-		}
-
-		if (write_B) {
-			cache_video_worker(clip, playhead, &clip->cache_B);
+		if (!clip->media_stream->infinite_length) {
+			cache_video_worker(clip);
 		}
     } else if (clip->stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
         cache_audio_worker(clip);
@@ -359,22 +816,38 @@ void cache_clip_worker(Clip* clip, long playhead, bool write_A, bool write_B, bo
 
 void close_clip_worker(Clip* clip) {
 	// closes ffmpeg file handle and frees any memory used for caching
+	if (clip->decoder == NULL) {
+		// the file never opened, there's nothing to close
+		clip->reset();
+		return;
+	}
+
 	if (clip->stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
 		sws_freeContext(clip->sws_ctx);
 	} else if (clip->stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+		close_audio_writer(clip);
 		swr_free(&clip->swr_ctx);
+		if (clip->conform_file != NULL) {
+			// unmaps too
+			delete clip->conform_file;
+		}
 	}
 
-	avcodec_close(clip->codecCtx);
-	avcodec_free_context(&clip->codecCtx);
-	avformat_close_input(&clip->formatCtx);
+	// keep the demuxer/decoder open for the next clip that needs this stream
+	if (clip->pkt_written) {
+		av_packet_unref(clip->pkt);
+	}
+	return_decoder(clip->decoder);
 
-	for (size_t i=0;i<clip->cache_size;i++) {
-		av_frame_free(&clip->cache_A.frames[i]);
-		if (!clip->media_stream->infinite_length) av_frame_free(&clip->cache_B.frames[i]);
+	for (int i=0;i<clip->cache.size;i++) {
+		av_frame_free(&clip->cache.frames[i]);
 	}
-	delete [] clip->cache_A.frames;
-	if (!clip->media_stream->infinite_length) delete [] clip->cache_B.frames;
+	delete [] clip->cache.frames;
+	delete [] clip->cache.frame_numbers;
+	free_reverse_frames(clip);
+
+	// buffers still held by the frame cache keep the pool alive until they're evicted
+	av_buffer_pool_uninit(&clip->cache.pool);
 
     av_frame_free(&clip->frame);
 
@@ -384,25 +857,33 @@ void close_clip_worker(Clip* clip) {
 }
 
 void Cacher::run() {
-	// open_lock is used to prevent the clip from being destroyed before the cacher has closed it properly
+    // clip->lock is held for the whole run so the main thread's tryLock() knows we're busy
     clip->lock.lock();
-    clip->finished_opening = false;
-    clip->open = true;
-    caching = true;
 
-	open_clip_worker(clip);
+    // any request from here on needs a run of its own
+    queued.storeRelease(0);
 
-    while (caching) {
-        clip->can_cache.wait(&clip->lock);
-        if (!caching) {
-			break;
-		} else {
-			cache_clip_worker(clip, playhead, write_A, write_B, reset);
-		}
-	}
+    if (!clip->open) {
+        // stale run queued before the clip was closed
+        clip->lock.unlock();
+        return;
+    }
 
-    close_clip_worker(clip);
+    if (!clip->finished_opening && !clip->failed_opening) {
+        open_clip_worker(clip);
+    }
+
+    if (caching.loadAcquire()) {
+        if (cache_pending && clip->finished_opening) {
+            cache_pending = false;
+            cache_clip_worker(clip, playhead, reset);
+        }
+        clip->lock.unlock();
+    } else {
+        close_clip_worker(clip);
 
-    clip->lock.unlock();
-	clip->open_lock.unlock();
+        // open_lock is used to prevent the clip from being destroyed before the cacher has closed it properly
+        clip->lock.unlock();
+        clip->open_lock.unlock();
+    }
 }
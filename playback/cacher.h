@@ -1,31 +1,49 @@
 #ifndef CACHER_H
 #define CACHER_H
 
-#include <QThread>
+#include "playback/workerpool.h"
+
+#include <QAtomicInt>
+#include <QAtomicPointer>
+
+class QObject;
 
 struct Clip;
 
-class Cacher : public QThread
+class Cacher : public WorkerTask
 {
-//	Q_OBJECT
 public:
 	Cacher(Clip* c);
     void run();
 
-	bool caching;
+    // queues a run on the worker pool if one isn't already queued
+    void request();
+
+	// set by the main thread when the clip opens (1) or closes (0), without the clip's lock
+	QAtomicInt caching;
 
-	// must be set before caching
+	// the request - only written or read with the clip's lock held (see cache_clip)
 	long playhead;
-	bool write_A;
-	bool write_B;
 	bool reset;
+    bool cache_pending;
+    long timeline_playhead; // where the timeline's playhead was when the request was made, see get_decode_weight
 
 private:
 	Clip* clip;
+    QAtomicInt queued;
 };
 
 void open_clip_worker(Clip* clip);
-void cache_clip_worker(Clip* clip, long playhead, bool write_A, bool write_B, bool reset);
+void cache_clip_worker(Clip* clip, long playhead, bool reset);
 void close_clip_worker(Clip* clip);
+void close_audio_writer(Clip* c);
+void request_audio_topup();
+void notify_frame_ready(Clip* c);
+
+// whatever shows the clips' frames - method (a slot, by name) is invoked on receiver's thread
+// when a frame it came up empty waiting for has been cached. receiver can be NULL
+void set_frame_ready_receiver(QObject* receiver, const char* method);
+void scrub_video_worker(Clip* c);
+int get_decode_weight(Clip* c, long timeline_playhead);
 
 #endif // CACHER_H
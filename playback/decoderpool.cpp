@@ -0,0 +1,246 @@
+#include "decoderpool.h"
+
+#include "io/media.h"
+
+extern "C" {
+	#include <libavformat/avformat.h>
+	#include <libavcodec/avcodec.h>
+}
+
+#include <QList>
+#include <QMutex>
+#include <QThread>
+#include <QDateTime>
+#include <QDebug>
+
+#define DECODER_IDLE_TIMEOUT 30000 // msecs an unused decoder is kept open
+#define DECODER_IDLE_MAX 4 // idle decoders kept per stream
+
+static QList<MediaDecoder*> idle_decoders;
+static int leased_weight = 0; // total weight of leased decoders
+static QMutex decoder_pool_lock;
+
+static void free_decoder(MediaDecoder* d) {
+    avcodec_close(d->codecCtx);
+    avcodec_free_context(&d->codecCtx);
+    avformat_close_input(&d->formatCtx);
+    delete d;
+}
+
+static void evict_idle_decoders() {
+    // must be called with the lock held
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (int i=idle_decoders.size()-1;i>=0;i--) {
+        if (now - idle_decoders.at(i)->returned > DECODER_IDLE_TIMEOUT) {
+            free_decoder(idle_decoders.takeAt(i));
+        }
+    }
+}
+
+static int get_thread_budget(int weight) {
+    // must be called with the lock held, after weight has been counted in leased_weight.
+    // one 4K clip on its own gets every core, eight overlapping ones get one each rather
+    // than all of them fighting over the cores with eight threads apiece
+    int cores = qMax(1, QThread::idealThreadCount());
+    return qBound(1, qRound(cores * weight / (double) qMax(1, leased_weight)), cores);
+}
+
+static int get_usable_threads(MediaDecoder* d, int threads) {
+    // decoders that can't use more than one thread (or misbehave with them) don't get any more
+    if (d->codec == NULL ||
+            d->stream->codecpar->codec_id == AV_CODEC_ID_PNG ||
+            d->stream->codecpar->codec_id == AV_CODEC_ID_APNG ||
+            d->stream->codecpar->codec_id == AV_CODEC_ID_TIFF ||
+            d->stream->codecpar->codec_id == AV_CODEC_ID_PSD ||
+            !(d->codec->capabilities & (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS))) {
+        return 1;
+    }
+    return threads;
+}
+
+static bool open_codec(MediaDecoder* d, int threads) {
+    // (re)creates the codec context, carrying over how much the caller asked it to skip
+    enum AVDiscard skip_frame = AVDISCARD_DEFAULT;
+    if (d->codecCtx != NULL) {
+        skip_frame = d->codecCtx->skip_frame;
+        avcodec_close(d->codecCtx);
+        avcodec_free_context(&d->codecCtx);
+    }
+
+    d->codecCtx = avcodec_alloc_context3(d->codec);
+    avcodec_parameters_to_context(d->codecCtx, d->stream->codecpar);
+
+    AVDictionary* opts = NULL;
+
+    // decoding optimization configuration
+    d->threads = get_usable_threads(d, threads);
+    d->codecCtx->thread_count = d->threads;
+    if (d->stream->codecpar->codec_id == AV_CODEC_ID_H264) {
+        av_dict_set(&opts, "tune", "fastdecode", 0);
+        av_dict_set(&opts, "tune", "zerolatency", 0);
+    }
+
+    d->codecCtx->lowres = qMin(d->lowres, (int) d->codec->max_lowres);
+
+    // Open codec
+    bool ok = (avcodec_open2(d->codecCtx, d->codec, &opts) >= 0);
+    if (!ok) {
+        qDebug() << "[ERROR] Could not open codec";
+    }
+    av_dict_free(&opts);
+
+    d->codecCtx->skip_frame = skip_frame;
+    return ok;
+}
+
+static MediaDecoder* open_decoder(Media* m, int file_index, bool proxy, int lowres, int threads) {
+    QByteArray ba = (proxy ? m->proxy_url : m->url).toUtf8();
+    const char* filename = ba.constData();
+
+    MediaDecoder* d = new MediaDecoder;
+    d->media = m;
+    d->file_index = file_index;
+    d->proxy = proxy;
+    d->lowres = lowres;
+    d->formatCtx = NULL;
+    d->codecCtx = NULL;
+    d->threads = 0;
+    d->weight = 0;
+    d->returned = 0;
+
+    int errCode = avformat_open_input(&d->formatCtx, filename, NULL, NULL);
+    if (errCode != 0) {
+        char err[1024];
+        av_strerror(errCode, err, 1024);
+        qDebug() << "[ERROR] Could not open" << filename << "-" << err;
+        delete d;
+        return NULL;
+    }
+
+    errCode = avformat_find_stream_info(d->formatCtx, NULL);
+    if (errCode < 0) {
+        char err[1024];
+        av_strerror(errCode, err, 1024);
+        qDebug() << "[ERROR] Could not open" << filename << "-" << err;
+    }
+
+    av_dump_format(d->formatCtx, 0, filename, 0);
+
+    int stream_index = proxy ? m->get_stream_from_file_index(file_index)->proxy_index : file_index;
+    d->stream = d->formatCtx->streams[stream_index];
+    d->codec = avcodec_find_decoder(d->stream->codecpar->codec_id);
+    if (d->codec == NULL || !open_codec(d, threads)) {
+        // a decoder that can't decode is no use to anyone
+        free_decoder(d);
+        return NULL;
+    }
+
+    return d;
+}
+
+MediaDecoder* lease_decoder(Media* m, int file_index, bool proxy, int lowres, int weight) {
+    decoder_pool_lock.lock();
+    evict_idle_decoders();
+
+    MediaDecoder* d = NULL;
+    for (int i=0;i<idle_decoders.size();i++) {
+        MediaDecoder* d_idle = idle_decoders.at(i);
+        if (d_idle->media == m && d_idle->file_index == file_index && d_idle->proxy == proxy && d_idle->lowres == lowres) {
+            d = idle_decoders.takeAt(i);
+            break;
+        }
+    }
+    leased_weight += weight;
+    int threads = get_thread_budget(weight);
+    decoder_pool_lock.unlock();
+
+    if (d == NULL) {
+        d = open_decoder(m, file_index, proxy, lowres, threads);
+    } else if (d->threads != get_usable_threads(d, threads)) {
+        // an idle codec is flushed already, reopening it is cheap next to probing the file
+        if (!open_codec(d, threads)) {
+            free_decoder(d);
+            d = NULL;
+        }
+    }
+    if (d == NULL) {
+        decoder_pool_lock.lock();
+        leased_weight -= weight;
+        decoder_pool_lock.unlock();
+        return NULL;
+    }
+    d->weight = weight;
+    return d;
+}
+
+bool rebalance_decoder(MediaDecoder* d, int weight) {
+    decoder_pool_lock.lock();
+    leased_weight += weight - d->weight;
+    d->weight = weight;
+    int threads = get_thread_budget(weight);
+    decoder_pool_lock.unlock();
+
+    if (get_usable_threads(d, threads) == d->threads) {
+        return false;
+    }
+    open_codec(d, threads);
+    return true;
+}
+
+void return_decoder(MediaDecoder* d) {
+    // whatever it was using goes back to the budget for everyone else
+    decoder_pool_lock.lock();
+    leased_weight -= d->weight;
+    d->weight = 0;
+    decoder_pool_lock.unlock();
+
+    avcodec_flush_buffers(d->codecCtx);
+    d->codecCtx->skip_frame = AVDISCARD_DEFAULT;
+
+    // rewind so whoever leases it next (e.g. a still image that never seeks) starts at the top.
+    // if the demuxer can't seek, the decoder can't be reused
+    if (av_seek_frame(d->formatCtx, -1, 0, AVSEEK_FLAG_BACKWARD) < 0) {
+        free_decoder(d);
+        return;
+    }
+
+    d->returned = QDateTime::currentMSecsSinceEpoch();
+
+    decoder_pool_lock.lock();
+    evict_idle_decoders();
+
+    // don't hoard more decoders of one stream than a cut-heavy edit needs
+    int count = 0;
+    for (int i=0;i<idle_decoders.size();i++) {
+        MediaDecoder* other = idle_decoders.at(i);
+        if (other->media == d->media && other->file_index == d->file_index && other->proxy == d->proxy && other->lowres == d->lowres) {
+            count++;
+            if (count >= DECODER_IDLE_MAX) {
+                free_decoder(idle_decoders.takeAt(i));
+                i--;
+            }
+        }
+    }
+
+    // most recently returned go first so leases get the warmest decoder
+    idle_decoders.prepend(d);
+    decoder_pool_lock.unlock();
+}
+
+void decoder_pool_remove_media(Media* m) {
+    decoder_pool_lock.lock();
+    for (int i=idle_decoders.size()-1;i>=0;i--) {
+        if (idle_decoders.at(i)->media == m) {
+            free_decoder(idle_decoders.takeAt(i));
+        }
+    }
+    decoder_pool_lock.unlock();
+}
+
+void decoder_pool_clear() {
+    decoder_pool_lock.lock();
+    while (!idle_decoders.isEmpty()) {
+        free_decoder(idle_decoders.takeLast());
+    }
+    decoder_pool_lock.unlock();
+}
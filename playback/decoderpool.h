@@ -0,0 +1,51 @@
+#ifndef DECODERPOOL_H
+#define DECODERPOOL_H
+
+#include <QtGlobal>
+
+struct Media;
+struct AVFormatContext;
+struct AVStream;
+struct AVCodec;
+struct AVCodecContext;
+
+// an opened demuxer/decoder for one stream of a media file. clips lease one when
+// they open and hand it back when they close, so the next clip from the same file
+// doesn't have to probe and open it all over again
+struct MediaDecoder {
+    Media* media;
+    int file_index; // stream in the original file, even when decoding the proxy
+    bool proxy; // decoding the media's proxy file rather than the original
+    int lowres; // reduced resolution asked of the codec (it may support less, see codecCtx->lowres)
+    AVFormatContext* formatCtx;
+    AVStream* stream;
+    AVCodec* codec;
+    AVCodecContext* codecCtx;
+    int threads; // decode threads the codec was opened with
+    int weight; // share of the decode thread budget it's asking for while leased
+    qint64 returned; // when it was last handed back (msecs since epoch)
+};
+
+// returns an idle decoder for this stream (or its proxy) or opens a new one, NULL on failure.
+// lowres asks the codec to decode at 1/2^lowres of full size if it can. a reused decoder has
+// been flushed and rewound to the start of the file (see return_decoder), so anything that
+// doesn't start at the top still has to seek.
+// the machine's cores are shared out as decode threads between the leased decoders in
+// proportion to their weight (roughly how expensive their frames are to decode)
+MediaDecoder* lease_decoder(Media* m, int file_index, bool proxy, int lowres, int weight);
+
+// updates a leased decoder's weight and reopens its codec if that changes its share of
+// threads. the thread count is fixed once a codec is open, so only call this where the
+// decoder is about to be flushed anyway - returns true if the codec context was replaced
+bool rebalance_decoder(MediaDecoder* d, int weight);
+
+// flushes the decoder and keeps it warm for the next lease
+void return_decoder(MediaDecoder* d);
+
+// closes idle decoders of this media (must be called before it's freed)
+void decoder_pool_remove_media(Media* m);
+
+// closes every idle decoder
+void decoder_pool_clear();
+
+#endif // DECODERPOOL_H
@@ -0,0 +1,173 @@
+#include "framecache.h"
+
+#include "io/config.h"
+
+extern "C" {
+	#include <libavutil/frame.h>
+}
+
+#include <QHash>
+#include <QMutex>
+#include <QDebug>
+
+struct FrameCacheKey {
+    Media* media;
+    int stream;
+    int variant;
+    long frame;
+};
+
+inline bool operator==(const FrameCacheKey& a, const FrameCacheKey& b) {
+    return a.media == b.media && a.stream == b.stream && a.variant == b.variant && a.frame == b.frame;
+}
+
+inline uint qHash(const FrameCacheKey& k, uint seed = 0) {
+    return qHash(quintptr(k.media), seed) ^ qHash((k.variant << 16) | k.stream, seed) ^ qHash(qint64(k.frame), seed);
+}
+
+// entries form a doubly linked list from most (head) to least (tail) recently used
+struct FrameCacheEntry {
+    FrameCacheKey key;
+    AVFrame* frame;
+    qint64 bytes;
+    FrameCacheEntry* prev;
+    FrameCacheEntry* next;
+};
+
+static QHash<FrameCacheKey, FrameCacheEntry*> frame_cache_entries;
+static FrameCacheEntry* frame_cache_head = NULL;
+static FrameCacheEntry* frame_cache_tail = NULL;
+static qint64 frame_cache_bytes = 0;
+static qint64 frame_cache_reserved = 0; // held outside the cache, see frame_cache_reserve()
+static QMutex frame_cache_lock;
+
+static void unlink_entry(FrameCacheEntry* e) {
+    if (e->prev != NULL) e->prev->next = e->next; else frame_cache_head = e->next;
+    if (e->next != NULL) e->next->prev = e->prev; else frame_cache_tail = e->prev;
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void push_front(FrameCacheEntry* e) {
+    e->prev = NULL;
+    e->next = frame_cache_head;
+    if (frame_cache_head != NULL) frame_cache_head->prev = e;
+    frame_cache_head = e;
+    if (frame_cache_tail == NULL) frame_cache_tail = e;
+}
+
+static void free_entry(FrameCacheEntry* e) {
+    // must be called with the lock held
+    unlink_entry(e);
+    frame_cache_entries.remove(e->key);
+    frame_cache_bytes -= e->bytes;
+    av_frame_free(&e->frame); // clips still showing this frame hold their own reference
+    delete e;
+}
+
+static qint64 frame_bytes(AVFrame* f) {
+    qint64 bytes = 0;
+    for (int i=0;i<AV_NUM_DATA_POINTERS;i++) {
+        if (f->buf[i] != NULL) bytes += f->buf[i]->size;
+    }
+    return bytes;
+}
+
+AVFrame* frame_cache_get(Media* m, int stream, int variant, long frame) {
+    FrameCacheKey key = {m, stream, variant, frame};
+    AVFrame* ref = NULL;
+
+    frame_cache_lock.lock();
+    FrameCacheEntry* e = frame_cache_entries.value(key, NULL);
+    if (e != NULL) {
+        unlink_entry(e);
+        push_front(e);
+        ref = av_frame_clone(e->frame);
+    }
+    frame_cache_lock.unlock();
+
+    return ref;
+}
+
+void frame_cache_insert(Media* m, int stream, int variant, long frame, AVFrame* f) {
+    qint64 budget = qint64(frame_cache_size)*1024*1024;
+    qint64 bytes = frame_bytes(f);
+    if (bytes == 0 || bytes > budget) return;
+
+    FrameCacheKey key = {m, stream, variant, frame};
+
+    frame_cache_lock.lock();
+    if (!frame_cache_entries.contains(key)) {
+        FrameCacheEntry* e = new FrameCacheEntry;
+        e->key = key;
+        e->frame = av_frame_clone(f);
+        if (e->frame == NULL) {
+            qDebug() << "[ERROR] Could not reference frame for frame cache";
+            delete e;
+        } else {
+            e->bytes = bytes;
+            e->prev = NULL;
+            e->next = NULL;
+            push_front(e);
+            frame_cache_entries.insert(key, e);
+            frame_cache_bytes += bytes;
+
+            while (frame_cache_bytes + frame_cache_reserved > budget && frame_cache_tail != NULL) {
+                free_entry(frame_cache_tail);
+            }
+        }
+    }
+    frame_cache_lock.unlock();
+}
+
+void frame_cache_remove_media(Media* m) {
+    frame_cache_lock.lock();
+    FrameCacheEntry* e = frame_cache_head;
+    while (e != NULL) {
+        FrameCacheEntry* next = e->next;
+        if (e->key.media == m) free_entry(e);
+        e = next;
+    }
+    frame_cache_lock.unlock();
+}
+
+void frame_cache_clear() {
+    frame_cache_lock.lock();
+    while (frame_cache_tail != NULL) {
+        free_entry(frame_cache_tail);
+    }
+    frame_cache_lock.unlock();
+}
+
+qint64 frame_cache_usage() {
+    frame_cache_lock.lock();
+    qint64 bytes = frame_cache_bytes + frame_cache_reserved;
+    frame_cache_lock.unlock();
+    return bytes;
+}
+
+bool frame_cache_reserve(AVFrame* f) {
+    qint64 budget = qint64(frame_cache_size)*1024*1024;
+    qint64 bytes = frame_bytes(f);
+    bool reserved = false;
+
+    frame_cache_lock.lock();
+    if (frame_cache_reserved + bytes <= budget) {
+        frame_cache_reserved += bytes;
+        while (frame_cache_bytes + frame_cache_reserved > budget && frame_cache_tail != NULL) {
+            free_entry(frame_cache_tail);
+        }
+        reserved = true;
+    }
+    frame_cache_lock.unlock();
+
+    return reserved;
+}
+
+void frame_cache_release(AVFrame* f) {
+    qint64 bytes = frame_bytes(f);
+
+    frame_cache_lock.lock();
+    frame_cache_reserved -= bytes;
+    frame_cache_lock.unlock();
+}
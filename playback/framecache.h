@@ -0,0 +1,41 @@
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+#include <QtGlobal>
+
+struct Media;
+struct AVFrame;
+
+// process-wide LRU of decoded video frames keyed by (media, stream, variant, frame),
+// shared by every clip so repeated and adjacent cuts of one source only decode once.
+// the byte budget is frame_cache_size in io/config.h
+
+// decodes of the same frame that look different (from a proxy, or at a reduced
+// playback resolution) are cached separately
+#define FRAME_VARIANT(proxy, divider) (((divider) << 1) | ((proxy) ? 1 : 0))
+
+// returns a new reference to the cached frame (free with av_frame_free) or NULL
+AVFrame* frame_cache_get(Media* m, int stream, int variant, long frame);
+
+// keeps a reference to the frame's buffers, evicting the least recently used
+// frames if it pushes the cache over budget
+void frame_cache_insert(Media* m, int stream, int variant, long frame, AVFrame* f);
+
+// drops every frame belonging to this media (must be called before it's freed)
+void frame_cache_remove_media(Media* m);
+
+// drops every frame, e.g. when the project's closed
+void frame_cache_clear();
+
+// bytes held by the cache, for the viewer's stats
+qint64 frame_cache_usage();
+
+// counts a frame held outside the cache (e.g. a reverse playback chunk) against the same
+// budget, evicting cached frames to make room. returns false if even an empty cache couldn't
+// fit it alongside what's already reserved
+bool frame_cache_reserve(AVFrame* f);
+
+// gives back a frame's reservation, before it's freed
+void frame_cache_release(AVFrame* f);
+
+#endif // FRAMECACHE_H
@@ -0,0 +1,212 @@
+#include "frameuploader.h"
+
+#include "project/clip.h"
+#include "playback/playback.h"
+#include "playback/cacher.h"
+
+extern "C" {
+	#include <libavutil/frame.h>
+}
+
+#include <QThread>
+#include <QCoreApplication>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QList>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOffscreenSurface>
+#include <QDebug>
+
+class FrameUploader : public QThread {
+public:
+    FrameUploader();
+    QOpenGLContext* context;
+    QOffscreenSurface* surface;
+
+    QMutex queue_lock;
+    QWaitCondition queue_changed;
+    QWaitCondition upload_done;
+    QList<Clip*> queue;
+    Clip* uploading; // (guarded by queue_lock)
+    bool quit;
+
+    // GL 3.2/ARB_sync - NULL if there aren't any, textures the viewer's just drawn with are
+    // then reused without waiting for the draw to finish
+    PFNGLFENCESYNCPROC fence_sync;
+    PFNGLWAITSYNCPROC wait_sync;
+    PFNGLDELETESYNCPROC delete_sync;
+protected:
+    void run();
+};
+
+static FrameUploader* uploader = NULL;
+
+FrameUploader::FrameUploader() {
+    context = NULL;
+    surface = NULL;
+    uploading = NULL;
+    quit = false;
+    fence_sync = NULL;
+    wait_sync = NULL;
+    delete_sync = NULL;
+}
+
+void FrameUploader::run() {
+    if (!context->makeCurrent(surface)) {
+        qDebug() << "[ERROR] Could not make the frame uploader's context current";
+    }
+
+    queue_lock.lock();
+    while (!quit) {
+        if (queue.isEmpty()) {
+            queue_changed.wait(&queue_lock);
+            continue;
+        }
+        Clip* c = queue.takeFirst();
+        uploading = c;
+        queue_lock.unlock();
+
+        if (c->upload_fence != NULL) {
+            // the viewer may still be drawing with these textures
+            wait_sync(static_cast<GLsync>(c->upload_fence), 0, GL_TIMEOUT_IGNORED);
+            delete_sync(static_cast<GLsync>(c->upload_fence));
+            c->upload_fence = NULL;
+        }
+
+        upload_frame(c, c->staging_frame, c->staged_textures);
+        av_frame_free(&c->staging_frame);
+
+        // the viewer's context only sees the new contents once they're really there
+        context->functions()->glFinish();
+        c->upload_state.storeRelease(UPLOAD_READY);
+        notify_frame_ready(c);
+
+        queue_lock.lock();
+        uploading = NULL;
+        upload_done.wakeAll();
+    }
+    queue_lock.unlock();
+
+    context->doneCurrent();
+    context->moveToThread(qApp->thread());
+}
+
+bool init_frame_uploader(QOpenGLContext* share) {
+    if (uploader != NULL) {
+        if (uploader->context->shareGroup() == share->shareGroup()) return true;
+        shutdown_frame_uploader();
+    }
+
+    QOpenGLContext* context = new QOpenGLContext();
+    context->setFormat(share->format());
+    context->setShareContext(share);
+    if (!context->create() || !context->shareContext()) {
+        qDebug() << "[WARNING] Could not create a context for uploading frames, uploading while painting instead";
+        delete context;
+        return false;
+    }
+
+    uploader = new FrameUploader();
+    uploader->context = context;
+
+    // offscreen surfaces can only be created on the main thread
+    uploader->surface = new QOffscreenSurface();
+    uploader->surface->setFormat(context->format());
+    uploader->surface->create();
+
+    uploader->fence_sync = reinterpret_cast<PFNGLFENCESYNCPROC>(share->getProcAddress("glFenceSync"));
+    uploader->wait_sync = reinterpret_cast<PFNGLWAITSYNCPROC>(share->getProcAddress("glWaitSync"));
+    uploader->delete_sync = reinterpret_cast<PFNGLDELETESYNCPROC>(share->getProcAddress("glDeleteSync"));
+    if (uploader->fence_sync == NULL || uploader->wait_sync == NULL || uploader->delete_sync == NULL) {
+        uploader->fence_sync = NULL;
+    }
+
+    context->moveToThread(uploader);
+    uploader->start();
+    return true;
+}
+
+void shutdown_frame_uploader() {
+    if (uploader == NULL) return;
+
+    uploader->queue_lock.lock();
+    uploader->quit = true;
+    uploader->queue_changed.wakeAll();
+    uploader->queue_lock.unlock();
+    uploader->wait();
+
+    // anything still queued is dropped, its clip goes back to uploading while painting
+    for (int i=0;i<uploader->queue.size();i++) {
+        Clip* c = uploader->queue.at(i);
+        av_frame_free(&c->staging_frame);
+        c->upload_state.storeRelease(UPLOAD_IDLE);
+    }
+
+    delete uploader->context;
+    delete uploader->surface;
+    delete uploader;
+    uploader = NULL;
+}
+
+bool frame_uploader_running() {
+    return (uploader != NULL);
+}
+
+bool queue_frame_upload(Clip* c, AVFrame* f, long frame) {
+    if (c->upload_state.loadAcquire() != UPLOAD_IDLE) return false;
+
+    c->staging_frame = av_frame_clone(f);
+    if (c->staging_frame == NULL) return false;
+    c->staged_frame = frame;
+    c->upload_state.storeRelease(UPLOAD_QUEUED);
+
+    uploader->queue_lock.lock();
+    uploader->queue.append(c);
+    uploader->queue_changed.wakeOne();
+    uploader->queue_lock.unlock();
+    return true;
+}
+
+bool take_staged_frame(Clip* c, long frame) {
+    if (c->upload_state.loadAcquire() != UPLOAD_READY) return false;
+
+    bool swapped = (c->staged_frame == frame);
+    if (swapped) {
+        for (int i=0;i<3;i++) {
+            QOpenGLTexture* t = c->textures[i];
+            c->textures[i] = c->staged_textures[i];
+            c->staged_textures[i] = t;
+        }
+        c->texture_frame = frame;
+
+        // the uploader waits for draws with the textures it's just been given back to finish
+        if (uploader != NULL && uploader->fence_sync != NULL && c->staged_textures[0] != NULL) {
+            c->upload_fence = uploader->fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            QOpenGLContext::currentContext()->functions()->glFlush();
+        }
+    }
+    c->staged_frame = -1;
+    c->upload_state.storeRelease(UPLOAD_IDLE);
+    return swapped;
+}
+
+void cancel_frame_upload(Clip* c) {
+    if (uploader != NULL) {
+        uploader->queue_lock.lock();
+        if (uploader->queue.removeAll(c) > 0) {
+            av_frame_free(&c->staging_frame);
+        }
+        while (uploader->uploading == c) {
+            uploader->upload_done.wait(&uploader->queue_lock);
+        }
+        uploader->queue_lock.unlock();
+
+        if (c->upload_fence != NULL) {
+            if (QOpenGLContext::currentContext() != NULL) uploader->delete_sync(static_cast<GLsync>(c->upload_fence));
+            c->upload_fence = NULL;
+        }
+    }
+    c->staged_frame = -1;
+    c->upload_state.storeRelease(UPLOAD_IDLE);
+}
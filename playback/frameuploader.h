@@ -0,0 +1,35 @@
+#ifndef FRAMEUPLOADER_H
+#define FRAMEUPLOADER_H
+
+struct Clip;
+struct AVFrame;
+class QOpenGLContext;
+
+// copies frames into the viewer's textures on a thread of its own, with a GL context that
+// shares objects with the viewer's, so painting during playback only binds and draws. each
+// clip has one upload on its way at a time, into its staged textures, which belong to the
+// uploader until take_staged_frame() has them (see Clip::upload_state)
+
+#define UPLOAD_IDLE 0 // staged textures are free (main thread)
+#define UPLOAD_QUEUED 1 // the uploader is filling them
+#define UPLOAD_READY 2 // they hold staged_frame, waiting to be swapped in
+
+// (main thread, share's context current) starts the uploader, false if it couldn't get a
+// context. without it frames are uploaded while painting like when rendering
+bool init_frame_uploader(QOpenGLContext* share);
+void shutdown_frame_uploader();
+bool frame_uploader_running();
+
+// (main thread) has f (a new reference is taken) uploaded as frame, false if the clip already
+// has one on its way
+bool queue_frame_upload(Clip* c, AVFrame* f, long frame);
+
+// (main thread, viewer's context current) swaps the staged textures in if they hold frame,
+// otherwise drops what's in them so the next upload can go ahead
+bool take_staged_frame(Clip* c, long frame);
+
+// (any thread) drops the clip's queued upload or waits for the one in progress, so its
+// textures can be destroyed
+void cancel_frame_upload(Clip* c);
+
+#endif // FRAMEUPLOADER_H
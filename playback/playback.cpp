@@ -5,6 +5,9 @@
 #include "io/media.h"
 #include "playback/audio.h"
 #include "playback/cacher.h"
+#include "playback/framecache.h"
+#include "playback/frameuploader.h"
+#include "io/conformgenerator.h"
 #include "panels/panels.h"
 #include "panels/timeline.h"
 #include "panels/viewer.h"
@@ -15,29 +18,223 @@ extern "C" {
 	#include <libavcodec/avcodec.h>
 	#include <libswscale/swscale.h>
 	#include <libswresample/swresample.h>
+	#include <libavutil/pixdesc.h>
 }
 
-#include <QObject>
 #include <QOpenGLTexture>
 #include <QDebug>
 #include <QOpenGLPixelTransferOptions>
+#include <QOpenGLBuffer>
 
 bool texture_failed = false;
+QAtomicInt native_yuv_playback(0);
+
+long dropped_frames = 0;
+double av_offset = 0;
+long av_offset_samples = 0;
+long last_shown_frame = -1;
+
+bool viewer_supports_format(int pix_fmt) {
+    // YUV formats the viewer can upload plane by plane and convert in its shader
+    switch (pix_fmt) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUVJ422P:
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUVJ444P:
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_YUV420P10LE:
+    case AV_PIX_FMT_YUV422P10LE:
+    case AV_PIX_FMT_YUV444P10LE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+QOpenGLTexture* create_plane_texture(int width, int height, QOpenGLTexture::TextureFormat format, QOpenGLTexture::PixelFormat pixel_format) {
+    QOpenGLTexture* t = new QOpenGLTexture(QOpenGLTexture::Target2D);
+    t->setSize(width, height);
+    t->setFormat(format);
+    t->setMipLevels(1);
+    t->setAutoMipMapGenerationEnabled(false);
+    t->setMinMagFilters(QOpenGLTexture::Linear, QOpenGLTexture::Linear);
+    t->setWrapMode(QOpenGLTexture::ClampToEdge);
+    t->allocateStorage(pixel_format, QOpenGLTexture::UInt8);
+    return t;
+}
+
+void upload_plane(QOpenGLTexture* t, QOpenGLTexture::PixelFormat pixel_format, uint8_t* data, int linesize, int bytes_per_pixel) {
+    // planes are padded by FFmpeg, so tell GL how long a row really is
+    QOpenGLPixelTransferOptions options;
+    options.setAlignment(1);
+    options.setRowLength(linesize/bytes_per_pixel);
+    t->setData(0, pixel_format, QOpenGLTexture::UInt8, data, &options);
+}
+
+void upload_frame(Clip* c, AVFrame* f, QOpenGLTexture** textures) {
+    // work out how many planes this frame has and how to upload each of them
+    int plane_count;
+    int widths[3];
+    int heights[3];
+    int bytes_per_pixel[3];
+    QOpenGLTexture::TextureFormat formats[3];
+    QOpenGLTexture::PixelFormat pixel_formats[3];
+
+    if (c->pix_fmt == AV_PIX_FMT_RGBA) {
+        plane_count = 1;
+        widths[0] = f->width;
+        heights[0] = f->height;
+        bytes_per_pixel[0] = 4;
+        formats[0] = QOpenGLTexture::RGBA8_UNorm;
+        pixel_formats[0] = QOpenGLTexture::RGBA;
+    } else {
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(f->format));
+        int chroma_width = AV_CEIL_RSHIFT(f->width, desc->log2_chroma_w);
+        int chroma_height = AV_CEIL_RSHIFT(f->height, desc->log2_chroma_h);
+
+        // >8-bit samples go up as two bytes (low in luminance, high in alpha) and
+        // get put back together in the shader
+        bool high_bit_depth = (desc->comp[0].depth > 8);
+
+        plane_count = (f->format == AV_PIX_FMT_NV12) ? 2 : 3;
+        for (int i=0;i<plane_count;i++) {
+            widths[i] = (i == 0) ? f->width : chroma_width;
+            heights[i] = (i == 0) ? f->height : chroma_height;
+            if (high_bit_depth || (f->format == AV_PIX_FMT_NV12 && i == 1)) {
+                bytes_per_pixel[i] = 2;
+                formats[i] = QOpenGLTexture::LuminanceAlphaFormat;
+                pixel_formats[i] = QOpenGLTexture::LuminanceAlpha;
+            } else {
+                bytes_per_pixel[i] = 1;
+                formats[i] = QOpenGLTexture::LuminanceFormat;
+                pixel_formats[i] = QOpenGLTexture::Luminance;
+            }
+        }
+    }
+
+    if (textures[0] == NULL) {
+        for (int i=0;i<plane_count;i++) {
+            textures[i] = create_plane_texture(widths[i], heights[i], formats[i], pixel_formats[i]);
+        }
+    }
+
+    // copy the planes into a pixel buffer object so the driver can DMA them to the texture
+    // in the background instead of blocking us while it copies. the two buffers take turns
+    // so we never write into one the GPU may still be reading from
+    QOpenGLBuffer*& pbo = c->upload_buffers[c->upload_index];
+    c->upload_index = (c->upload_index + 1) % 2;
+    if (pbo == NULL) {
+        pbo = new QOpenGLBuffer(QOpenGLBuffer::PixelUnpackBuffer);
+        pbo->setUsagePattern(QOpenGLBuffer::StreamDraw);
+        pbo->create();
+    }
+
+    int offsets[3];
+    int total_size = 0;
+    for (int i=0;i<plane_count;i++) {
+        offsets[i] = total_size;
+        total_size += f->linesize[i]*heights[i];
+    }
+
+    pbo->bind();
+    pbo->allocate(total_size); // orphans the old storage rather than waiting on it
+    uchar* mapped = static_cast<uchar*>(pbo->map(QOpenGLBuffer::WriteOnly));
+    if (mapped != NULL) {
+        for (int i=0;i<plane_count;i++) {
+            memcpy(mapped+offsets[i], f->data[i], f->linesize[i]*heights[i]);
+        }
+        pbo->unmap();
+
+        // with a PBO bound, the data "pointer" is an offset into it
+        for (int i=0;i<plane_count;i++) {
+            upload_plane(textures[i], pixel_formats[i], reinterpret_cast<uint8_t*>(quintptr(offsets[i])), f->linesize[i], bytes_per_pixel[i]);
+        }
+        pbo->release();
+    } else {
+        qDebug() << "[WARNING] Could not map pixel buffer, uploading directly";
+        pbo->release();
+        for (int i=0;i<plane_count;i++) {
+            upload_plane(textures[i], pixel_formats[i], f->data[i], f->linesize[i], bytes_per_pixel[i]);
+        }
+    }
+}
+
+static bool upload_clip_frame(Clip* c, AVFrame* f, long frame) {
+    // gets a frame into the clip's textures. during playback that's the uploader's job, this
+    // returns false until it's done (the viewer's repainted once it is)
+    if (c->multithreaded && frame_uploader_running()) {
+        queue_frame_upload(c, f, frame);
+        return false;
+    }
+    upload_frame(c, f, c->textures);
+    c->texture_frame = frame;
+    return true;
+}
+
+void stage_next_frame(Clip* c) {
+    // have the uploader get the frame after the one on screen onto the GPU now, so the next
+    // paint only has to swap it in
+    if (!c->multithreaded || !frame_uploader_running()) return;
+    ClipCache& cache = c->cache;
+    int tail = cache.tail.load();
+    int head = cache.head.loadAcquire();
+    if (head - tail >= 2) {
+        int slot = (tail+1) % cache.size;
+        long frame = cache.frame_numbers[slot];
+        if (frame != c->texture_frame) {
+            queue_frame_upload(c, cache.frames[slot], frame);
+        }
+    }
+}
+
+void destroy_textures(Clip* c) {
+    cancel_frame_upload(c);
+    for (int i=0;i<3;i++) {
+        if (c->textures[i] != NULL) {
+            c->textures[i]->destroy();
+            delete c->textures[i];
+            c->textures[i] = NULL;
+        }
+        if (c->staged_textures[i] != NULL) {
+            c->staged_textures[i]->destroy();
+            delete c->staged_textures[i];
+            c->staged_textures[i] = NULL;
+        }
+    }
+    for (int i=0;i<2;i++) {
+        if (c->upload_buffers[i] != NULL) {
+            c->upload_buffers[i]->destroy();
+            delete c->upload_buffers[i];
+            c->upload_buffers[i] = NULL;
+        }
+    }
+    c->staged_frame = -1;
+}
 
 void open_clip(Clip* clip, bool multithreaded) {
     if (multithreaded) {
+        // later opens of this audio read it conformed instead of decoding and resampling it again
+        if (clip->media->audio_tracks.contains(clip->media_stream)) {
+            request_conform(clip->media, clip->sequence);
+        }
+
         if (clip->open_lock.tryLock()) {
             clip->multithreaded = true;
+            clip->finished_opening = false;
+            clip->failed_opening = false;
+            clip->open = true;
 
-            // maybe keep cacher instance in memory while clip exists for performance?
-            clip->cacher = new Cacher(clip);
-            QObject::connect(clip->cacher, SIGNAL(finished()), clip->cacher, SLOT(deleteLater()));
-
-            clip->cacher->start(QThread::LowPriority);
+            // opening is done by the clip's cacher on the worker pool
+            clip->cacher->timeline_playhead = (clip->sequence == sequence) ? panel_timeline->playhead : -1;
+            clip->cacher->caching.storeRelease(1);
+            clip->cacher->request();
         }
     } else {
         clip->multithreaded = false;
         clip->finished_opening = false;
+        clip->failed_opening = false;
         clip->open = true;
 
         open_clip_worker(clip);
@@ -46,133 +243,231 @@ void open_clip(Clip* clip, bool multithreaded) {
 
 void close_clip(Clip* clip) {
 	// destroy opengl texture in main thread
-	if (clip->texture != NULL) {
-		clip->texture->destroy();
-		clip->texture = NULL;
-	}
+	destroy_textures(clip);
 
 	if (clip->multithreaded) {
-		clip->cacher->caching = false;
-		clip->can_cache.wakeAll();
+		clip->cacher->caching.storeRelease(0);
+		clip->cacher->request();
 	} else {
 		close_clip_worker(clip);
 	}
 }
 
-void cache_clip(Clip* clip, long playhead, bool write_A, bool write_B, bool reset) {
+void cache_clip(Clip* clip, long playhead, bool reset) {
 	if (clip->multithreaded) {
+		// caller holds clip->lock, so the cacher can't be reading these right now. if a reset
+		// is still waiting to be picked up, don't let a plain top-up request overwrite it
 		clip->cacher->playhead = playhead;
-		clip->cacher->write_A = write_A;
-		clip->cacher->write_B = write_B;
-		clip->cacher->reset = reset;
+		clip->cacher->timeline_playhead = (clip->sequence == sequence) ? panel_timeline->playhead : -1;
+		clip->cacher->reset = reset || (clip->cacher->cache_pending && clip->cacher->reset);
+		clip->cacher->cache_pending = true;
 
-		clip->can_cache.wakeAll();
+		clip->cacher->request();
 	} else {
-		cache_clip_worker(clip, playhead, write_A, write_B, reset);
+		cache_clip_worker(clip, playhead, reset);
 	}
 }
 
 void get_clip_frame(Clip* c, long playhead) {
 	if (c->open) {
+		// clips are opened ahead of the playhead in either direction, show their first/last frame till then
+		playhead = qMin(playhead, c->timeline_out - 1);
 		long clip_time = seconds_to_clip_frame(c, playhead_to_seconds(c, playhead));
 
 		// do we need to update the texture?
 		if ((!c->media_stream->infinite_length && c->texture_frame != clip_time) ||
 				(c->media_stream->infinite_length && c->texture_frame == -1)) {
 			AVFrame* current_frame = NULL;
+			AVFrame* shared_frame = NULL;
 
 			// get frame data
 			if (c->media_stream->infinite_length) { // if clip is a still frame, we only need one
-				if (c->cache_A.written) {
+				if (c->cache.head.loadAcquire() > 0) {
 					// retrieve cached frame
-					current_frame = c->cache_A.frames[0];
+					current_frame = c->cache.frames[0];
 				} else if (c->multithreaded) {
 					if (c->lock.tryLock()) {
 						// grab image (multi-threaded)
-						cache_clip(c, 0, false, false, true);
+						cache_clip(c, 0, true);
 						c->lock.unlock();
 					}
 				} else {
 					// grab image (single-threaded)
 					reset_cache(c, playhead);
 				}
+			} else if (panel_timeline->scrubbing && c->multithreaded && c->media_stream->index_done.loadAcquire()) {
+				get_scrub_frame(c, clip_time);
+				return;
 			} else {
 				// keeping a RAM cache improves performance, however it's detrimental when rendering
-				// determine which cache contains the requested frame
-				bool using_cache_A = false;
-				bool using_cache_B = false;
-				AVFrame** cache = NULL;
-				long cache_offset = 0;
+				ClipCache& cache = c->cache;
+				int head = cache.head.loadAcquire();
+				int tail = cache.tail.load();
 				bool cache_needs_reset = false;
 
-				if (c->cache_A.written && clip_time >= c->cache_A.offset && clip_time < c->cache_A.offset + c->cache_size) {
-					if (c->cache_A.mutex.tryLock()) { // lock in case cacher is still writing to it
-						using_cache_A = true;
-						c->cache_A.unread = false;
-						cache = c->cache_A.frames;
-						cache_offset = c->cache_A.offset;
-						c->cache_A.mutex.unlock();
+				// when shuttling, the ring runs backwards in reverse and skips frames when going fast.
+				// it also skips if the cacher falls behind the playhead so it can catch up (any further
+				// behind than the ring holds and it's reset to the playhead instead)
+				bool reverse = (panel_timeline->playing && panel_timeline->playback_speed < 0);
+				long newest_frame = (tail == head) ? cache.read_frame - 1 : cache.frame_numbers[(head-1)%cache.size];
+				long lag = clip_time - newest_frame;
+				bool late = (panel_timeline->playing && !reverse && cache.read_frame >= 0 && lag > SKIP_FRAMES_LATE && lag <= cache.size);
+				bool skip = (panel_timeline->playing && (late || panel_timeline->playback_speed >= SKIP_FRAMES_SPEED) && c->media_stream->index_done.loadAcquire());
+				int step = reverse ? -1 : 1;
+
+				if (cache.reverse != reverse || cache.scrub) {
+					// ring is being filled in the wrong direction, or holds a frame from scrubbing
+					tail = head;
+					cache_needs_reset = true;
+				}
+
+				// frames the playhead has passed won't be needed again, free them up for the cacher
+				while (tail != head && (cache.frame_numbers[tail%cache.size] - clip_time)*step < 0) {
+					if (skip && (tail+1 == head || (cache.frame_numbers[(tail+1)%cache.size] - clip_time)*step > 0)) {
+						// with frames being skipped this may be the closest one we get, hold on to it
+						// until we know whether the next one is past the playhead
+						break;
 					}
-				} else if (c->cache_B.written && clip_time >= c->cache_B.offset && clip_time < c->cache_B.offset + c->cache_size) {
-					if (c->cache_B.mutex.tryLock()) { // lock in case cacher is still writing to it
-						using_cache_B = true;
-						c->cache_B.unread = false;
-						cache = c->cache_B.frames;
-						cache_offset = c->cache_B.offset;
-						c->cache_B.mutex.unlock();
+					cache.read_frame = cache.frame_numbers[tail%cache.size] + step;
+					tail++;
+				}
+
+				if (tail != head && !cache_needs_reset) {
+					long tail_frame = cache.frame_numbers[tail%cache.size];
+					if (tail_frame == clip_time) {
+						current_frame = cache.frames[tail%cache.size];
+					} else if ((tail_frame - clip_time)*step > 0 && cache.read_frame == clip_time) {
+						// the cacher started (or carried on) from this frame and the first one it found
+						// is past it, the stream has no frame here. show the nearest one there is
+						current_frame = cache.frames[tail%cache.size];
+					} else if ((tail_frame - clip_time)*step > 0) {
+						// cache is ahead of the playhead, we must have seeked backwards
+						tail = head;
+						cache_needs_reset = true;
+					} else if (tail+1 != head) {
+						// the frame we want was skipped, show the one just before it
+						current_frame = cache.frames[tail%cache.size];
+					} else if ((clip_time - tail_frame)*step > cache.size) {
+						// the playhead has run too far ahead of the cacher to wait for it
+						tail = head;
+						cache_needs_reset = true;
 					}
-				} else {
-					// this is technically bad, unless we just seeked
-					c->cache_A.unread = c->cache_B.unread = false;
+				} else if (!cache_needs_reset && cache.read_frame != clip_time && !(c->reached_end && (cache.read_frame - clip_time)*step < 0)) {
+					// the frame we want isn't next in line either, we must have seeked
 					cache_needs_reset = true;
 				}
 
-				if (cache != NULL) {
-					current_frame = cache[clip_time - cache_offset];
-				}
+				cache.tail.storeRelease(tail);
 
-				// determine whether we should start filling the other cache
-				if (!using_cache_A || !using_cache_B) {
+				// keep the cacher topped up
+				if (cache_needs_reset || head - tail < cache.size) {
 					if (c->lock.tryLock()) {
-						bool write_A = (!using_cache_A && !c->cache_A.unread);
-						bool write_B = (!using_cache_B && !c->cache_B.unread);
-						if (write_A || write_B) {
-							long playhead;
-							if (cache_needs_reset) {
-								// if we have no cache and need to seek, start us at the current playhead...
-								playhead = clip_time;
-							} else {
-								// ...otherwise start at the end of the current cache
-								playhead = cache_offset + c->cache_size;
-							}
-							cache_clip(c, playhead, write_A, write_B, cache_needs_reset);
+						if (cache_needs_reset) {
+							// start the cacher at the current playhead
+							cache.read_frame = clip_time;
+							cache.reverse = reverse;
+							cache.scrub = false;
 						}
+						cache.skip_frames = skip;
+						cache_clip(c, clip_time, cache_needs_reset);
 						c->lock.unlock();
 					}
 				}
-			}
 
-			if (current_frame != NULL) {
-				// set up opengl texture
-				if (c->texture == NULL) {
-					c->texture = new QOpenGLTexture(QOpenGLTexture::Target2D);
-					c->texture->setSize(c->media_stream->video_width, c->media_stream->video_height);
-					c->texture->setFormat(QOpenGLTexture::RGBA8_UNorm);
-					c->texture->setMipLevels(c->texture->maximumMipLevels());
-					c->texture->setMinMagFilters(QOpenGLTexture::Linear, QOpenGLTexture::Linear);
-					c->texture->allocateStorage(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8);
+				if (current_frame == NULL) {
+					if (c->reached_end && !cache_needs_reset) {
+						// no frames left in the file, keep showing the last one
+						c->texture_frame = clip_time;
+					} else {
+						// show the frame now if another clip of this media already decoded it
+						shared_frame = frame_cache_get(c->media, c->media_stream->file_index, c->frame_variant, clip_time);
+						current_frame = shared_frame;
+					}
 				}
+			}
 
-				c->texture->setData(0, QOpenGLTexture::RGBA, QOpenGLTexture::UInt8, current_frame->data[0]);
-				c->texture_frame = clip_time;
-			} else {
+			if (take_staged_frame(c, clip_time)) {
+				// uploaded ahead of time, it's been swapped in
+			} else if (current_frame != NULL) {
+				// YUV planes go up as they are, the viewer converts them to RGB
+				if (!upload_clip_frame(c, current_frame, clip_time)) texture_failed = true;
+			} else if (c->texture_frame != clip_time) {
 				texture_failed = true;
-				qDebug() << "[ERROR] Failed to retrieve frame from cache (R:" << clip_time << "| A:" << c->cache_A.offset << "-" << c->cache_A.offset+c->cache_size-1 << "| B:" << c->cache_B.offset << "-" << c->cache_B.offset+c->cache_size-1 << "| WA:" << c->cache_A.written << "| WB:" << c->cache_B.written << ")";
+			}
+
+			if (shared_frame != NULL) av_frame_free(&shared_frame);
+
+			if (c->texture_frame == clip_time && !c->media_stream->infinite_length) {
+				stage_next_frame(c);
 			}
 		}
 	}
 }
 
+void reset_playback_stats() {
+    dropped_frames = 0;
+    av_offset = 0;
+    av_offset_samples = 0;
+    last_shown_frame = -1;
+}
+
+void record_frame_shown(long playhead, double clock_playhead) {
+    // called by the viewer each time it's drawn a frame at normal speed
+    if (last_shown_frame >= 0 && playhead > last_shown_frame + 1) {
+        dropped_frames += playhead - last_shown_frame - 1;
+    }
+    last_shown_frame = playhead;
+
+    double offset = (clock_playhead - playhead) * 1000.0 / sequence->frame_rate;
+    av_offset = (av_offset_samples == 0) ? offset : (av_offset*3 + offset)/4;
+    av_offset_samples++;
+}
+
+void get_scrub_frame(Clip* c, long clip_time) {
+    // while the playhead's being dragged, show the nearest frame we can get quickly - the exact
+    // one if it's been decoded already, otherwise the keyframe it depends on (see scrub_video_worker)
+    ClipCache& cache = c->cache;
+    long keyframe = c->media_stream->get_keyframe_before(clip_time);
+    int head = cache.head.loadAcquire();
+    int tail = cache.tail.load();
+
+    long frame_number = clip_time;
+    AVFrame* shared_frame = frame_cache_get(c->media, c->media_stream->file_index, c->frame_variant, clip_time);
+    AVFrame* current_frame = shared_frame;
+    if (current_frame == NULL && cache.scrub && tail != head) {
+        // the cacher only ever has the one frame in the ring while scrubbing
+        long ring_frame = cache.frame_numbers[(head-1)%cache.size];
+        if (ring_frame >= keyframe && ring_frame <= clip_time) {
+            current_frame = cache.frames[(head-1)%cache.size];
+            frame_number = ring_frame;
+        }
+    }
+
+    if (current_frame == NULL) {
+        // ask for this spot, unless a request for the same keyframe is still on its way
+        bool requested = (cache.scrub && tail == head && cache.read_frame >= 0
+                          && c->media_stream->get_keyframe_before(cache.read_frame) == keyframe);
+        if (!requested && c->lock.tryLock()) {
+            cache.tail.storeRelease(head);
+            cache.read_frame = clip_time;
+            cache.reverse = false;
+            cache.skip_frames = false;
+            cache.scrub = true;
+            cache_clip(c, clip_time, true);
+            c->lock.unlock();
+        }
+
+        // keep showing the last frame, the cacher will repaint us when it has this one
+        texture_failed = true;
+    } else if (c->texture_frame != frame_number && !take_staged_frame(c, frame_number)
+               && !upload_clip_frame(c, current_frame, frame_number)) {
+        // keep showing the last frame, the uploader will repaint us when it has this one
+        texture_failed = true;
+    }
+
+    if (shared_frame != NULL) av_frame_free(&shared_frame);
+}
+
 float playhead_to_seconds(Clip* c, long playhead) {
 	// returns time in seconds
     return (qMax((long) 0, playhead - c->timeline_in) + c->clip_in)/c->sequence->frame_rate;
@@ -181,6 +476,13 @@ float playhead_to_seconds(Clip* c, long playhead) {
 long seconds_to_clip_frame(Clip* c, float seconds) {
 	// returns time as frame number (according to clip's frame rate)
 	if (c->stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+		MediaStream* ms = c->media_stream;
+		if (ms->index_done.loadAcquire()) {
+			// look the exact frame up in the index so variable frame rate footage lands correctly.
+			// allow a millisecond of slack for float rounding in the seconds we were given
+			int64_t pts = ms->frame_pts.first() + (int64_t) floor((seconds + 0.001) * AV_TIME_BASE);
+			return qMax(0L, ms->get_frame_from_pts(pts));
+		}
 		return floor(seconds*av_q2d(av_guess_frame_rate(c->formatCtx, c->stream, c->frame)));
 	} else {
 		qDebug() << "[ERROR] seconds_to_clip_frame only works on video streams";
@@ -206,7 +508,7 @@ int retrieve_next_frame(Clip* c, AVFrame* f) {
 			}
 			read_ret = av_read_frame(c->formatCtx, c->pkt);
 			c->pkt_written = true;
-		} while (read_ret >= 0 && c->pkt->stream_index != c->media_stream->file_index);
+		} while (read_ret >= 0 && c->pkt->stream_index != c->stream->index);
 
 		if (read_ret >= 0) {
 			int send_ret = avcodec_send_packet(c->codecCtx, c->pkt);
@@ -227,14 +529,64 @@ int retrieve_next_frame(Clip* c, AVFrame* f) {
 	return result;
 }
 
+#define CONFORM_BLOCK 1024 // samples handed to the effects at a time when reading conformed audio
+
+static void read_conformed_audio(Clip* c, AVFrame* output) {
+    // deinterleaves the next block of the mapping into the planar frame the effects and the mix work on
+    if (output->buf[0] == NULL || output->linesize[0] < (int) (CONFORM_BLOCK*sizeof(float))) {
+        int format = output->format;
+        uint64_t channel_layout = output->channel_layout;
+        int channels = output->channels;
+        int sample_rate = output->sample_rate;
+        av_frame_unref(output);
+        output->format = format;
+        output->channel_layout = channel_layout;
+        output->channels = channels;
+        output->sample_rate = sample_rate;
+        output->nb_samples = CONFORM_BLOCK;
+        av_frame_get_buffer(output, 0);
+    }
+
+    int channels = output->channels;
+    int nb_samples = (int) qMin((qint64) CONFORM_BLOCK, c->conform_frames - c->conform_position);
+    if (nb_samples <= 0) {
+        output->nb_samples = 0;
+        c->reached_end = true;
+        return;
+    }
+
+    const float* src = c->conform_data + c->conform_position*channels;
+    for (int i=0;i<channels;i++) {
+        float* dst = reinterpret_cast<float*>(output->extended_data[i]);
+        for (int j=0;j<nb_samples;j++) {
+            dst[j] = src[j*channels+i];
+        }
+    }
+    output->nb_samples = nb_samples;
+    output->pts = av_rescale_q(c->conform_position, av_make_q(1, output->sample_rate), c->stream->time_base);
+    c->conform_position += nb_samples;
+}
+
 void retrieve_next_frame_raw_data(Clip* c, AVFrame* output) {
     if (c->reached_end) {
         qDebug() << "[WARNING] Attempted to retrieve frame of stream with no frames left";
+    } else if (c->conform_data != NULL) {
+        read_conformed_audio(c, output);
     } else {
-        int ret = retrieve_next_frame(c, c->frame);
+        int ret = 0;
+        if (c->frame_pending) {
+            // a seek already decoded this one
+            c->frame_pending = false;
+        } else {
+            ret = retrieve_next_frame(c, c->frame);
+        }
         if (ret >= 0) {
-            if (c->stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-                sws_scale(c->sws_ctx, c->frame->data, c->frame->linesize, 0, c->stream->codecpar->height, output->data, output->linesize);
+            if (c->stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && c->pix_fmt != AV_PIX_FMT_RGBA) {
+                // the viewer converts this format itself, just keep a reference to the decoded frame
+                av_frame_unref(output);
+                av_frame_ref(output, c->frame);
+            } else if (c->stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+                sws_scale(c->sws_ctx, c->frame->data, c->frame->linesize, 0, c->frame->height, output->data, output->linesize);
             } else if (c->stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
                 output->pts = c->frame->pts;
                 ret = swr_convert_frame(c->swr_ctx, output, c->frame);
@@ -250,19 +602,43 @@ void retrieve_next_frame_raw_data(Clip* c, AVFrame* output) {
     }
 }
 
+#define LOOKAHEAD_SAFETY 2.0 // how many times the measured open/seek time to allow
+#define LOOKAHEAD_MAX 10.0 // seconds
+
+long get_lookahead(Clip* c) {
+    // a clip is opened at least a second before its in point, or earlier if its media has been
+    // slow to open and seek to. either way it's scaled up by how fast the playhead is moving
+    double prepare_time = qMax(1.0, LOOKAHEAD_SAFETY * (c->media_stream->open_cost.load() + c->media_stream->seek_cost.load()) * 0.001);
+    double speed = qMax(1, qAbs(panel_timeline->playback_speed));
+    return ceil(qMin(LOOKAHEAD_MAX, prepare_time * speed) * c->sequence->frame_rate);
+}
+
 bool is_clip_active(Clip* c, long playhead) {
-    return c->timeline_in < playhead + ceil(c->sequence->frame_rate) && c->timeline_out > playhead && c->enabled;
+    if (panel_timeline->playing && panel_timeline->playback_speed < 0) {
+        // in reverse, clips are coming up from their out points
+        return c->timeline_in <= playhead && c->timeline_out + get_lookahead(c) > playhead && c->enabled;
+    }
+    return c->timeline_in < playhead + get_lookahead(c) && c->timeline_out > playhead && c->enabled;
+}
+
+void close_active_clips(Sequence* s, bool wait) {
+    for (int i=0;i<s->clip_count();i++) {
+        Clip* c = s->get_clip(i);
+        if (c != NULL && c->open) {
+            close_clip(c);
+            if (wait && c->multithreaded) {
+                // open_lock is released once the cacher has finished closing it
+                c->open_lock.lock();
+                c->open_lock.unlock();
+            }
+        }
+    }
 }
 
 void set_sequence(Sequence* s) {
     if (sequence != NULL) {
         // clean up - close all open clips
-        for (int i=0;i<sequence->clip_count();i++) {
-            Clip* c = sequence->get_clip(i);
-            if (c != NULL && c->open) {
-                close_clip(c);
-            }
-        }
+        close_active_clips(sequence, false);
     }
     sequence = s;
     panel_timeline->update_sequence();
@@ -3,22 +3,47 @@
 
 #include <QVector>
 #include <QMutex>
+#include <QAtomicInt>
 
 struct Clip;
-struct ClipCache;
 struct Sequence;
 struct AVFrame;
+class QOpenGLTexture;
 
 extern bool texture_failed;
 
+// forward shuttle speed from which the decoder drops non-reference frames
+#define SKIP_FRAMES_SPEED 4
+
+// frames the cacher can fall behind the playhead before it drops non-reference frames to catch up
+#define SKIP_FRAMES_LATE 2
+
+// playback statistics, reset each time playback starts
+extern long dropped_frames; // frames the playhead passed without them being shown
+extern double av_offset; // msecs the picture shown is behind (positive) or ahead of the clock, averaged
+extern long av_offset_samples; // frames av_offset was measured over (0 means there's no measurement yet)
+void reset_playback_stats();
+void record_frame_shown(long playhead, double clock_playhead);
+
+// set by the viewer once its YUV shader is ready - until then every frame
+// is converted to RGBA with sws_scale. read by the cachers as clips open
+extern QAtomicInt native_yuv_playback;
+bool viewer_supports_format(int pix_fmt);
+
 void open_clip(Clip* clip, bool multithreaded);
-void cache_clip(Clip* clip, long playhead, bool write_A, bool write_B, bool reset);
+void cache_clip(Clip* clip, long playhead, bool reset);
 void close_clip(Clip* clip);
-void cache_audio_worker(Clip* c, bool write_A);
-void cache_video_worker(Clip* c, long playhead, ClipCache* cache);
+void cache_audio_worker(Clip* c);
+void cache_video_worker(Clip* c);
 void handle_media(Sequence* sequence, long playhead, bool multithreaded);
 void reset_cache(Clip* c, long target_frame);
+long get_decoded_frame_number(Clip* c, AVFrame* f, long expected);
 void get_clip_frame(Clip* c, long playhead);
+
+// copies a frame into textures (created if they're NULL) through the clip's pixel buffers, on
+// whichever thread has a context current - the frame uploader's during playback, see frameuploader.h
+void upload_frame(Clip* c, AVFrame* f, QOpenGLTexture** textures);
+void get_scrub_frame(Clip* c, long clip_time);
 float playhead_to_seconds(Clip* c, long playhead);
 long seconds_to_clip_frame(Clip* c, float seconds);
 float clip_frame_to_seconds(Clip* c, long clip_frame);
@@ -28,12 +53,8 @@ bool is_clip_active(Clip* c, long playhead);
 void get_next_audio(Clip* c, bool mix);
 void set_sequence(Sequence* s);
 
-struct ClipCacheData {
-	Clip& clip;
-	long playhead;
-	bool write_A;
-	bool write_B;
-	bool reset;
-};
+// closes every open clip so they reopen next time they're drawn, wait blocks until
+// clips closing on the worker pool have finished
+void close_active_clips(Sequence* s, bool wait);
 
 #endif // PLAYBACK_H
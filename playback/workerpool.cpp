@@ -0,0 +1,197 @@
+#include "workerpool.h"
+
+#include <QDebug>
+
+WorkerPool* worker_pool = NULL;
+
+WorkerTask::WorkerTask() {
+    auto_delete = false;
+    priority = TASK_PRIORITY_PLAYBACK;
+    pending = 0;
+}
+
+WorkerTask::~WorkerTask() {}
+
+WorkerThread::WorkerThread(WorkerPool* p, int i) : pool(p), index(i) {}
+
+void WorkerThread::run() {
+    pool->work(index);
+}
+
+WorkerPool::WorkerPool(int thread_count) {
+    quit = false;
+    next_queue = 0;
+    for (int i=0;i<TASK_PRIORITY_COUNT;i++) {
+        running[i] = 0;
+    }
+
+    // keep one worker free of background work so playback never waits behind a thumbnail
+    background_limit = qMax(1, thread_count - 1);
+
+    queues.resize(thread_count*TASK_PRIORITY_COUNT);
+    for (int i=0;i<thread_count;i++) {
+        WorkerThread* t = new WorkerThread(this, i);
+        threads.append(t);
+        t->start(QThread::LowPriority); // raised while running playback work, see execute()
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    lock.lock();
+    quit = true;
+    task_available.wakeAll();
+    lock.unlock();
+
+    for (int i=0;i<threads.size();i++) {
+        threads.at(i)->wait();
+        delete threads.at(i);
+    }
+
+    // clean up anything that never got to run
+    for (int i=0;i<queues.size();i++) {
+        for (int j=0;j<queues.at(i).size();j++) {
+            WorkerTask* task = queues.at(i).at(j);
+            task->pending--;
+            if (task->auto_delete && task->pending == 0) delete task;
+        }
+    }
+}
+
+int WorkerPool::thread_count() {
+    return threads.size();
+}
+
+int WorkerPool::current_worker() {
+    QThread* current = QThread::currentThread();
+    for (int i=0;i<threads.size();i++) {
+        if (threads.at(i) == current) return i;
+    }
+    return -1;
+}
+
+void WorkerPool::submit(WorkerTask* task, int priority) {
+    lock.lock();
+    task->priority = priority;
+    task->pending++;
+
+    // tasks submitted from a worker stay on that worker's queue, others are spread out
+    int index = current_worker();
+    if (index < 0) {
+        index = next_queue;
+        next_queue = (next_queue + 1) % threads.size();
+    }
+    queues[index*TASK_PRIORITY_COUNT+priority].append(task);
+
+    task_available.wakeAll();
+    lock.unlock();
+}
+
+void WorkerPool::wait(WorkerTask* task) {
+    lock.lock();
+    while (task->pending > 0) {
+        task_finished.wait(&lock);
+    }
+    lock.unlock();
+}
+
+bool WorkerPool::cancel(WorkerTask* task) {
+    lock.lock();
+    int removed = 0;
+    for (int i=0;i<queues.size();i++) {
+        removed += queues[i].removeAll(task);
+    }
+    task->pending -= removed;
+    bool running = (task->pending > 0);
+    if (removed > 0 && !running) {
+        task_finished.wakeAll();
+        if (task->auto_delete) delete task;
+    }
+    lock.unlock();
+    return running;
+}
+
+WorkerTask* WorkerPool::take(int index, int priority_limit) {
+    // must be called with the lock held
+    int background_running = 0;
+    for (int i=TASK_PRIORITY_PLAYBACK+1;i<TASK_PRIORITY_COUNT;i++) {
+        background_running += running[i];
+    }
+    for (int p=0;p<priority_limit;p++) {
+        if (p > TASK_PRIORITY_PLAYBACK && background_running >= background_limit) break;
+
+        // newest task from our own queue first...
+        QList<WorkerTask*>& own = queues[index*TASK_PRIORITY_COUNT+p];
+        if (!own.isEmpty()) return own.takeLast();
+
+        // ...otherwise steal the oldest task from another worker
+        for (int i=1;i<threads.size();i++) {
+            QList<WorkerTask*>& other = queues[((index+i)%threads.size())*TASK_PRIORITY_COUNT+p];
+            if (!other.isEmpty()) return other.takeFirst();
+        }
+    }
+    return NULL;
+}
+
+void WorkerPool::execute(WorkerTask* task) {
+    // must be called with the lock held, releases it while the task runs
+    int priority = task->priority;
+    running[priority]++;
+    lock.unlock();
+
+    // playback work is what the viewer's waiting on, it shouldn't lose the CPU to background
+    // work elsewhere in the system. put back afterwards, we may be yielding from a preview task
+    QThread* thread = QThread::currentThread();
+    QThread::Priority old_priority = thread->priority();
+    QThread::Priority new_priority = (priority == TASK_PRIORITY_PLAYBACK) ? QThread::NormalPriority : QThread::LowPriority;
+    if (new_priority != old_priority) thread->setPriority(new_priority);
+
+    task->run();
+
+    if (new_priority != old_priority) thread->setPriority(old_priority);
+
+    lock.lock();
+    running[priority]--;
+    task->pending--;
+    if (task->auto_delete && task->pending == 0) {
+        delete task;
+    }
+    task_finished.wakeAll();
+    task_available.wakeAll();
+}
+
+void WorkerPool::work(int index) {
+    lock.lock();
+    while (!quit) {
+        WorkerTask* task = take(index, TASK_PRIORITY_COUNT);
+        if (task == NULL) {
+            task_available.wait(&lock);
+        } else {
+            execute(task);
+        }
+    }
+    lock.unlock();
+}
+
+void WorkerPool::yield(int priority) {
+    int index = current_worker();
+    if (index < 0) return;
+
+    lock.lock();
+    WorkerTask* task;
+    while (!quit && (task = take(index, priority)) != NULL) {
+        execute(task);
+    }
+    lock.unlock();
+}
+
+void init_worker_pool() {
+    if (worker_pool == NULL) {
+        worker_pool = new WorkerPool(qMax(1, QThread::idealThreadCount()));
+        qDebug() << "[INFO] Worker pool started with" << worker_pool->thread_count() << "threads";
+    }
+}
+
+void close_worker_pool() {
+    delete worker_pool;
+    worker_pool = NULL;
+}
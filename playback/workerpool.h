@@ -0,0 +1,84 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QList>
+#include <QVector>
+
+class WorkerPool;
+
+// lower values run first
+enum TaskPriorities {
+    TASK_PRIORITY_PLAYBACK, // opening/caching clips for the viewer
+    TASK_PRIORITY_PREVIEW, // thumbnails and waveforms
+    TASK_PRIORITY_COUNT
+};
+
+class WorkerTask {
+public:
+    WorkerTask();
+    virtual ~WorkerTask();
+    virtual void run() = 0;
+
+    // if true, the pool deletes the task once it has finished running
+    bool auto_delete;
+private:
+    friend class WorkerPool;
+    int priority;
+    int pending; // times the task is queued or running (guarded by the pool's lock)
+};
+
+class WorkerThread : public QThread {
+public:
+    WorkerThread(WorkerPool* p, int i);
+    void run();
+private:
+    WorkerPool* pool;
+    int index;
+};
+
+class WorkerPool {
+public:
+    WorkerPool(int thread_count);
+    ~WorkerPool();
+
+    void submit(WorkerTask* task, int priority);
+
+    // blocks until the task is neither queued nor running
+    void wait(WorkerTask* task);
+
+    // takes the task off the queues if it hasn't started yet. returns true if it's still
+    // running somewhere (wait() for it), false if it's now neither queued nor running
+    bool cancel(WorkerTask* task);
+
+    // called periodically by long running tasks - runs any queued tasks of a higher
+    // priority on the calling thread so they don't have to wait for a free worker
+    void yield(int priority);
+
+    int thread_count();
+private:
+    friend class WorkerThread;
+    void work(int index);
+    WorkerTask* take(int index, int priority_limit);
+    void execute(WorkerTask* task);
+    int current_worker();
+
+    QVector<WorkerThread*> threads;
+    QVector< QList<WorkerTask*> > queues; // one per thread per priority
+    int running[TASK_PRIORITY_COUNT];
+    int background_limit;
+    int next_queue;
+    bool quit;
+    QMutex lock;
+    QWaitCondition task_available;
+    QWaitCondition task_finished;
+};
+
+extern WorkerPool* worker_pool;
+
+void init_worker_pool();
+void close_worker_pool();
+
+#endif // WORKERPOOL_H
@@ -5,6 +5,7 @@
 #include "io/media.h"
 #include "playback/playback.h"
 #include "playback/cacher.h"
+#include "playback/workerpool.h"
 
 #include <QDebug>
 
@@ -20,11 +21,22 @@ Clip::Clip() {
     timeline_out = 0;
     track = 0;
     undeletable = 0;
-    texture = NULL;
+    for (int i=0;i<3;i++) {
+        textures[i] = NULL;
+        staged_textures[i] = NULL;
+    }
+    upload_buffers[0] = NULL;
+    upload_buffers[1] = NULL;
+    upload_index = 0;
+    upload_state.store(0);
+    staging_frame = NULL;
+    upload_fence = NULL;
+    notify_viewer.store(0);
     opening_transition = NULL;
     closing_transition = NULL;
     media = NULL;
     pkt = new AVPacket();
+    cacher = new Cacher(this);
 }
 
 Clip* Clip::copy() {
@@ -54,30 +66,46 @@ Clip* Clip::copy() {
 }
 
 void Clip::reset() {
-    cache_size = false;
     audio_just_reset = false;
-    cache_A.offset = false;
-    cache_B.offset = false;
     open = false;
     finished_opening = false;
+    failed_opening = false;
     pkt_written = false;
-    cache_A.written = false;
-    cache_B.written = false;
-    cache_A.unread = false;
-    cache_B.unread = false;
+    frame_pending = false;
     reached_end = false;
-    reset_audio = false;
+    reset_audio.store(0);
     frame_sample_index = false;
     audio_buffer_write = false;
+    audio_writer = -1;
+    conform_file = NULL;
+    conform_data = NULL;
+    conform_frames = 0;
+    conform_position = 0;
     need_new_audio_frame = false;
 	texture_frame = -1;
+	pix_fmt = AV_PIX_FMT_RGBA;
+	frame_width = 0;
+	frame_height = 0;
+	decoder = NULL;
+	frame_variant = 0;
 	formatCtx = NULL;
 	stream = NULL;
 	codec = NULL;
 	codecCtx = NULL;
-	texture = NULL;
-	cache_A.frames = NULL;
-	cache_B.frames = NULL;
+	staged_frame = -1;
+	cache.frames = NULL;
+	cache.frame_numbers = NULL;
+	cache.size = 0;
+	cache.head.store(0);
+	cache.tail.store(0);
+	cache.pool = NULL;
+	cache.write_frame = 0;
+	cache.decode_frame = -1;
+	cache.read_frame = -1;
+	cache.reverse = false;
+	cache.skip_frames = false;
+	cache.scrub = false;
+	reverse_start = 0;
 }
 
 Clip::~Clip() {
@@ -89,6 +117,10 @@ Clip::~Clip() {
     open_lock.lock();
 	open_lock.unlock();
 
+    // a stale cacher run may still be queued on the pool
+    worker_pool->wait(cacher);
+    delete cacher;
+
     if (opening_transition != NULL) delete opening_transition;
     if (closing_transition != NULL) delete closing_transition;
 
@@ -1,11 +1,12 @@
 #ifndef CLIP_H
 #define CLIP_H
 
-#include <QWaitCondition>
 #include <QMutex>
 #include <QVector>
+#include <QAtomicInt>
 
 class Cacher;
+struct MediaDecoder;
 class Effect;
 class Transition;
 struct Sequence;
@@ -18,16 +19,29 @@ struct AVCodec;
 struct AVCodecContext;
 struct AVFrame;
 struct AVPacket;
+struct AVBufferPool;
 struct SwsContext;
 struct SwrContext;
+class QFile;
 class QOpenGLTexture;
+class QOpenGLBuffer;
 
+// single-producer/single-consumer ring of decoded frames. the cacher is the only
+// one to advance head and the main thread is the only one to advance tail, so
+// neither side ever has to lock the other out.
 struct ClipCache {
 	AVFrame** frames;
-	long offset;
-	bool written;
-	bool unread;
-	QMutex mutex;
+	long* frame_numbers;
+	int size;
+	QAtomicInt head;
+	QAtomicInt tail;
+	AVBufferPool* pool; // frame buffers, refcounted so they can be shared with the frame cache
+	long write_frame; // next frame number the cacher will write (cacher only)
+	long decode_frame; // next frame number the decoder will output, -1 if it needs a seek (cacher only)
+	long read_frame; // frame number expected at tail when the ring is empty (main thread only)
+	bool reverse; // ring is filled with descending frames (set by the main thread on reset)
+	bool skip_frames; // cacher may drop frames to keep up with fast forward (set by the main thread)
+	bool scrub; // only decode the keyframe the wanted frame depends on (set by the main thread on reset)
 };
 
 /*struct ClipPlayback {
@@ -66,7 +80,9 @@ struct Clip
     Transition* opening_transition;
     Transition* closing_transition;
 
-    // media handling
+    // media handling (formatCtx through codecCtx belong to the leased decoder)
+    MediaDecoder* decoder;
+    int frame_variant; // FRAME_VARIANT() of the frames this clip decodes, for the frame cache
     AVFormatContext* formatCtx;
     AVStream* stream;
     AVCodec* codec;
@@ -74,33 +90,55 @@ struct Clip
     AVPacket* pkt;
     AVFrame* frame;
     bool pkt_written;
+    bool frame_pending; // frame already holds the next frame to show (decoded by a seek)
     bool reached_end;
     bool open;
     bool finished_opening;
+    bool failed_opening; // the file couldn't be opened, nothing tries again until the clip's reopened
 
     // caching functions
     bool multithreaded;
     Cacher* cacher;
-    QWaitCondition can_cache;
-    quint16 cache_size;
-    ClipCache cache_A;
-    ClipCache cache_B;
+    ClipCache cache;
     QMutex lock;
     QMutex open_lock;
+    QAtomicInt notify_viewer; // viewer is waiting on this clip, the cacher repaints it once a frame lands
+
+    // reverse playback - the decoder only goes forward, so the GOP (or without an index, a chunk)
+    // up to the frame we want is decoded at once and handed out backwards (cacher only)
+    QVector<AVFrame*> reverse_frames;
+    long reverse_start;
 
     // video playback variables
     SwsContext* sws_ctx;
-    QOpenGLTexture* texture;
+    int pix_fmt; // format of the cached frames - RGBA, or YUV the viewer converts itself
+    int frame_width; // size of the cached frames, reduced by the playback resolution
+    int frame_height;
+    QOpenGLTexture* textures[3]; // RGBA frame, or Y, U and V planes (UV interleaved in [1] for NV12)
+    QOpenGLTexture* staged_textures[3]; // the next frame, uploaded ahead of time (the uploader's while upload_state is queued)
+    long staged_frame;
+    QAtomicInt upload_state; // UPLOAD_IDLE/QUEUED/READY, see frameuploader.h
+    AVFrame* staging_frame; // what the uploader's putting in staged_textures
+    void* upload_fence; // GLsync the uploader waits on before reusing textures the viewer drew with
+    QOpenGLBuffer* upload_buffers[2]; // pixel buffer objects the uploads go through
+    int upload_index;
     long texture_frame;
 
     // audio playback variables
     SwrContext* swr_ctx;
     bool need_new_audio_frame;
     int frame_sample_index;
-    int audio_buffer_write;
-    bool reset_audio;
+    qint64 audio_buffer_write;
+    int audio_writer; // this clip's writer in audio_ibuffer, -1 if it isn't mixing
+    QAtomicInt reset_audio; // the mix was cleared (or the clip just opened), the viewer's next request resets the clip's audio
     bool audio_just_reset;
     long audio_target_frame;
+
+    // the media's conformed audio, mapped and read in place of decoding (see ConformGenerator)
+    QFile* conform_file;
+    const float* conform_data; // interleaved, already in the sequence's format
+    qint64 conform_frames;
+    qint64 conform_position; // next sample to read
 };
 
 #endif // CLIP_H
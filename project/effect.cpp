@@ -42,4 +42,4 @@ void Effect::export_values(float* val, int* count) {
     qDebug() << "[ERROR] export_values MUST be overridden";
 }*/
 void Effect::process_gl(int*, int*) {}
-void Effect::process_audio(uint8_t*, int) {}
+void Effect::process_audio(float**, int, int) {}
@@ -32,7 +32,9 @@ public:
     virtual void save(QXmlStreamWriter* stream);
 
 	virtual void process_gl(int* anchor_x, int* anchor_y);
-    virtual void process_audio(quint8* samples, int nb_bytes);
+    // audio effects work on a block at a time of planar float samples (one buffer per
+    // channel), so anything worked out from their settings is done once per block
+    virtual void process_audio(float** samples, int channels, int nb_samples);
 
 public slots:
 	void field_changed();
@@ -2,6 +2,8 @@
 
 #include "panels/panels.h"
 #include "panels/timeline.h"
+#include "panels/viewer.h"
+#include "ui/viewerwidget.h"
 #include "project/sequence.h"
 
 #include <QPainter>
@@ -23,6 +25,7 @@ void set_playhead(QMouseEvent* event) {
 }
 
 void TimelineHeader::mousePressEvent(QMouseEvent* event) {
+    panel_timeline->scrubbing = true;
     set_playhead(event);
     dragging = true;
 }
@@ -35,6 +38,12 @@ void TimelineHeader::mouseReleaseEvent(QMouseEvent *) {
     dragging = false;
     panel_timeline->snapped = false;
     panel_timeline->repaint_timeline();
+
+    // swap whatever scrubbing showed for the exact frame
+    if (panel_timeline->scrubbing) {
+        panel_timeline->scrubbing = false;
+        panel_viewer->viewer_widget->update();
+    }
 }
 
 void TimelineHeader::paintEvent(QPaintEvent*) {
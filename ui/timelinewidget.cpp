@@ -1223,7 +1223,7 @@ void TimelineWidget::redraw_clips() {
             }
 
             // draw thumbnail/waveform
-            if (clip->media_stream->preview_done) {
+            if (clip->media_stream->preview_done.loadAcquire()) {
                 if (clip->track < 0) {
                     int thumb_y = clip_painter.fontMetrics().height()+CLIP_TEXT_PADDING+CLIP_TEXT_PADDING;
                     int thumb_height = clip_rect.height()-thumb_y;
@@ -1232,29 +1232,39 @@ void TimelineWidget::redraw_clips() {
                         QRect thumb_rect(thumb_x, clip_rect.y()+thumb_y, thumb_width, thumb_height);
                         clip_painter.drawImage(thumb_rect, clip->media_stream->video_preview);
                     }
-                } else if (clip_rect.height() > TRACK_MIN_HEIGHT) {
-                    int divider = clip->media_stream->audio_channels*2;
-
-                    clip_painter.setPen(QColor(80, 80, 80));
-                    int channel_height = clip_rect.height()/clip->media_stream->audio_channels;
-                    long media_length = clip->media->get_length_in_frames(clip->sequence->frame_rate);
-                    for (int i=0;i<clip_rect.width();i++) {
-                        int waveform_index = qFloor((((clip->clip_in + ((float) i/panel_timeline->zoom))/media_length) * clip->media_stream->audio_preview.size())/divider)*divider;
-
-                        for (int j=0;j<clip->media_stream->audio_channels;j++) {
-                            int mid = clip_rect.top()+channel_height*j+(channel_height/2);
-                            int offset = waveform_index+(j*2);
-
-                            if (offset >= 0 && offset < clip->media_stream->audio_preview.size()) {
-                                qint8 min = (double)clip->media_stream->audio_preview.at(offset) / 128.0 * (channel_height/2);
-                                qint8 max = (double)clip->media_stream->audio_preview.at(offset+1) / 128.0 * (channel_height/2);
-                                clip_painter.drawLine(clip_rect.left()+i, mid+min, clip_rect.left()+i, mid+max);
-                            } else {
-                                QMessageBox::critical(this, "AAAAAAAAAAAAA", "Here's that terrible, no-good bug again!!! I've stepped around it but plz report the following to Matt:\n\n" + QString::number(offset) + " vs " + QString::number(clip->media_stream->audio_preview.size()), QMessageBox::Ok);
-                                break;
-                            }
+                } else if (clip_rect.height() > TRACK_MIN_HEIGHT && clip->media_stream->waveform.channels > 0) {
+                    const Waveform& waveform = clip->media_stream->waveform;
+                    int channel_height = clip_rect.height()/waveform.channels;
+                    int half_height = channel_height/2;
+
+                    // pick the pyramid level with about one peak per pixel, so each column only combines a few peaks
+                    double samples_per_pixel = waveform.sample_rate / (clip->sequence->frame_rate * panel_timeline->zoom);
+                    double start_sample = clip->clip_in / clip->sequence->frame_rate * waveform.sample_rate;
+                    int level = waveform.get_level(samples_per_pixel);
+
+                    // only the columns that land on the pixmap
+                    int left = qMax(clip_rect.left(), 0);
+                    int right = qMin(clip_rect.left() + clip_rect.width(), clip_pixmap.width());
+                    QVector<QLine> peak_lines;
+                    QVector<QLine> rms_lines;
+                    peak_lines.reserve((right - left) * waveform.channels);
+                    rms_lines.reserve((right - left) * waveform.channels);
+                    for (int i=left;i<right;i++) {
+                        qint64 start = qFloor(start_sample + (i - clip_rect.left()) * samples_per_pixel);
+                        qint64 end = qFloor(start_sample + (i + 1 - clip_rect.left()) * samples_per_pixel);
+                        for (int j=0;j<waveform.channels;j++) {
+                            WaveformPeak peak;
+                            if (!waveform.get_peak(level, j, start, end, &peak)) break;
+                            int mid = clip_rect.top()+channel_height*j+half_height;
+                            int rms = peak.rms * half_height / 255;
+                            peak_lines.append(QLine(i, mid + peak.min * half_height / 127, i, mid + peak.max * half_height / 127));
+                            rms_lines.append(QLine(i, mid - rms, i, mid + rms));
                         }
                     }
+                    clip_painter.setPen(QColor(80, 80, 80));
+                    clip_painter.drawLines(peak_lines);
+                    clip_painter.setPen(QColor(50, 50, 50));
+                    clip_painter.drawLines(rms_lines);
                 }
             }
 
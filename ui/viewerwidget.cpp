@@ -8,20 +8,65 @@
 #include "effects/transition.h"
 #include "playback/playback.h"
 #include "playback/audio.h"
+#include "playback/frameuploader.h"
 #include "io/media.h"
+#include "io/config.h"
 #include "ui_timeline.h"
 
 #include <QDebug>
 #include <QPainter>
 #include <QtMath>
+#include <QApplication>
+#include <QThread>
 
 extern "C" {
 	#include <libavformat/avformat.h>
+	#include <libavutil/pixdesc.h>
 }
 
+// converts the planes uploaded by upload_yuv_frame() to RGB. samples wider than
+// 8 bits arrive split across luminance (low byte) and alpha (high byte)
+static const char* yuv_vertex_shader =
+        "void main() {\n"
+        "    gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+        "    gl_FrontColor = gl_Color;\n"
+        "    gl_Position = ftransform();\n"
+        "}\n";
+
+static const char* yuv_fragment_shader =
+        "uniform sampler2D y_plane;\n"
+        "uniform sampler2D u_plane;\n"
+        "uniform sampler2D v_plane;\n"
+        "uniform bool nv12;\n"
+        "uniform bool high_bit_depth;\n"
+        "uniform float bit_depth_max;\n"
+        "uniform mat3 yuv_matrix;\n"
+        "uniform vec3 yuv_offset;\n"
+        "float sample_plane(sampler2D plane, vec2 coord) {\n"
+        "    vec4 s = texture2D(plane, coord);\n"
+        "    if (high_bit_depth) return (s.r*255.0 + s.a*65280.0)/bit_depth_max;\n"
+        "    return s.r;\n"
+        "}\n"
+        "void main() {\n"
+        "    vec2 coord = gl_TexCoord[0].st;\n"
+        "    vec3 yuv;\n"
+        "    yuv.x = sample_plane(y_plane, coord);\n"
+        "    if (nv12) {\n"
+        "        vec4 uv = texture2D(u_plane, coord);\n"
+        "        yuv.y = uv.r;\n"
+        "        yuv.z = uv.a;\n"
+        "    } else {\n"
+        "        yuv.y = sample_plane(u_plane, coord);\n"
+        "        yuv.z = sample_plane(v_plane, coord);\n"
+        "    }\n"
+        "    gl_FragColor = vec4(yuv_matrix * (yuv - yuv_offset), 1.0) * gl_Color;\n"
+        "}\n";
+
 ViewerWidget::ViewerWidget(QWidget *parent) : QOpenGLWidget(parent)
 {	
     multithreaded = true;
+    yuv_program = NULL;
+    composite_buffer = NULL;
     enable_paint = true;
     force_audio = false;
     flip = false;
@@ -29,10 +74,17 @@ ViewerWidget::ViewerWidget(QWidget *parent) : QOpenGLWidget(parent)
 	QSurfaceFormat format;
 	format.setDepthBufferSize(24);
 	setFormat(format);
+}
+
+ViewerWidget::~ViewerWidget() {
+    shutdown_frame_uploader();
 
-	// error handler - retries after 200ms if we couldn't get the entire image
-    retry_timer.setInterval(250);
-	connect(&retry_timer, SIGNAL(timeout()), this, SLOT(retry()));
+    // the buffer belongs to our context, which has to be current to free it
+    if (composite_buffer != NULL) {
+        makeCurrent();
+        delete composite_buffer;
+        doneCurrent();
+    }
 }
 
 void ViewerWidget::retry() {
@@ -46,6 +98,84 @@ void ViewerWidget::initializeGL() {
     glMatrixMode(GL_PROJECTION);
     glEnable(GL_TEXTURE_2D);
     glEnable(GL_BLEND);
+
+    if (yuv_program == NULL && QOpenGLShaderProgram::hasOpenGLShaderPrograms(context())) {
+        yuv_program = new QOpenGLShaderProgram(this);
+        if (yuv_program->addShaderFromSourceCode(QOpenGLShader::Vertex, yuv_vertex_shader)
+                && yuv_program->addShaderFromSourceCode(QOpenGLShader::Fragment, yuv_fragment_shader)
+                && yuv_program->link()) {
+            native_yuv_playback.storeRelease(1);
+        } else {
+            qDebug() << "[WARNING] Could not compile YUV shader, falling back to RGBA conversion -" << yuv_program->log();
+            delete yuv_program;
+            yuv_program = NULL;
+        }
+    }
+
+    // playback uploads go through a context shared with ours (rendering calls this on its own thread)
+    if (QThread::currentThread() == qApp->thread()) {
+        init_frame_uploader(context());
+    }
+}
+
+void ViewerWidget::bind_yuv_frame(Clip* c) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(c->pix_fmt));
+    int depth = desc->comp[0].depth;
+    float max = (1 << depth) - 1;
+
+    // luma coefficients - untagged footage is assumed to be 709 if it's HD and 601 if not
+    float kr = 0.299f;
+    float kb = 0.114f;
+    int colorspace = c->stream->codecpar->color_space;
+    if (colorspace == AVCOL_SPC_BT709 || (colorspace == AVCOL_SPC_UNSPECIFIED && c->media_stream->video_height >= 720)) {
+        kr = 0.2126f;
+        kb = 0.0722f;
+    } else if (colorspace == AVCOL_SPC_BT2020_NCL || colorspace == AVCOL_SPC_BT2020_CL) {
+        kr = 0.2627f;
+        kb = 0.0593f;
+    }
+    float kg = 1.0f - kr - kb;
+
+    bool full_range = (c->stream->codecpar->color_range == AVCOL_RANGE_JPEG
+                       || c->pix_fmt == AV_PIX_FMT_YUVJ420P
+                       || c->pix_fmt == AV_PIX_FMT_YUVJ422P
+                       || c->pix_fmt == AV_PIX_FMT_YUVJ444P);
+    float y_offset = 0;
+    float y_scale = 1;
+    float c_scale = 1;
+    float c_offset = (1 << (depth-1)) / max;
+    if (!full_range) {
+        y_offset = (16 << (depth-8)) / max;
+        y_scale = max / (219 << (depth-8));
+        c_scale = max / (224 << (depth-8));
+    }
+
+    float m[] = {
+        y_scale, 0, 2*(1-kr)*c_scale,
+        y_scale, -2*kb*(1-kb)/kg*c_scale, -2*kr*(1-kr)/kg*c_scale,
+        y_scale, 2*(1-kb)*c_scale, 0
+    };
+
+    yuv_program->bind();
+    yuv_program->setUniformValue("y_plane", 0);
+    yuv_program->setUniformValue("u_plane", 1);
+    yuv_program->setUniformValue("v_plane", 2);
+    yuv_program->setUniformValue("nv12", c->pix_fmt == AV_PIX_FMT_NV12);
+    yuv_program->setUniformValue("high_bit_depth", depth > 8);
+    yuv_program->setUniformValue("bit_depth_max", max);
+    yuv_program->setUniformValue("yuv_matrix", QMatrix3x3(m));
+    yuv_program->setUniformValue("yuv_offset", QVector3D(y_offset, c_offset, c_offset));
+
+    c->textures[1]->bind(1);
+    if (c->textures[2] != NULL) c->textures[2]->bind(2);
+    c->textures[0]->bind(0, QOpenGLTexture::ResetTextureUnit);
+}
+
+void ViewerWidget::release_yuv_frame(Clip* c) {
+    c->textures[1]->release(1);
+    if (c->textures[2] != NULL) c->textures[2]->release(2);
+    c->textures[0]->release(0, QOpenGLTexture::ResetTextureUnit);
+    yuv_program->release();
 }
 
 //void ViewerWidget::resizeGL(int w, int h)
@@ -57,13 +187,28 @@ void ViewerWidget::paintEvent(QPaintEvent *e) {
 }
 
 void ViewerWidget::paintGL() {
+    // at a reduced playback resolution, clips are composited into a smaller buffer that's
+    // then stretched over the widget. rendering (not multithreaded) is always at full size
+    bool reduced = (multithreaded && playback_divider > 1);
+    if (reduced) {
+        QSize size(qMax(1, sequence->width/playback_divider), qMax(1, sequence->height/playback_divider));
+        if (composite_buffer == NULL || composite_buffer->size() != size) {
+            delete composite_buffer;
+            composite_buffer = new QOpenGLFramebufferObject(size);
+        }
+        composite_buffer->bind();
+        glViewport(0, 0, size.width(), size.height());
+    } else if (composite_buffer != NULL && playback_divider <= 1) {
+        // back at full resolution, no need to hold on to it
+        delete composite_buffer;
+        composite_buffer = NULL;
+    }
+
     bool loop = true;
     while (loop) {
         loop = false;
         texture_failed = false;
 
-        if (multithreaded) retry_timer.stop();
-
         glClear(GL_COLOR_BUFFER_BIT);
 
         current_clips.clear();
@@ -97,12 +242,22 @@ void ViewerWidget::paintGL() {
             }
         }
 
-        bool render_audio = (panel_timeline->playing || force_audio);
+        // audio is muted while shuttling at anything other than normal speed
+        bool normal_playback = (panel_timeline->playing && panel_timeline->playback_speed == 1);
+        bool render_audio = (normal_playback || force_audio);
 
         for (int i=0;i<current_clips.size();i++) {
             Clip* c = current_clips.at(i);
 
-            if (!c->finished_opening) {
+            // if this clip comes up empty its cacher repaints us once it has something new.
+            // armed before looking so a frame landing in the meantime can't be missed
+            if (multithreaded) c->notify_viewer.fetchAndStoreOrdered(1);
+            bool failed_before = texture_failed;
+            texture_failed = false;
+
+            if (c->failed_opening) {
+                // nothing to show, and waiting won't change that
+            } else if (!c->finished_opening) {
                 qDebug() << "[WARNING] Tried to display clip" << i << "but it's closed";
                 texture_failed = true;
             } else if (is_clip_active(c, panel_timeline->playhead)) {
@@ -110,10 +265,10 @@ void ViewerWidget::paintGL() {
                     // start preparing cache
                     get_clip_frame(c, panel_timeline->playhead);
 
-                    if (c->texture == NULL) {
-                        qDebug() << "[WARNING] Texture hasn't been created yet";
+                    if (c->textures[0] == NULL) {
+                        // nothing's been uploaded yet (the uploader may still be on it)
                         texture_failed = true;
-                    } else if (panel_timeline->playhead >= c->timeline_in) {
+                    } else if (panel_timeline->playhead >= c->timeline_in && panel_timeline->playhead < c->timeline_out) {
                         glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
                         glColor4f(1.0, 1.0, 1.0, 1.0);
 
@@ -149,7 +304,12 @@ void ViewerWidget::paintGL() {
                         int anchor_right = c->media_stream->video_width - anchor_x;
                         int anchor_bottom = c->media_stream->video_height - anchor_y;
 
-                        c->texture->bind();
+                        bool yuv = (c->pix_fmt != AV_PIX_FMT_RGBA);
+                        if (yuv) {
+                            bind_yuv_frame(c);
+                        } else {
+                            c->textures[0]->bind();
+                        }
 
                         glBegin(GL_QUADS);
                         glTexCoord2f(0.0, 0.0);
@@ -162,40 +322,46 @@ void ViewerWidget::paintGL() {
                         glVertex2f(-anchor_x, anchor_bottom);
                         glEnd();
 
-                        c->texture->release();
+                        if (yuv) {
+                            release_yuv_frame(c);
+                        } else {
+                            c->textures[0]->release();
+                        }
                     }
                 } else if (render_audio &&
                            c->stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO &&
                            c->lock.tryLock()) {
-                    // clip is not caching, start caching audio
-                    cache_clip(c, panel_timeline->playhead, false, false, c->reset_audio);
+                    // clip is not caching, start caching audio. a reset is only handed over along
+                    // with the playhead it's for
+                    cache_clip(c, panel_timeline->playhead, c->reset_audio.fetchAndStoreOrdered(0) != 0);
                     c->lock.unlock();
                 }
             }
+
+            if (!texture_failed) c->notify_viewer.storeRelease(0);
+            texture_failed = texture_failed || failed_before;
         }
 
-        if (panel_timeline->playing) {
-            int adjusted_read_index = audio_ibuffer_read%audio_ibuffer_size;
-            int max_write = audio_ibuffer_size - adjusted_read_index;
-            int actual_write = audio_io_device->write((const char*) audio_ibuffer+adjusted_read_index, max_write);
-            audio_ibuffer_read += actual_write;
+        if (normal_playback) {
+            // the audio thread plays the mix, meter whatever it's got through since last time
+            qint64 read_end = audio_ibuffer.get_read_position();
 
             // send samples to audio monitor cache
             if (panel_timeline->ui->audio_monitor->sample_cache_offset == -1) {
                 panel_timeline->ui->audio_monitor->sample_cache_offset = panel_timeline->playhead;
             }
             long sample_cache_playhead = panel_timeline->ui->audio_monitor->sample_cache_offset + panel_timeline->ui->audio_monitor->sample_cache.size();
-            int next_buffer_offset, buffer_offset_adjusted, i;
-            int buffer_offset = get_buffer_offset_from_frame(sample_cache_playhead);
+            qint64 next_buffer_offset;
+            int i;
+            qint64 buffer_offset = get_buffer_offset_from_frame(sample_cache_playhead);
             samples.resize(av_get_channel_layout_nb_channels(sequence->audio_layout));
             samples.fill(0);
-            while (buffer_offset < audio_ibuffer_read) {
+            while (buffer_offset < read_end) {
                 sample_cache_playhead++;
-                next_buffer_offset = qMin(get_buffer_offset_from_frame(sample_cache_playhead), audio_ibuffer_read);
+                next_buffer_offset = qMin(get_buffer_offset_from_frame(sample_cache_playhead), read_end);
                 while (buffer_offset < next_buffer_offset) {
                     for (i=0;i<samples.size();i++) {
-                        buffer_offset_adjusted = buffer_offset%audio_ibuffer_size;
-                        samples[i] = qMax(qAbs((qint16) (((audio_ibuffer[buffer_offset_adjusted+1] & 0xFF) << 8) | (audio_ibuffer[buffer_offset_adjusted] & 0xFF))), samples[i]);
+                        samples[i] = qMax(qAbs(audio_ibuffer.get_played_sample(buffer_offset)), samples[i]);
                         buffer_offset += 2;
                     }
                 }
@@ -204,23 +370,47 @@ void ViewerWidget::paintGL() {
                 }
                 buffer_offset = next_buffer_offset;
             }
-
-            memset(audio_ibuffer+adjusted_read_index, 0, actual_write);
-            if (actual_write == max_write) {
-                // got all the bytes, write again
-                actual_write = audio_io_device->write((const char*) audio_ibuffer, audio_ibuffer_size);
-                memset(audio_ibuffer, 0, actual_write);
-                audio_ibuffer_read += actual_write;
-            }
         }
 
         if (texture_failed) {
-            if (multithreaded) {
-                retry_timer.start();
-            } else {
+            // multithreaded, the clips' cachers will call retry() once they have what we're missing
+            if (!multithreaded) {
                 qDebug() << "[INFO] Texture failed - looping";
                 loop = true;
             }
+        } else if (normal_playback) {
+            // measure how far the picture we just drew is from the sound being heard
+            record_frame_shown(panel_timeline->playhead, panel_timeline->get_clock_playhead());
+
+            // refresh the viewer's readout about once a second
+            if (av_offset_samples % qMax(1, qRound(sequence->frame_rate)) == 0) {
+                panel_viewer->update_playback_stats();
+            }
         }
     }
+
+    if (reduced) {
+        glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+        glViewport(0, 0, width()*devicePixelRatio(), height()*devicePixelRatio());
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        glBlendFunc(GL_ONE, GL_ZERO);
+        glColor4f(1.0, 1.0, 1.0, 1.0);
+        glLoadIdentity();
+
+        glBindTexture(GL_TEXTURE_2D, composite_buffer->texture());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBegin(GL_QUADS);
+        glTexCoord2f(0.0, 0.0);
+        glVertex2f(-1.0, -1.0);
+        glTexCoord2f(1.0, 0.0);
+        glVertex2f(1.0, -1.0);
+        glTexCoord2f(1.0, 1.0);
+        glVertex2f(1.0, 1.0);
+        glTexCoord2f(0.0, 1.0);
+        glVertex2f(-1.0, 1.0);
+        glEnd();
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
 }
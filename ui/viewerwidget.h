@@ -5,7 +5,8 @@
 #include <QOpenGLFunctions>
 #include <QMatrix4x4>
 #include <QOpenGLTexture>
-#include <QTimer>
+#include <QOpenGLShaderProgram>
+#include <QOpenGLFramebufferObject>
 
 struct Clip;
 
@@ -16,6 +17,7 @@ class ViewerWidget : public QOpenGLWidget, public QOpenGLFunctions
 	Q_OBJECT
 public:
     ViewerWidget(QWidget *parent = 0);
+    ~ViewerWidget();
 
     bool multithreaded;
     bool force_audio;
@@ -23,15 +25,19 @@ public:
     bool flip;
     void paintGL();
     void initializeGL();
+public slots:
+    // called by the cachers once a frame the last paint was missing has landed
+    void retry();
 protected:
     void paintEvent(QPaintEvent *e);
 //    void resizeGL(int w, int h);
 private:
-	QTimer retry_timer;
+    void bind_yuv_frame(Clip* c);
+    void release_yuv_frame(Clip* c);
+    QOpenGLShaderProgram* yuv_program;
+    QOpenGLFramebufferObject* composite_buffer; // reduced playback resolution is composited here first
     QVector<Clip*> current_clips;
     QVector<qint16> samples;
-private slots:
-	void retry();
 };
 
 #endif // VIEWERWIDGET_H